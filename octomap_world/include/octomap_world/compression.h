@@ -0,0 +1,59 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_COMPRESSION_H_
+#define OCTOMAP_WORLD_COMPRESSION_H_
+
+#include <string>
+
+namespace volumetric_mapping {
+
+// LZ4 compression of serialized maps. The data is split into fixed-size
+// chunks that are compressed and decompressed independently on num_threads
+// threads. The container starts with a header that allows to detect it, so
+// compressed and uncompressed data can be told apart when reading.
+
+void compressData(const char* data, size_t size, int num_threads,
+                  std::string* output);
+
+// Whether data starts with the header of compressed data.
+bool isCompressedData(const char* data, size_t size);
+// Size of the data after decompression, which is stored in the header, or 0
+// if the header is invalid. Bounded by the size of the compressed data, so it
+// is safe to allocate.
+size_t getDecompressedSize(const char* data, size_t size);
+
+// Decompresses into output, which has to hold getDecompressedSize() bytes.
+// Returns false if the data is corrupted.
+bool decompressData(const char* data, size_t size, int num_threads,
+                    char* output);
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_COMPRESSION_H_
@@ -0,0 +1,207 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_LINEAR_OCTREE_H_
+#define OCTOMAP_WORLD_LINEAR_OCTREE_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <octomap/octomap.h>
+
+namespace volumetric_mapping {
+
+// A read-only octree without pointers, which is memory-mapped from a file and
+// queried in place, so a map is available immediately after opening it
+// instead of after rebuilding all nodes on the heap. It can also be built in
+// memory from a tree, to hold a map that no longer changes in less space.
+// The nodes are stored in breadth-first order, such that the children of a
+// node are consecutive. Instead of a child index per node, only the index of
+// the first child of every kRankBlockSize-th node is stored, and the rest are
+// counted from the child masks of the nodes in between. The log-odds are
+// stored as floats, or quantized to 8 or 16 bits. The file is in host byte
+// order.
+// Searches start from a dense index of the nodes at a fixed depth over the
+// bounding box of the map, which is built when loading, so a small map is
+// searched from close to its leaves instead of from the root.
+class LinearOctree {
+ public:
+  // Called with the smallest key, the depth and the log-odds of a leaf.
+  // Returns false to stop visiting further leaves.
+  typedef std::function<bool(const octomap::OcTreeKey&, unsigned int, float)>
+      LeafVisitor;
+
+  LinearOctree();
+  ~LinearOctree();
+
+  // Writes all nodes of the tree in the linear format, with log_odds_bits
+  // (8, 16 or 32) per log-odds value. Quantized values are spread over the
+  // clamping range of the tree, and keep their side of its occupancy
+  // threshold, so cells are classified the same as in the tree. Within the
+  // clamping range, they are at most half of getLogOddsStep() off.
+  static bool writeToFile(const octomap::OcTree& tree,
+                          unsigned int log_odds_bits,
+                          const std::string& filename);
+
+  // Maps a file written by writeToFile(). Pages are only read from disk once
+  // they are accessed.
+  bool mapFile(const std::string& filename);
+  // Builds the arrays writeToFile() would write for tree in memory instead.
+  bool build(const octomap::OcTree& tree, unsigned int log_odds_bits);
+  // Unmaps the file or frees the built arrays.
+  void clear();
+  bool isLoaded() const { return header_ != NULL; }
+  // Bytes of the mapped file or the built arrays.
+  size_t memoryUsage() const;
+
+  double getResolution() const { return header_->resolution; }
+  unsigned int getTreeDepth() const { return header_->tree_depth; }
+  size_t getNumNodes() const { return header_->num_nodes; }
+  unsigned int getLogOddsBits() const { return header_->log_odds_bits; }
+  // Difference between adjacent quantized log-odds, unused for 32 bits.
+  float getLogOddsStep() const { return header_->log_odds_step; }
+  // Depth of the nodes the index points to, or 0 if there is no index.
+  unsigned int getIndexDepth() const { return index_depth_; }
+  void getMetricMin(double* x, double* y, double* z) const;
+  void getMetricMax(double* x, double* y, double* z) const;
+
+  // Returns the log-odds of the leaf containing the cell at key, or false if
+  // the cell is unknown.
+  bool search(const octomap::OcTreeKey& key, float* log_odds) const;
+  // Like search(), but always starts from the root instead of the index, to
+  // check the index against.
+  bool searchFromRoot(const octomap::OcTreeKey& key, float* log_odds) const;
+  // Visits all leaves overlapping the key range from min_key to max_key, both
+  // inclusive, in depth-first order, until visit_leaf returns false. Sets
+  // contains_unknown if a cell of the range visited so far is not in the
+  // tree.
+  void forEachLeafInKeyRange(const octomap::OcTreeKey& min_key,
+                             const octomap::OcTreeKey& max_key,
+                             const LeafVisitor& visit_leaf,
+                             bool* contains_unknown) const;
+
+  // Recreates all nodes in tree, which has to have the same resolution and
+  // depth. Any previous contents of tree are cleared.
+  void copyToOcTree(octomap::OcTree* tree) const;
+
+ private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t tree_depth;
+    double resolution;
+    uint64_t num_nodes;
+    double metric_min[3];
+    double metric_max[3];
+    // 32 for float log-odds, or 8 or 16 for quantized log-odds of
+    // log_odds_offset + level * log_odds_step.
+    uint32_t log_odds_bits;
+    float log_odds_offset;
+    float log_odds_step;
+    uint32_t padding;
+  };
+
+  static const char kMagic[8];
+  static const uint32_t kVersion;
+  static const size_t kRankBlockSize;
+  static const size_t kNodesPerIndexEntry;
+  static const uint32_t kNoIndexNode;
+
+  // Sizes of the arrays following the header: one child mask per node, the
+  // log-odds of all nodes and the first child index of every block of
+  // kRankBlockSize nodes, each padded to 8 bytes.
+  static size_t getMasksSize(uint64_t num_nodes);
+  static size_t getLogOddsSize(uint64_t num_nodes, unsigned int log_odds_bits);
+  static size_t getRanksSize(uint64_t num_nodes);
+
+  // Fills the header and the arrays of the linear format from tree.
+  static bool buildArrays(const octomap::OcTree& tree,
+                          unsigned int log_odds_bits, Header* header,
+                          std::vector<uint8_t>* child_masks,
+                          std::vector<char>* log_odds,
+                          std::vector<uint32_t>* ranks);
+
+  // Chooses the deepest index depth whose index over the bounding box of the
+  // map has at most one entry per kNodesPerIndexEntry nodes, and fills it.
+  void buildIndex();
+  void fillIndexRecurs(uint64_t index, const octomap::OcTreeKey& node_min_key,
+                       unsigned int depth);
+  // Entry of the index containing key, or false if key is outside of it.
+  bool getIndexEntry(const octomap::OcTreeKey& key, size_t* entry) const;
+
+  // Index of child i of the node at index, which has to exist. Returns false
+  // if the children of the node are out of range, which only happens for
+  // corrupt files.
+  bool getChildIndex(uint64_t index, unsigned int i,
+                     uint64_t* child_index) const;
+  float getLogOdds(uint64_t index) const;
+  // Searches key from the node at index and depth, which has to contain it.
+  bool searchFrom(uint64_t index, unsigned int depth,
+                  const octomap::OcTreeKey& key, float* log_odds) const;
+
+  void copyNodesRecurs(uint64_t index, unsigned int depth,
+                       octomap::OcTreeNode* node, octomap::OcTree* tree) const;
+  // Returns false once visit_leaf did.
+  bool forEachLeafRecurs(uint64_t index, const octomap::OcTreeKey& node_min_key,
+                         unsigned int depth, const octomap::OcTreeKey& min_key,
+                         const octomap::OcTreeKey& max_key,
+                         const LeafVisitor& visit_leaf,
+                         bool* contains_unknown) const;
+
+  // Not copyable, since it owns the mapping or the arrays.
+  LinearOctree(const LinearOctree&) = delete;
+  LinearOctree& operator=(const LinearOctree&) = delete;
+
+  void* mapped_data_;
+  size_t mapped_size_;
+  // Arrays owned by a tree built in memory.
+  Header built_header_;
+  std::vector<uint8_t> built_child_masks_;
+  std::vector<char> built_log_odds_;
+  std::vector<uint32_t> built_ranks_;
+
+  // For every cell of index_depth_ within the bounding box of the map, the
+  // deepest node containing it at or above that depth and the depth of that
+  // node, or kNoIndexNode if the cell is unknown. Empty if there is no index.
+  unsigned int index_depth_;
+  unsigned int index_min_[3];
+  unsigned int index_size_[3];
+  std::vector<uint32_t> index_nodes_;
+  std::vector<uint8_t> index_depths_;
+  const Header* header_;
+  const uint8_t* child_masks_;
+  const void* log_odds_;
+  const uint32_t* ranks_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_LINEAR_OCTREE_H_
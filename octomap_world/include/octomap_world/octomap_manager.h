@@ -30,6 +30,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef OCTOMAP_WORLD_OCTOMAP_MANAGER_H_
 #define OCTOMAP_WORLD_OCTOMAP_MANAGER_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
@@ -39,8 +46,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <std_srvs/Empty.h>
 #include <tf/transform_listener.h>
 #include <volumetric_msgs/GetChangedPoints.h>
+#include <volumetric_msgs/GetOctomapRegion.h>
+#include <volumetric_msgs/GetSaveStatus.h>
 #include <volumetric_msgs/LoadMap.h>
 #include <volumetric_msgs/SaveMap.h>
+#include <volumetric_msgs/SaveMapAsync.h>
 #include <volumetric_msgs/SetBoxOccupancy.h>
 #include <volumetric_msgs/SetDisplayBounds.h>
 
@@ -56,15 +66,24 @@ class OctomapManager : public OctomapWorld {
 
   // By default, loads octomap parameters from the ROS parameter server.
   OctomapManager(const ros::NodeHandle& nh, const ros::NodeHandle& nh_private);
+  // Waits for all background saves to finish.
+  ~OctomapManager();
 
   void publishAll();
   void publishAllEvent(const ros::TimerEvent& e);
+  // Publishes the leaves changed since the last update, if map updates are
+  // enabled. Does nothing if there are no changes unless force is set.
+  void publishMapUpdate(bool force);
 
   // Data insertion callbacks with TF frame resolution through the listener.
   void insertDisparityImageWithTf(
       const stereo_msgs::DisparityImageConstPtr& disparity);
   void insertPointcloudWithTf(
       const sensor_msgs::PointCloud2::ConstPtr& pointcloud);
+  // Pointclouds in the world frame with the sensor origin of every point in
+  // vp_x, vp_y and vp_z, as forwarded by octomap_shard_router.
+  void insertWorldPointcloud(
+      const sensor_msgs::PointCloud2::ConstPtr& pointcloud);
 
   // Input Octomap callback.
   void octomapCallback(const octomap_msgs::Octomap& msg);
@@ -80,11 +99,23 @@ class OctomapManager : public OctomapWorld {
                           std_srvs::Empty::Response& response);
   bool getOctomapCallback(octomap_msgs::GetOctomap::Request& request,
                           octomap_msgs::GetOctomap::Response& response);
+  bool getOctomapRegionCallback(
+      volumetric_msgs::GetOctomapRegion::Request& request,
+      volumetric_msgs::GetOctomapRegion::Response& response);
 
   bool loadOctomapCallback(volumetric_msgs::LoadMap::Request& request,
                            volumetric_msgs::LoadMap::Response& response);
   bool saveOctomapCallback(volumetric_msgs::SaveMap::Request& request,
                            volumetric_msgs::SaveMap::Response& response);
+  bool saveOctomapAsyncCallback(
+      volumetric_msgs::SaveMapAsync::Request& request,
+      volumetric_msgs::SaveMapAsync::Response& response);
+  bool getSaveStatusCallback(
+      volumetric_msgs::GetSaveStatus::Request& request,
+      volumetric_msgs::GetSaveStatus::Response& response);
+  // Saves the map to octomap_file and clears the scan journal.
+  bool checkpointMapCallback(std_srvs::Empty::Request& request,
+                             std_srvs::Empty::Response& response);
   bool savePointCloudCallback(volumetric_msgs::SaveMap::Request& request,
                               volumetric_msgs::SaveMap::Response& response);
 
@@ -102,6 +133,16 @@ class OctomapManager : public OctomapWorld {
   void transformCallback(const geometry_msgs::TransformStamped& transform_msg);
 
  private:
+  // A save started by save_map_async, which writes a snapshot of the map on
+  // the save thread.
+  struct SaveJob {
+    // Released once written.
+    std::shared_ptr<OctomapWorld> snapshot;
+    std::string file_path;
+    // One of the volumetric_msgs::GetSaveStatus::Response constants.
+    std::atomic<uint8_t> status;
+  };
+
   // Sets up subscriptions based on ROS node parameters.
   void setParametersFromROS();
   void subscribe();
@@ -121,6 +162,16 @@ class OctomapManager : public OctomapWorld {
                             const ros::Time& timestamp,
                             Transformation* transform);
 
+  // Has to be called whenever the map is replaced or cleared as a whole, which
+  // is not captured by change detection. Skips a sequence number, so that
+  // replicas re-request the full map.
+  void invalidateMapUpdates();
+  // Forgets all but the last kMaxFinishedSaveJobs finished background saves.
+  void reapSaveJobs();
+  // Body of save_thread_: writes the queued saves in the order they were
+  // started, until stop_save_thread_ is set and the queue is empty.
+  void runSaveThread();
+
   ros::NodeHandle nh_;
   ros::NodeHandle nh_private_;
 
@@ -146,6 +197,7 @@ class OctomapManager : public OctomapWorld {
   ros::Subscriber left_info_sub_;
   ros::Subscriber right_info_sub_;
   ros::Subscriber pointcloud_sub_;
+  ros::Subscriber world_pointcloud_sub_;
   ros::Subscriber octomap_sub_;
 
   // Only used if use_tf_transforms_ set to false.
@@ -155,6 +207,28 @@ class OctomapManager : public OctomapWorld {
   ros::Publisher binary_map_pub_;
   ros::Publisher full_map_pub_;
 
+  // Publish incremental updates of the octomap, for OctomapReplica.
+  bool publish_map_updates_;
+  uint64_t map_update_sequence_;
+  ros::Publisher map_update_pub_;
+  // Depth of the subtrees that make up an update.
+  int map_update_subtree_depth_;
+  // With map updates, the full octomap is only published every n-th time as a
+  // keyframe.
+  int map_keyframe_interval_;
+  int num_map_publishes_;
+
+  // Whether maps from input_octomap are merged into the map instead of
+  // replacing it.
+  bool merge_input_octomaps_;
+  // Whether the map loaded on startup is frozen, for nodes that only query it.
+  bool freeze_map_;
+  // Whether load_map casts rays from the sensor origins of point clouds.
+  bool load_map_cast_rays_;
+  // Whether save_point_cloud writes one point with a size per leaf instead
+  // of one point per cell.
+  bool save_point_cloud_leaf_centers_;
+
   // Publish voxel centroids as pcl.
   ros::Publisher nearest_obstacle_pub_;
   ros::Publisher pcl_pub_;
@@ -167,8 +241,12 @@ class OctomapManager : public OctomapWorld {
   ros::ServiceServer reset_map_service_;
   ros::ServiceServer publish_all_service_;
   ros::ServiceServer get_map_service_;
+  ros::ServiceServer get_map_region_service_;
   ros::ServiceServer save_octree_service_;
+  ros::ServiceServer save_octree_async_service_;
+  ros::ServiceServer get_save_status_service_;
   ros::ServiceServer load_octree_service_;
+  ros::ServiceServer checkpoint_map_service_;
   ros::ServiceServer save_point_cloud_service_;
   ros::ServiceServer set_box_occupancy_service_;
   ros::ServiceServer set_display_bounds_service_;
@@ -189,6 +267,20 @@ class OctomapManager : public OctomapWorld {
 
   // Transform queue, used only when use_tf_transforms is false.
   std::deque<geometry_msgs::TransformStamped> transform_queue_;
+
+  // Map loaded on startup, and the checkpoint of the scan journal.
+  std::string octomap_file_;
+
+  // Background saves by job ID, and the ones not written yet in the order they
+  // were started. A single thread writes them, so saves to the same file
+  // finish in order. The queue and the stop flag are guarded by save_mutex_.
+  std::map<uint64_t, std::shared_ptr<SaveJob>> save_jobs_;
+  uint64_t next_save_job_id_;
+  std::deque<std::shared_ptr<SaveJob>> save_queue_;
+  bool stop_save_thread_;
+  std::mutex save_mutex_;
+  std::condition_variable save_condition_;
+  std::thread save_thread_;
 };
 
 }  // namespace volumetric_mapping
@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_OCTOMAP_MAP_BUILDER_H_
+#define OCTOMAP_WORLD_OCTOMAP_MAP_BUILDER_H_
+
+#include <string>
+#include <vector>
+
+#include <Eigen/StdVector>
+
+#include "octomap_world/octomap_world.h"
+
+namespace volumetric_mapping {
+
+// Builds a map offline from point cloud files with known sensor poses, as a
+// faster and deterministic alternative to replaying them through an
+// OctomapManager. The clouds are read and ray cast on num_threads threads
+// one batch ahead of their insertion, and inserted in the order given, so the
+// same input always results in the same map.
+class OctomapMapBuilder : public OctomapWorld {
+ public:
+  // A .pcd or .ply file with its points in the sensor frame.
+  struct Cloud {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    std::string filename;
+    Transformation T_G_sensor;
+  };
+  typedef std::vector<Cloud, Eigen::aligned_allocator<Cloud> > CloudVector;
+
+  explicit OctomapMapBuilder(const OctomapParameters& params);
+
+  // Reads a pose file with one line per cloud: its file name relative to
+  // cloud_directory, followed by the pose of the sensor in the world frame as
+  // x y z qx qy qz qw. Empty lines and lines starting with # are skipped.
+  static bool readPoseFile(const std::string& pose_file,
+                           const std::string& cloud_directory,
+                           CloudVector* clouds);
+
+  // Inserts all clouds in order. Returns the number of inserted points in
+  // num_points.
+  bool insertClouds(const CloudVector& clouds, size_t* num_points);
+
+ private:
+  // Cells of one cloud to be updated.
+  struct CloudUpdate {
+    CloudUpdate() : num_points(0), success(false) {}
+
+    octomap::KeySet free_cells;
+    octomap::KeySet occupied_cells;
+    size_t num_points;
+    bool success;
+  };
+
+  // Reads the cloud and casts its rays without changing the map, so it can be
+  // called from several threads while another one inserts.
+  void computeCloudUpdate(const Cloud& cloud, CloudUpdate* update) const;
+  // Computes the updates of the clouds from begin to at most
+  // begin + batch_size.
+  void computeBatchUpdates(const CloudVector& clouds, size_t begin,
+                           size_t batch_size,
+                           std::vector<CloudUpdate>* updates) const;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_OCTOMAP_MAP_BUILDER_H_
@@ -0,0 +1,132 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_OCTOMAP_OVERLAY_H_
+#define OCTOMAP_WORLD_OCTOMAP_OVERLAY_H_
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <octomap/octomap.h>
+#include <volumetric_map_base/world_base.h>
+
+#include "octomap_world/octomap_world.h"
+
+namespace volumetric_mapping {
+
+// Hypothetical edits on top of an OctomapWorld, e.g. for a planner that
+// treats unknown space in a corridor as free. Edits are recorded sparsely per
+// cell without touching the base map, and queries see the edits first and
+// the base map otherwise. The edits can be discarded, or committed to the
+// base map in time linear in their number.
+class OctomapOverlay : public WorldBase {
+ public:
+  typedef std::shared_ptr<OctomapOverlay> Ptr;
+
+  explicit OctomapOverlay(const std::shared_ptr<OctomapWorld>& base);
+  virtual ~OctomapOverlay() {}
+
+  // Same as in OctomapWorld, but only recorded in the overlay.
+  virtual void setFree(
+      const Eigen::Vector3d& position, const Eigen::Vector3d& bounding_box_size,
+      const BoundHandling& insertion_method = BoundHandling::kDefault);
+  virtual void setFree(
+      const std::vector<Eigen::Vector3d>& positions,
+      const Eigen::Vector3d& bounding_box_size,
+      const BoundHandling& insertion_method = BoundHandling::kDefault);
+  virtual void setOccupied(
+      const Eigen::Vector3d& position, const Eigen::Vector3d& bounding_box_size,
+      const BoundHandling& insertion_method = BoundHandling::kDefault);
+  virtual void setOccupied(
+      const std::vector<Eigen::Vector3d>& positions,
+      const Eigen::Vector3d& bounding_box_size,
+      const BoundHandling& insertion_method = BoundHandling::kDefault);
+
+  // Same as in OctomapWorld, including the treatment of unknown cells.
+  virtual CellStatus getCellStatusBoundingBox(
+      const Eigen::Vector3d& point,
+      const Eigen::Vector3d& bounding_box_size) const;
+  virtual CellStatus getCellStatusPoint(const Eigen::Vector3d& point) const;
+  virtual CellStatus getLineStatus(const Eigen::Vector3d& start,
+                                   const Eigen::Vector3d& end) const;
+  virtual CellStatus getLineStatusBoundingBox(
+      const Eigen::Vector3d& start, const Eigen::Vector3d& end,
+      const Eigen::Vector3d& bounding_box_size) const;
+
+  // Collision checking with the robot size of the base map.
+  virtual Eigen::Vector3d getRobotSize() const;
+  virtual bool checkCollisionWithRobot(const Eigen::Vector3d& robot_position);
+  virtual bool checkPathForCollisionsWithRobot(
+      const std::vector<Eigen::Vector3d>& robot_positions,
+      size_t* collision_index);
+
+  virtual double getResolution() const { return base_->getResolution(); }
+  virtual Eigen::Vector3d getMapCenter() const {
+    return base_->getMapCenter();
+  }
+  virtual Eigen::Vector3d getMapSize() const { return base_->getMapSize(); }
+  virtual void getMapBounds(Eigen::Vector3d* min_bound,
+                            Eigen::Vector3d* max_bound) const {
+    base_->getMapBounds(min_bound, max_bound);
+  }
+
+  // Number of cells edited.
+  size_t getNumEdits() const { return edits_.size(); }
+  // Drops all edits.
+  void discard() { edits_.clear(); }
+  // Applies all edits to the base map and drops them.
+  void commit();
+
+ private:
+  typedef std::unordered_map<octomap::OcTreeKey, float,
+                             octomap::OcTreeKey::KeyHash>
+      KeyLogOddsMap;
+
+  void setLogOddsBoundingBox(const std::vector<Eigen::Vector3d>& positions,
+                             const Eigen::Vector3d& bounding_box_size,
+                             float log_odds_value,
+                             const BoundHandling& insertion_method);
+  // Log-odds of the cell at key from the edits or the base map, or false if
+  // it is unknown in both.
+  bool searchLogOdds(const octomap::OcTreeKey& key, float* log_odds) const;
+  bool isSpeckleNode(const octomap::OcTreeKey& key) const;
+  // Whether any edit lies within the key range.
+  bool hasEditsInKeyRange(const octomap::OcTreeKey& min_key,
+                          const octomap::OcTreeKey& max_key) const;
+  bool checkSinglePoseCollision(const Eigen::Vector3d& robot_position) const;
+  CellStatus unknownStatus() const;
+
+  std::shared_ptr<OctomapWorld> base_;
+  KeyLogOddsMap edits_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_OCTOMAP_OVERLAY_H_
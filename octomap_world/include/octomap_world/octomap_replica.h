@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_OCTOMAP_REPLICA_H_
+#define OCTOMAP_WORLD_OCTOMAP_REPLICA_H_
+
+#include <glog/logging.h>
+#include <ros/ros.h>
+
+#include "octomap_world/octomap_world.h"
+
+#include <volumetric_msgs/OctomapUpdate.h>
+
+namespace volumetric_mapping {
+
+// A local copy of the map held by an OctomapManager, possibly in another
+// process. Bootstraps from the full map via the manager's get_map service, and
+// then keeps itself up to date from the incremental updates the manager
+// publishes on octomap_updates (publish_map_updates must be set on the
+// manager). Whenever an update was missed, the full map is requested again.
+// All queries of OctomapWorld run directly on the local copy.
+class OctomapReplica : public OctomapWorld {
+ public:
+  typedef std::shared_ptr<OctomapReplica> Ptr;
+
+  // Subscribes to octomap_updates and calls get_map in the nh namespace;
+  // remap both to the manager's topic and service.
+  OctomapReplica(const ros::NodeHandle& nh, const ros::NodeHandle& nh_private);
+
+  void mapUpdateCallback(const volumetric_msgs::OctomapUpdate& msg);
+
+  // Replaces the local map with the full map of the manager.
+  bool requestFullMap();
+
+  // Whether a full map has been received yet.
+  bool isInitialized() const { return initialized_; }
+  uint64_t getLastSequence() const { return last_sequence_; }
+
+ private:
+  ros::NodeHandle nh_;
+  ros::NodeHandle nh_private_;
+
+  ros::Subscriber map_update_sub_;
+  ros::ServiceClient get_map_client_;
+
+  bool initialized_;
+  // Sequence number of the last applied update.
+  uint64_t last_sequence_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_OCTOMAP_REPLICA_H_
@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_OCTOMAP_SHARD_ROUTER_H_
+#define OCTOMAP_WORLD_OCTOMAP_SHARD_ROUTER_H_
+
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <octomap_msgs/GetOctomap.h>
+#include <ros/ros.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <std_srvs/Empty.h>
+#include <tf/transform_listener.h>
+#include <volumetric_map_base/world_base.h>
+#include <volumetric_msgs/GetChangedPoints.h>
+#include <volumetric_msgs/LoadMap.h>
+#include <volumetric_msgs/SaveMap.h>
+#include <volumetric_msgs/SetBoxOccupancy.h>
+
+#include "octomap_world/octomap_world.h"
+
+namespace volumetric_mapping {
+
+// Front end of a map that is split spatially over several octomap_manager
+// processes (shards). Each shard only updates the cells within its
+// update_min_bound/update_max_bound parameters. The router transforms every
+// incoming pointcloud to the world frame once and forwards each point to the
+// shards its ray passes through, which only cast the part of the ray within
+// their bounds. Service calls are fanned out to the relevant shards, and
+// get_map merges the maps of all shards.
+// Shards are given as the list of manager node names in the `shards`
+// parameter. The router publishes to <shard>/world_pointcloud. Only TF
+// transform resolution is supported.
+class OctomapShardRouter {
+ public:
+  OctomapShardRouter(const ros::NodeHandle& nh,
+                     const ros::NodeHandle& nh_private);
+
+  void insertPointcloudWithTf(
+      const sensor_msgs::PointCloud2::ConstPtr& pointcloud);
+
+  // Service callbacks, forwarded to the shards.
+  bool resetMapCallback(std_srvs::Empty::Request& request,
+                        std_srvs::Empty::Response& response);
+  bool publishAllCallback(std_srvs::Empty::Request& request,
+                          std_srvs::Empty::Response& response);
+  // Merges the maps of all shards, each clipped to its bounds.
+  bool getOctomapCallback(octomap_msgs::GetOctomap::Request& request,
+                          octomap_msgs::GetOctomap::Response& response);
+  // Every shard saves to and loads from its own file, see getShardFilePath().
+  bool loadOctomapCallback(volumetric_msgs::LoadMap::Request& request,
+                           volumetric_msgs::LoadMap::Response& response);
+  bool saveOctomapCallback(volumetric_msgs::SaveMap::Request& request,
+                           volumetric_msgs::SaveMap::Response& response);
+  bool setBoxOccupancyCallback(
+      volumetric_msgs::SetBoxOccupancy::Request& request,
+      volumetric_msgs::SetBoxOccupancy::Response& response);
+  bool getChangedPointsCallback(
+      volumetric_msgs::GetChangedPoints::Request& request,
+      volumetric_msgs::GetChangedPoints::Response& response);
+
+ private:
+  struct Shard {
+    std::string name;
+    // Region owned by the shard.
+    Eigen::Vector3d min_bound;
+    Eigen::Vector3d max_bound;
+    // Resolution of the shard's map.
+    double resolution;
+
+    ros::Publisher pointcloud_pub;
+    ros::ServiceClient reset_map_client;
+    ros::ServiceClient publish_all_client;
+    ros::ServiceClient get_map_client;
+    ros::ServiceClient load_map_client;
+    ros::ServiceClient save_map_client;
+    ros::ServiceClient set_box_occupancy_client;
+    ros::ServiceClient get_changed_points_client;
+  };
+
+  bool setupShards();
+  void advertiseServices();
+
+  bool lookupTransformTf(const std::string& from_frame,
+                         const std::string& to_frame,
+                         const ros::Time& timestamp, Transformation* transform);
+
+  // Whether the segment from start to end passes through the box.
+  static bool segmentIntersectsBox(const Eigen::Vector3d& start,
+                                   const Eigen::Vector3d& end,
+                                   const Eigen::Vector3d& min_bound,
+                                   const Eigen::Vector3d& max_bound);
+  // Inserts the shard index before the extension: map.bt -> map_shard0.bt.
+  std::string getShardFilePath(const std::string& file_path,
+                               size_t shard_index) const;
+
+  ros::NodeHandle nh_;
+  ros::NodeHandle nh_private_;
+
+  tf::TransformListener tf_listener_;
+  std::string world_frame_;
+
+  std::vector<Shard> shards_;
+
+  ros::Subscriber pointcloud_sub_;
+
+  ros::ServiceServer reset_map_service_;
+  ros::ServiceServer publish_all_service_;
+  ros::ServiceServer get_map_service_;
+  ros::ServiceServer load_octree_service_;
+  ros::ServiceServer save_octree_service_;
+  ros::ServiceServer set_box_occupancy_service_;
+  ros::ServiceServer get_changed_points_service_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_OCTOMAP_SHARD_ROUTER_H_
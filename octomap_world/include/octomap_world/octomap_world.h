@@ -30,13 +30,20 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef OCTOMAP_WORLD_OCTOMAP_WORLD_H_
 #define OCTOMAP_WORLD_OCTOMAP_WORLD_H_
 
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 
 #include <octomap/octomap.h>
 #include <octomap_msgs/Octomap.h>
 #include <std_msgs/ColorRGBA.h>
 #include <visualization_msgs/MarkerArray.h>
 #include <volumetric_map_base/world_base.h>
+#include <volumetric_msgs/OctomapUpdate.h>
+
+#include "octomap_world/linear_octree.h"
+#include "octomap_world/scan_journal.h"
 
 namespace volumetric_mapping {
 
@@ -66,7 +73,16 @@ struct OctomapParameters {
         visualize_min_z(-std::numeric_limits<double>::max()),
         visualize_max_z(std::numeric_limits<double>::max()),
         treat_unknown_as_occupied(true),
-        change_detection_enabled(false) {
+        change_detection_enabled(false),
+        update_min_bound(Eigen::Vector3d::Constant(
+            -std::numeric_limits<double>::max())),
+        update_max_bound(
+            Eigen::Vector3d::Constant(std::numeric_limits<double>::max())),
+        compress_map_msgs(false),
+        num_threads(std::thread::hardware_concurrency()),
+        tile_depth(10),
+        journal_sync_interval(10),
+        linear_octree_log_odds_bits(32) {
     // Set reasonable defaults here...
   }
 
@@ -106,6 +122,51 @@ struct OctomapParameters {
 
   // Whether to track changes -- must be set to true to use getChangedPoints().
   bool change_detection_enabled;
+
+  // Only cells with their center in [update_min_bound, update_max_bound) are
+  // changed by sensor data and manual edits, e.g. the region owned by one
+  // shard of a sharded map.
+  Eigen::Vector3d update_min_bound;
+  Eigen::Vector3d update_max_bound;
+
+  // LZ4-compress the data of binary and full octomap messages. Compressed
+  // messages are detected and decompressed by setOctomapFromMsg().
+  bool compress_map_msgs;
+
+  // Number of threads for serializing and (de)compressing maps.
+  int num_threads;
+
+  // Depth of the tiles in the octree when writing a new tiled map store, the
+  // root being at depth 0. Tiles have an edge length of
+  // resolution * 2^(16 - tile_depth).
+  int tile_depth;
+
+  // Number of scans after which the scan journal is written and synced to
+  // disk.
+  int journal_sync_interval;
+
+  // Bits per log-odds value in maps saved as linear octrees: 32 for floats,
+  // or 16 or 8 for values quantized over the clamping range, which are
+  // classified the same but take less memory.
+  int linear_octree_log_odds_bits;
+};
+
+// Result of OctomapWorld::pruneLossy().
+struct LossyPruneReport {
+  LossyPruneReport()
+      : num_nodes_before(0),
+        num_nodes_after(0),
+        memory_before(0),
+        memory_after(0),
+        max_probability_error(0.0) {}
+
+  size_t num_nodes_before;
+  size_t num_nodes_after;
+  // Memory used by the octree in bytes.
+  size_t memory_before;
+  size_t memory_after;
+  // Largest change of the occupancy probability of any cell.
+  double max_probability_error;
 };
 
 // A wrapper around octomap that allows insertion from various ROS message
@@ -115,6 +176,8 @@ struct OctomapParameters {
 // and deserialization functions to and from ROS messages).
 class OctomapWorld : public WorldBase {
   typedef std::shared_ptr<OctomapWorld> Ptr;
+  // Resolves its queries through the protected lookups of its base map.
+  friend class OctomapOverlay;
 
  public:
   // Default constructor - creates a valid octree using parameter defaults.
@@ -123,14 +186,37 @@ class OctomapWorld : public WorldBase {
   // Creates an octomap with the correct parameters.
   OctomapWorld(const OctomapParameters& params);
 
-  // Deep copy of OctomapWorld rhs
+  // Deep copy of OctomapWorld rhs, copying the nodes of its octree directly.
   OctomapWorld(const OctomapWorld& rhs);
 
   virtual ~OctomapWorld() {}
 
   // General map management.
   void resetMap();
+  // Prunes the subtrees changed since the last prune, or the whole map if it
+  // was replaced since.
   void prune();
+  // Like prune(), but also merges children whose log-odds differ by at most
+  // log_odds_tolerance, if they are all known and either all occupied or all
+  // free. The merged node gets the middle of their range, so no cell changes
+  // by more than half the tolerance per call. report can be NULL.
+  void pruneLossy(double log_odds_tolerance, LossyPruneReport* report);
+  // Prunes the map and converts it to a pointerless linear octree in memory,
+  // with linear_octree_log_odds_bits per log-odds value, for maps that are
+  // only queried. Point, line and bounding box queries are answered from it;
+  // anything that modifies the map or iterates over its nodes converts it
+  // back first.
+  bool freeze();
+  bool isFrozen() const { return linear_octree_ != NULL; }
+  // Converts a mapped or frozen linear octree back to nodes and reads all
+  // tiles of an open tiled map store. Const methods that need the nodes do so
+  // on first use, for the part of the map they access. Such loads are
+  // serialized, but const methods reading the nodes at the same time are not:
+  // to query the map from several threads, call loadFullMap() first, or on a
+  // mapped or frozen map only use the point, line and bounding box status
+  // queries, which never load. getMapBounds() is safe in both cases, as it
+  // updates its cache under the same lock.
+  void loadFullMap() const;
   // Creates an octomap if one is not yet created or if the resolution of the
   // current varies from the parameters requested.
   void setOctomapParameters(const OctomapParameters& params);
@@ -214,15 +300,107 @@ class OctomapWorld : public WorldBase {
       const std::vector<Eigen::Vector3d>& robot_positions,
       size_t* collision_index);
 
-  // Serialization and deserialization from ROS messages.
+  // Deep copy of the map with the same parameters, e.g. to write it to disk
+  // on another thread while this map keeps changing.
+  std::shared_ptr<OctomapWorld> getSnapshot() const;
+  // Cheap copy of the map with the same parameters, e.g. for evaluating
+  // hypothetical changes or saving the map on another thread. The clone shares
+  // the octree with this map until either of them changes it, which then
+  // copies it first. A frozen or lazily loaded map is not loaded for this.
+  std::shared_ptr<OctomapWorld> getCopyOnWriteClone() const;
+  // Copies the part of the map within the bounding box into a new map with
+  // the same parameters. Subtrees within the box are copied as a whole and
+  // nodes on its border are clipped to it, so this takes time proportional to
+  // the size of the region.
+  std::shared_ptr<OctomapWorld> extractSubmap(
+      const Eigen::Vector3d& bbx_min, const Eigen::Vector3d& bbx_max) const;
+
+  // Serialization and deserialization from ROS messages. The serialized maps
+  // are cached per map version, so repeated calls without map changes in
+  // between only copy the cached message.
   bool getOctomapBinaryMsg(octomap_msgs::Octomap* msg) const;
   bool getOctomapFullMsg(octomap_msgs::Octomap* msg) const;
   // Clears the current octomap and replaces it with one from the message.
   void setOctomapFromMsg(const octomap_msgs::Octomap& msg);
+  // Fuses the log-odds of other into this map, e.g. the map of another robot.
+  // T_this_other transforms points from the frame of other into this map.
+  // Translations by whole cells between maps of the same resolution are
+  // merged node by node, and pruned nodes are only expanded where the maps
+  // differ. Any other transformation resamples other at the cell centers of
+  // this map. Ignores the update bounds.
+  void merge(const OctomapWorld& other, const Transformation& T_this_other);
+  // Serializes only the subtrees overlapping the bounding box, cut off at
+  // max_depth (0 for the full depth), into a full (log-odds) map message.
+  // Cut-off subtrees take the occupancy of their inner node, i.e., the maximum
+  // of their children. Nodes on the border of the box are clipped to it, so
+  // cells outside of it stay unknown.
+  bool getOctomapRegionMsg(const Eigen::Vector3d& center,
+                           const Eigen::Vector3d& bounding_box_size,
+                           unsigned int max_depth,
+                           octomap_msgs::Octomap* msg) const;
 
-  // Loading and writing to disk.
+  // Incremental updates -- fills the message with all subtrees at
+  // subtree_depth that contain leaves changed since the last call, and resets
+  // the change detection tracking. Can therefore not be combined with
+  // getChangedPoints().
+  // IMPORTANT NOTE: change_detection MUST be set to true in the parameters in
+  // order for this to work!
+  void getOctomapUpdateMsg(unsigned int subtree_depth,
+                           volumetric_msgs::OctomapUpdate* msg);
+  // Applies an update produced by getOctomapUpdateMsg() of a map with the same
+  // resolution. Returns false if the update does not fit this map.
+  bool applyOctomapUpdateMsg(const volumetric_msgs::OctomapUpdate& msg);
+
+  // Loading and writing to disk. Files with the .lbt extension are in the
+  // linear octree format, which is memory-mapped on loading: point, line and
+  // map bounds queries are answered from the file right away, and the map is
+  // only copied into a regular octree once anything else accesses it. Files
+  // with the .btz extension are LZ4-compressed octomap binary files, and
+  // directories with the .tiles extension are tiled map stores.
   bool loadOctomapFromFile(const std::string& filename);
   bool writeOctomapToFile(const std::string& filename);
+  // Like writeOctomapToFile(), but writes to a temporary file first and
+  // replaces filename with it once it is synced to disk, so a crash never
+  // leaves a partially written map.
+  bool writeOctomapToFileAtomically(const std::string& filename);
+
+  // Tiled map store: a directory with one file per subtree at tile_depth plus
+  // an index. Opening a store replaces the map, but tiles are only read once
+  // insertions or queries touch them. Writing to the open store only writes
+  // the tiles changed since it was opened or last written.
+  bool openTiledMapStore(const std::string& directory);
+  bool writeTiledMapStore(const std::string& directory);
+
+  // Inserts the rays from the viewpoint (vp_x, vp_y, vp_z) of every point to
+  // the point, both already in the world frame. Used by the shards of a map,
+  // which get their scans from octomap_shard_router.
+  void insertPointcloudWithOrigins(
+      const pcl::PointCloud<pcl::PointWithViewpoint>& cloud);
+
+  // Inserts the points of a .pcd or .ply file as occupied cells. The file is
+  // read in chunks while the keys of the previous chunk are computed on
+  // num_threads threads, so clouds larger than the memory can be imported.
+  // With cast_rays, the free space between every point and its sensor origin
+  // is inserted as well, which requires origins in the file (see
+  // PointCloudReader). Imported files are not written to the scan journal.
+  bool insertPointCloudFile(const std::string& filename, bool cast_rays);
+
+  // Writes the occupied cells to a binary .pcd file, or .ply file for any
+  // other extension, straight from the leaf iteration. Either every occupied
+  // cell of the map resolution is written as one point, like
+  // getOccupiedPointCloud(), or with leaf_centers only the center of every
+  // occupied leaf with its edge length in an additional "size" field.
+  bool writeOccupiedPointCloudFile(const std::string& filename,
+                                   bool leaf_centers) const;
+
+  // Scan journal: the occupancy updates of every scan inserted while it is
+  // open are appended to the journal file. Opening a journal first replays
+  // the scans it already contains onto the current map, e.g. the last saved
+  // map after a crash. Manual edits and loaded maps are not journaled.
+  bool openScanJournal(const std::string& filename);
+  void closeScanJournal();
+  // Drops all scans from the journal, once a map containing them is saved.
+  bool clearScanJournal();
 
   // Writing binary octomap to stream
   bool writeOctomapToBinaryConst(std::ostream& s) const;
@@ -249,12 +427,16 @@ class OctomapWorld : public WorldBase {
   // order for this to work!
   void getChangedPoints(std::vector<Eigen::Vector3d>* changed_points,
                         std::vector<bool>* changed_states);
-  void enableChangeDetection() { octree_->enableChangeDetection(true); }
-  void disableChangeDetection() { octree_->enableChangeDetection(false); }
+  void enableChangeDetection();
+  void disableChangeDetection();
 
   void coordToKey(const Eigen::Vector3d& coord, octomap::OcTreeKey* key) const;
   void keyToCoord(const octomap::OcTreeKey& key, Eigen::Vector3d* coord) const;
 
+  // Monotonically increasing counter that changes whenever the contents of the
+  // map (or the parameters affecting its serialization) change.
+  uint64_t getMapVersion() const { return map_version_; }
+
  protected:
   // Actual implementation for inserting disparity data.
   virtual void insertProjectedDisparityIntoMapImpl(
@@ -267,6 +449,10 @@ class OctomapWorld : public WorldBase {
 
   // Check if the node at the specified key has neighbors or not.
   bool isSpeckleNode(const octomap::OcTreeKey& key) const;
+  // getCellStatusBoundingBox() of a key range of a frozen map.
+  CellStatus getLinearOctreeStatusKeyRange(
+      const octomap::OcTreeKey& min_key,
+      const octomap::OcTreeKey& max_key) const;
 
   // Manually affect the probabilities of areas within a bounding box.
   void setLogOddsBoundingBox(
@@ -302,13 +488,156 @@ class OctomapWorld : public WorldBase {
   void castRay(const octomap::point3d& sensor_origin,
                const octomap::point3d& point, octomap::KeySet* free_cells,
                octomap::KeySet* occupied_cells);
+  // Thread-safe version with its own temporary key_ray.
+  void castRay(const octomap::point3d& sensor_origin,
+               const octomap::point3d& point, octomap::KeyRay* key_ray,
+               octomap::KeySet* free_cells,
+               octomap::KeySet* occupied_cells) const;
+  // Clips the ray from start to end to the update bounds padded by one cell.
+  // Returns false if it does not pass through them.
+  bool clipRayToUpdateBounds(octomap::point3d* start,
+                             octomap::point3d* end) const;
   void updateOccupancy(octomap::KeySet* free_cells,
                        octomap::KeySet* occupied_cells);
+  // Updates the leaves of updateOccupancy(), without journaling the scan or
+  // bumping the map version. With lazy_eval, the inner nodes are not updated
+  // either, which the caller has to do after the last update.
+  void applyOccupancyUpdate(octomap::KeySet* free_cells,
+                            octomap::KeySet* occupied_cells, bool lazy_eval);
   bool isValidPoint(const cv::Vec3f& point) const;
+  // Whether the cell at the key lies within the update bounds.
+  bool isInUpdateBounds(const octomap::OcTreeKey& key) const;
+  bool hasUpdateBounds() const;
+
+  // Log-odds of the cell at key, or false if it is unknown. Served from the
+  // linear octree if one is loaded.
+  bool searchLogOdds(const octomap::OcTreeKey& key, float* log_odds) const;
+  // Copies a loaded linear octree into octree_. Has to be called before
+  // accessing the nodes of octree_ directly. Const, since const queries which
+  // can not be answered from the linear octree need it as well.
+  void promoteLinearOctree() const;
+  // Reads the tiles of the open tiled map store that are not loaded yet,
+  // either one tile, all tiles overlapping a key range or all of them. Const
+  // for the same reason as promoteLinearOctree().
+  void loadTile(const octomap::OcTreeKey& tile_key) const;
+  void loadTilesInKeyRange(const octomap::OcTreeKey& min_key,
+                           const octomap::OcTreeKey& max_key) const;
+  void loadAllTiles() const;
+  // Marks the tiles containing the keys as changed.
+  void markTilesDirty(const octomap::KeySet& keys);
+  void markTilesDirtyInKeyRange(const octomap::OcTreeKey& min_key,
+                                const octomap::OcTreeKey& max_key);
+  // For changes all over the map, the next write rewrites all tiles.
+  void markAllTilesDirty() { all_tiles_dirty_ = true; }
+
+  // Marks the subtrees containing the keys for the next prune(). Changes
+  // through octomap's updateNode() without lazy_eval are pruned right away.
+  void markUnpruned(const octomap::KeySet& keys);
+  void markUnprunedInKeyRange(const octomap::OcTreeKey& min_key,
+                              const octomap::OcTreeKey& max_key);
+  // For changes all over the map, the next prune() prunes all of it.
+  void markAllUnpruned() { all_unpruned_ = true; }
+  // Prunes the subtree at key and depth, and then its parents as far as
+  // they become collapsible.
+  void pruneSubtree(const octomap::OcTreeKey& key, unsigned int depth);
+  void pruneRecurs(octomap::OcTreeNode* node);
+  // Helper of pruneLossy(). Returns the range of the log-odds of the cells
+  // within node from before pruning, and whether all of them are known.
+  void pruneLossyRecurs(octomap::OcTreeNode* node, float log_odds_tolerance,
+                        float* min_log_odds, float* max_log_odds, bool* full,
+                        double* max_probability_error);
+  // Detaches the map from the tiled map store, when the map gets replaced.
+  void closeTiledMapStore();
+  // Collects the keys of all tiles the subtree at node has data in.
+  void getTileKeysRecurs(const octomap::OcTreeNode* node,
+                         const octomap::OcTreeKey& node_min_key,
+                         unsigned int depth, octomap::KeySet* tile_keys) const;
+  // Key range of the cells overlapping the box, clamped to the map.
+  void getKeyRange(const Eigen::Vector3d& bbx_min,
+                   const Eigen::Vector3d& bbx_max, octomap::OcTreeKey* min_key,
+                   octomap::OcTreeKey* max_key) const;
+
+  // insertPointCloudFile() without suspending the scan journal.
+  bool insertPointCloudFileChunks(const std::string& filename, bool cast_rays);
+
+  // Writes the map to path in the format of the extension, other than .tiles.
+  bool writeOctomapToFile(const std::string& path,
+                          const std::string& extension);
+
+  // Maps a file in the linear octree format in place of the current map.
+  bool loadLinearOctreeFromFile(const std::string& filename);
+  bool loadCompressedOctomapFromFile(const std::string& filename);
+  bool writeCompressedOctomapToFile(const std::string& filename);
+  void compressOctomapMsg(octomap_msgs::Octomap* msg) const;
 
   void setOctomapFromBinaryMsg(const octomap_msgs::Octomap& msg);
   void setOctomapFromFullMsg(const octomap_msgs::Octomap& msg);
 
+  // Sets the probabilities, thresholds and change detection from params_ on
+  // the current octree.
+  void applyParametersToOctree();
+
+  // Node-level (de)serialization in the octomap full (log-odds) format.
+  void writeNodesRecurs(const octomap::OcTreeNode* node, std::ostream& s) const;
+  bool readNodesRecurs(std::istream& s, octomap::OcTreeNode* node);
+  // Like writeNodesRecurs(), but leaves out all children not overlapping the
+  // key range [min_key, max_key] and stops at max_depth. Leaves overlapping
+  // the border of the range are split up to it. node_min_key is the lowest
+  // key within the node. Returns false and writes nothing if the node has no
+  // data within the range.
+  bool writeNodesInBoxRecurs(const octomap::OcTreeNode* node,
+                             const octomap::OcTreeKey& node_min_key,
+                             unsigned int depth,
+                             const octomap::OcTreeKey& min_key,
+                             const octomap::OcTreeKey& max_key,
+                             unsigned int max_depth, std::ostream& s) const;
+  // Returns the node at key and depth without any children, creating it and
+  // its parents if necessary. Pruned parents are expanded, so the rest of the
+  // map stays the same.
+  octomap::OcTreeNode* createNodeAtDepth(const octomap::OcTreeKey& key,
+                                         unsigned int depth);
+  // Same, but keeps the children of an existing node. Sets created if the
+  // node was unknown, in which case its value is undefined.
+  octomap::OcTreeNode* getOrCreateNodeAtDepth(const octomap::OcTreeKey& key,
+                                              unsigned int depth,
+                                              bool* created);
+  // Deletes all descendants of node, which keeps its value. Unlike
+  // deleteNodeChild(), also frees their arrays of children and keeps the node
+  // count right.
+  void deleteChildren(octomap::OcTreeNode* node);
+
+  // Helpers of merge(). The subtrees of other at the depth where key_offset
+  // is aligned to the nodes are merged into the nodes of this map shifted by
+  // key_offset. node_min_key is the lowest key within other_node.
+  void mergeAlignedRecurs(const OctomapWorld& other,
+                          const octomap::OcTreeNode* other_node,
+                          const octomap::OcTreeKey& node_min_key,
+                          unsigned int depth, unsigned int align_depth,
+                          const Eigen::Vector3i& key_offset);
+  // Adds the log-odds of other_node and its children to node, which is new
+  // and unknown if unknown is set.
+  void mergeNodeRecurs(const OctomapWorld& other,
+                       const octomap::OcTreeNode* other_node,
+                       octomap::OcTreeNode* node, bool unknown);
+  void addLogOddsRecurs(float log_odds, octomap::OcTreeNode* node,
+                        bool unknown);
+  void mergeResampled(const OctomapWorld& other,
+                      const Transformation& T_this_other);
+
+  // Helpers of extractSubmap(). Copies the part of node within the key range
+  // [min_key, max_key] into submap_node of submap, where node_min_key is the
+  // lowest key within node. Returns false if there is no data in the range.
+  bool copySubmapRecurs(const octomap::OcTreeNode* node,
+                        const octomap::OcTreeKey& node_min_key,
+                        unsigned int depth, const octomap::OcTreeKey& min_key,
+                        const octomap::OcTreeKey& max_key,
+                        octomap::OcTreeNode* submap_node,
+                        OctomapWorld* submap) const;
+  // Copies node and all its children into submap_node.
+  void copyNodesRecurs(const octomap::OcTreeNode* node,
+                       octomap::OcTreeNode* submap_node,
+                       OctomapWorld* submap) const;
+
   double colorizeMapByHeight(double z, double min_z, double max_z) const;
 
   // Collision checking methods.
@@ -316,7 +645,65 @@ class OctomapWorld : public WorldBase {
 
   std_msgs::ColorRGBA percentToColor(double h) const;
 
+  // Has to be called by every method that modifies octree_, so the cached
+  // serializations get invalidated.
+  void incrementMapVersion() { ++map_version_; }
+  // Has to be called by every method before it modifies octree_, to stop
+  // sharing it with copy-on-write clones. Starts with an empty octree unless
+  // copy_nodes is set.
+  void detachOctree(bool copy_nodes);
+  // Replaces octree_ by octree, taking ownership. Large old octrees are
+  // deleted in the background, so replacing the map does not wait for it.
+  // Parameters still have to be applied to the new octree.
+  void replaceOctree(octomap::OcTree* octree);
+  // Recomputes the cached map bounds, unless they are up to date with the map
+  // version. Has to be called with lazy_load_mutex_ locked.
+  void updateMapBounds() const;
+  // Adds an inserted cell to the cached map bounds.
+  void extendMapBounds(const octomap::OcTreeKey& key);
+
+  // Can be shared with copy-on-write clones.
   std::shared_ptr<octomap::OcTree> octree_;
+  // If set, holds the map instead of octree_, which is then empty.
+  // Read-only, so it can be shared with copy-on-write clones.
+  mutable std::shared_ptr<LinearOctree> linear_octree_;
+  // Serializes the loads of const methods, see loadFullMap().
+  mutable std::recursive_mutex lazy_load_mutex_;
+
+  // Version of the map contents, and the versions the cached messages were
+  // serialized from.
+  uint64_t map_version_;
+  mutable uint64_t binary_msg_version_;
+  mutable octomap_msgs::Octomap binary_msg_cache_;
+  mutable uint64_t full_msg_version_;
+  mutable octomap_msgs::Octomap full_msg_cache_;
+
+  // Bounds of the map as the keys of its first and last cells, unless it is
+  // empty, and the map version they are up to date with. Insertions extend
+  // them, while other changes, which may remove cells, leave them to be
+  // recomputed once they are needed.
+  mutable uint64_t map_bounds_version_;
+  mutable bool map_bounds_empty_;
+  mutable octomap::OcTreeKey map_min_key_;
+  mutable octomap::OcTreeKey map_max_key_;
+
+  // Open tiled map store: its directory (empty if none), the depth of its
+  // tiles, the tiles listed in its index, the ones of those not read yet and
+  // the tiles changed since the last write.
+  std::string tile_directory_;
+  unsigned int tile_depth_;
+  octomap::KeySet stored_tiles_;
+  mutable octomap::KeySet unloaded_tiles_;
+  octomap::KeySet dirty_tiles_;
+  bool all_tiles_dirty_;
+
+  // Subtrees changed since the last prune(), at a fixed depth, or whether
+  // all of the map may have changed.
+  octomap::KeySet unpruned_subtrees_;
+  bool all_unpruned_;
+
+  // Open scan journal, if any.
+  std::unique_ptr<ScanJournal> scan_journal_;
 
   OctomapParameters params_;
 
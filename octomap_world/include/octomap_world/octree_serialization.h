@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_OCTREE_SERIALIZATION_H_
+#define OCTOMAP_WORLD_OCTREE_SERIALIZATION_H_
+
+#include <ostream>
+#include <string>
+
+#include <octomap/octomap.h>
+
+namespace volumetric_mapping {
+
+// Serialization of octrees in the octomap binary and full (log-odds) formats
+// on num_threads threads. The tree is split into the subtrees at the first
+// depth with enough of them to keep all threads busy; these are encoded
+// independently and then stitched together with the nodes above them. The
+// output is identical to that of octomap's own single-threaded writers.
+// Only encoding is parallel: the format has no offsets to find the subtrees
+// without reading everything before them, so decoding stays octomap's
+// single-threaded readBinary()/readData(). Run
+// octree_serialization_benchmark to compare against octomap's writers.
+
+// Appends the nodes as written by OcTree::writeBinaryData().
+void writeBinaryDataParallel(const octomap::OcTree& tree, int num_threads,
+                             std::string* output);
+// Appends the nodes as written by OcTree::writeData().
+void writeFullDataParallel(const octomap::OcTree& tree, int num_threads,
+                           std::string* output);
+
+// Writes a complete binary octomap file, like OcTree::writeBinaryConst().
+bool writeBinaryParallel(const octomap::OcTree& tree, int num_threads,
+                         std::ostream& s);
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_OCTREE_SERIALIZATION_H_
@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_PARALLEL_FOR_H_
+#define OCTOMAP_WORLD_PARALLEL_FOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace volumetric_mapping {
+
+// Calls function(i) for all i in [0, num_items) on up to num_threads threads.
+// Items are handed out one at a time, so items of very different cost are
+// still spread evenly over the threads.
+template <typename Function>
+void parallelFor(size_t num_items, int num_threads, const Function& function) {
+  const size_t num_workers =
+      std::min(static_cast<size_t>(std::max(num_threads, 1)), num_items);
+  if (num_workers <= 1) {
+    for (size_t i = 0; i < num_items; ++i) {
+      function(i);
+    }
+    return;
+  }
+  std::atomic<size_t> next_item(0);
+  std::vector<std::thread> workers;
+  for (size_t worker = 0; worker < num_workers; ++worker) {
+    workers.emplace_back([&function, &next_item, num_items]() {
+      for (size_t i = next_item++; i < num_items; i = next_item++) {
+        function(i);
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_PARALLEL_FOR_H_
@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_POINT_CLOUD_IO_H_
+#define OCTOMAP_WORLD_POINT_CLOUD_IO_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <octomap/octomap.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+namespace volumetric_mapping {
+
+// Reads the points of .pcd and .ply files in chunks, so clouds larger than
+// the memory can be processed. Points can come with the origin of the sensor
+// that measured them, either per point in the vp_x, vp_y and vp_z fields of
+// pcl::PointWithViewpoint, or for the whole cloud in the PCD VIEWPOINT.
+// Supports ASCII and binary PCD files, and ASCII and little endian binary PLY
+// files with the vertices as first element. Compressed binary PCD files are
+// read into memory as a whole.
+class PointCloudReader {
+ public:
+  PointCloudReader();
+
+  // Reads the header.
+  bool open(const std::string& filename);
+
+  size_t getNumPoints() const { return num_points_; }
+  bool hasOrigins() const { return has_point_origins_ || has_cloud_origin_; }
+
+  // Reads the next max_points points, and their origins if origins is not
+  // NULL and the file has them. Points with non-finite coordinates are
+  // skipped. Returns false if the file is truncated or corrupted. points is
+  // empty once all points have been read.
+  bool readPoints(size_t max_points, std::vector<octomap::point3d>* points,
+                  std::vector<octomap::point3d>* origins);
+
+ private:
+  enum class Encoding { kAscii, kBinary, kLoaded };
+  enum class ValueType {
+    kInt8,
+    kUInt8,
+    kInt16,
+    kUInt16,
+    kInt32,
+    kUInt32,
+    kFloat32,
+    kFloat64
+  };
+
+  // Field of a point in the order they are stored, with count values each.
+  struct Field {
+    std::string name;
+    ValueType type;
+    size_t count;
+  };
+  // Location of a value within a point: the byte offset in binary data, the
+  // token index in ASCII data.
+  struct ValueLocation {
+    size_t offset;
+    size_t index;
+    ValueType type;
+  };
+
+  static size_t getSize(ValueType type);
+  static bool getPcdValueType(char type, size_t size, ValueType* value_type);
+  static bool getPlyValueType(const std::string& type, ValueType* value_type);
+  static double readValue(const char* data, ValueType type);
+
+  bool readPcdHeader();
+  bool readPlyHeader();
+  // Looks up the coordinates and origins among the fields of a point.
+  bool setFields(const std::vector<Field>& fields);
+  // Parses the values of one ASCII point line into values, in the order of
+  // locations_.
+  bool parseAsciiPoint(const std::string& line, double* values) const;
+
+  std::string filename_;
+  std::ifstream file_;
+  Encoding encoding_;
+  size_t num_points_;
+  size_t num_points_read_;
+  // Bytes per point in binary data.
+  size_t point_size_;
+
+  // x, y and z, followed by vp_x, vp_y and vp_z if has_point_origins_.
+  ValueLocation locations_[6];
+  size_t num_locations_;
+  bool has_point_origins_;
+  bool has_cloud_origin_;
+  octomap::point3d cloud_origin_;
+
+  // Whole cloud, for compressed files.
+  pcl::PointCloud<pcl::PointXYZ> loaded_cloud_;
+  std::vector<char> buffer_;
+};
+
+// Writes points to binary .pcd files, or .ply files for any other extension,
+// through a buffer, so the cloud never has to be held in memory. The number
+// of points is filled into the header when closing the file.
+class PointCloudWriter {
+ public:
+  PointCloudWriter();
+  // Closes the file if it is still open.
+  ~PointCloudWriter();
+
+  // With with_sizes, every point has an additional float field "size", e.g.
+  // the edge length of the octree leaf it is the center of.
+  bool open(const std::string& filename, bool with_sizes);
+  bool close();
+
+  void addPoint(float x, float y, float z);
+  void addPoint(float x, float y, float z, float size);
+
+ private:
+  // Written with a fixed width, so it can be overwritten in place.
+  void writeCountPlaceholder();
+  void flush();
+
+  // Not copyable, since it owns the file.
+  PointCloudWriter(const PointCloudWriter&) = delete;
+  PointCloudWriter& operator=(const PointCloudWriter&) = delete;
+
+  std::string filename_;
+  std::ofstream file_;
+  bool with_sizes_;
+  size_t num_points_;
+  // Positions of the point counts in the header.
+  std::vector<std::streampos> count_positions_;
+  std::string buffer_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_POINT_CLOUD_IO_H_
@@ -0,0 +1,116 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OCTOMAP_WORLD_SCAN_JOURNAL_H_
+#define OCTOMAP_WORLD_SCAN_JOURNAL_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <octomap/octomap.h>
+
+namespace volumetric_mapping {
+
+// Append-only log of the occupancy updates of integrated scans, to recover
+// the scans since the last saved map after a crash. Every scan is stored as
+// its final free and occupied keys, so replaying it skips the ray casting.
+// Records are buffered and only written and synced to disk every
+// sync_interval scans, so a crash loses at most the last sync_interval - 1
+// scans. The file is in host byte order.
+class ScanJournal {
+ public:
+  typedef std::function<void(octomap::KeySet* free_cells,
+                             octomap::KeySet* occupied_cells)>
+      ReplayCallback;
+
+  ScanJournal();
+  // Syncs any buffered scans.
+  ~ScanJournal();
+
+  // Opens the journal for appending, creating it if it does not exist. An
+  // existing journal has to be of a map with the same resolution, and has to
+  // be replayed first to drop a partially written last scan.
+  bool open(const std::string& filename, double resolution,
+            unsigned int sync_interval);
+  void close();
+  bool isOpen() const { return fd_ >= 0; }
+
+  bool append(const octomap::KeySet& free_cells,
+              const octomap::KeySet& occupied_cells);
+  // Writes all buffered scans and waits until they are on disk.
+  bool sync();
+  // Drops all scans, once they are contained in a saved map.
+  bool clear();
+
+  // Calls callback for every scan in the journal, in the order they were
+  // appended. A last scan that was only partially written is cut off the
+  // file, so scans appended after opening it again can be replayed.
+  // Returns the number of replayed scans in num_scans.
+  static bool replay(const std::string& filename, double resolution,
+                     const ReplayCallback& callback, size_t* num_scans);
+
+ private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t padding;
+    double resolution;
+  };
+
+  struct RecordHeader {
+    uint32_t num_free;
+    uint32_t num_occupied;
+    // Checksum of the keys, to detect partially written records.
+    uint32_t checksum;
+  };
+
+  static const char kMagic[8];
+  static const uint32_t kVersion;
+
+  static uint32_t computeChecksum(const char* data, size_t size);
+  static void appendKeys(const octomap::KeySet& keys, std::string* buffer);
+  static void readKeys(const char* data, size_t num_keys,
+                       octomap::KeySet* keys);
+
+  // Not copyable, since it owns the file descriptor.
+  ScanJournal(const ScanJournal&) = delete;
+  ScanJournal& operator=(const ScanJournal&) = delete;
+
+  int fd_;
+  std::string filename_;
+  unsigned int sync_interval_;
+  // Scans appended since the last sync.
+  unsigned int num_buffered_;
+  std::string buffer_;
+};
+
+}  // namespace volumetric_mapping
+
+#endif  // OCTOMAP_WORLD_SCAN_JOURNAL_H_
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/compression.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <glog/logging.h>
+#include <lz4.h>
+
+#include "octomap_world/parallel_for.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+const char kMagic[8] = {'V', 'M', 'L', 'Z', '4', 'C', 'M', 'P'};
+const uint32_t kVersion = 1;
+// Big enough to not hurt the compression ratio, small enough to spread maps
+// of a few MB over all threads.
+const uint32_t kChunkSize = 1 << 20;
+// LZ4 can not compress data by more than this.
+const uint64_t kMaxCompressionRatio = 255;
+
+// Followed by the compressed size of every chunk as uint32_t, then by the
+// chunks themselves. All in host byte order.
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t chunk_size;
+  uint64_t num_chunks;
+  uint64_t decompressed_size;
+};
+
+// Checks the header against the size of the compressed data before anything
+// is allocated for it. The chunk count is bounded by the data holding one size
+// per chunk, and the decompressed size by the chunk count and by the maximum
+// compression ratio.
+bool isValidHeader(const Header& header, size_t size) {
+  return header.version == kVersion && header.chunk_size > 0 &&
+         header.chunk_size <= kChunkSize &&
+         header.num_chunks <= (size - sizeof(header)) / sizeof(uint32_t) &&
+         header.num_chunks ==
+             (header.decompressed_size + header.chunk_size - 1) /
+                 header.chunk_size &&
+         header.decompressed_size / kMaxCompressionRatio <= size;
+}
+
+}  // namespace
+
+void compressData(const char* data, size_t size, int num_threads,
+                  std::string* output) {
+  CHECK_NOTNULL(output);
+  const size_t num_chunks = (size + kChunkSize - 1) / kChunkSize;
+
+  std::vector<std::string> chunks(num_chunks);
+  parallelFor(num_chunks, num_threads, [&](size_t i) {
+    const size_t offset = i * kChunkSize;
+    const int chunk_size = std::min<size_t>(kChunkSize, size - offset);
+    std::string& chunk = chunks[i];
+    chunk.resize(LZ4_compressBound(chunk_size));
+    const int compressed_size = LZ4_compress_default(
+        data + offset, &chunk[0], chunk_size, static_cast<int>(chunk.size()));
+    CHECK_GT(compressed_size, 0);
+    chunk.resize(compressed_size);
+  });
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.chunk_size = kChunkSize;
+  header.num_chunks = num_chunks;
+  header.decompressed_size = size;
+
+  size_t output_size = sizeof(header) + num_chunks * sizeof(uint32_t);
+  for (const std::string& chunk : chunks) {
+    output_size += chunk.size();
+  }
+  output->clear();
+  output->reserve(output_size);
+  output->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const std::string& chunk : chunks) {
+    const uint32_t compressed_size = chunk.size();
+    output->append(reinterpret_cast<const char*>(&compressed_size),
+                   sizeof(compressed_size));
+  }
+  for (const std::string& chunk : chunks) {
+    output->append(chunk);
+  }
+}
+
+bool isCompressedData(const char* data, size_t size) {
+  return size >= sizeof(Header) && memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+size_t getDecompressedSize(const char* data, size_t size) {
+  if (!isCompressedData(data, size)) {
+    return 0;
+  }
+  Header header;
+  memcpy(&header, data, sizeof(header));
+  if (!isValidHeader(header, size)) {
+    return 0;
+  }
+  return header.decompressed_size;
+}
+
+bool decompressData(const char* data, size_t size, int num_threads,
+                    char* output) {
+  if (!isCompressedData(data, size)) {
+    LOG(ERROR) << "Data is not compressed.";
+    return false;
+  }
+  Header header;
+  memcpy(&header, data, sizeof(header));
+  if (!isValidHeader(header, size)) {
+    LOG(ERROR) << "Invalid header of compressed data.";
+    return false;
+  }
+
+  // Offsets of the chunks within data.
+  std::vector<size_t> offsets(header.num_chunks);
+  std::vector<uint32_t> compressed_sizes(header.num_chunks);
+  memcpy(compressed_sizes.data(), data + sizeof(header),
+         header.num_chunks * sizeof(uint32_t));
+  size_t offset = sizeof(header) + header.num_chunks * sizeof(uint32_t);
+  for (size_t i = 0; i < header.num_chunks; ++i) {
+    offsets[i] = offset;
+    offset += compressed_sizes[i];
+  }
+  if (offset > size) {
+    LOG(ERROR) << "Compressed data is truncated.";
+    return false;
+  }
+
+  std::atomic<bool> success(true);
+  parallelFor(header.num_chunks, num_threads, [&](size_t i) {
+    const size_t output_offset = i * header.chunk_size;
+    const int chunk_size = std::min<uint64_t>(
+        header.chunk_size, header.decompressed_size - output_offset);
+    if (LZ4_decompress_safe(data + offsets[i], output + output_offset,
+                            compressed_sizes[i], chunk_size) != chunk_size) {
+      success = false;
+    }
+  });
+  if (!success) {
+    LOG(ERROR) << "Compressed data is corrupted.";
+  }
+  return success;
+}
+
+}  // namespace volumetric_mapping
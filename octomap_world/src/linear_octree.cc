@@ -0,0 +1,649 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/linear_octree.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <queue>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace volumetric_mapping {
+
+const char LinearOctree::kMagic[8] = {'V', 'M', 'L', 'I', 'N', 'O', 'C', 'T'};
+const uint32_t LinearOctree::kVersion = 2;
+const size_t LinearOctree::kRankBlockSize = 16;
+const size_t LinearOctree::kNodesPerIndexEntry = 16;
+const uint32_t LinearOctree::kNoIndexNode =
+    std::numeric_limits<uint32_t>::max();
+
+namespace {
+
+size_t padTo8Bytes(size_t size) { return (size + 7) & ~static_cast<size_t>(7); }
+
+void writePadding(size_t size, std::ostream* stream) {
+  const char zeros[8] = {0};
+  stream->write(zeros, padTo8Bytes(size) - size);
+}
+
+}  // namespace
+
+LinearOctree::LinearOctree()
+    : mapped_data_(NULL),
+      mapped_size_(0),
+      header_(NULL),
+      child_masks_(NULL),
+      log_odds_(NULL),
+      ranks_(NULL),
+      index_depth_(0) {}
+
+LinearOctree::~LinearOctree() { clear(); }
+
+size_t LinearOctree::getMasksSize(uint64_t num_nodes) {
+  return padTo8Bytes(num_nodes);
+}
+
+size_t LinearOctree::getLogOddsSize(uint64_t num_nodes,
+                                    unsigned int log_odds_bits) {
+  return padTo8Bytes(num_nodes * (log_odds_bits / 8));
+}
+
+size_t LinearOctree::getRanksSize(uint64_t num_nodes) {
+  return padTo8Bytes((num_nodes + kRankBlockSize - 1) / kRankBlockSize *
+                     sizeof(uint32_t));
+}
+
+bool LinearOctree::buildArrays(const octomap::OcTree& tree,
+                               unsigned int log_odds_bits, Header* header,
+                               std::vector<uint8_t>* child_masks,
+                               std::vector<char>* log_odds,
+                               std::vector<uint32_t>* ranks) {
+  CHECK_NOTNULL(header);
+  CHECK_NOTNULL(child_masks);
+  CHECK_NOTNULL(log_odds);
+  CHECK_NOTNULL(ranks);
+  if (log_odds_bits != 8 && log_odds_bits != 16 && log_odds_bits != 32) {
+    LOG(ERROR) << "Unsupported number of log-odds bits " << log_odds_bits;
+    return false;
+  }
+
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, kMagic, sizeof(kMagic));
+  header->version = kVersion;
+  header->tree_depth = tree.getTreeDepth();
+  header->resolution = tree.getResolution();
+  tree.getMetricMin(header->metric_min[0], header->metric_min[1],
+                    header->metric_min[2]);
+  tree.getMetricMax(header->metric_max[0], header->metric_max[1],
+                    header->metric_max[2]);
+  header->log_odds_bits = log_odds_bits;
+
+  // Breadth-first traversal: the children of every node come right after all
+  // nodes queued so far.
+  child_masks->clear();
+  std::vector<float> float_log_odds;
+  std::queue<const octomap::OcTreeNode*> queue;
+  if (tree.getRoot() != NULL) {
+    queue.push(tree.getRoot());
+  }
+  while (!queue.empty()) {
+    const octomap::OcTreeNode* node = queue.front();
+    queue.pop();
+    uint8_t child_mask = 0;
+    for (unsigned int i = 0; i < 8; ++i) {
+      if (tree.nodeChildExists(node, i)) {
+        child_mask |= (1 << i);
+        queue.push(tree.getNodeChild(node, i));
+      }
+    }
+    child_masks->push_back(child_mask);
+    float_log_odds.push_back(node->getLogOdds());
+  }
+  header->num_nodes = child_masks->size();
+  if (header->num_nodes > std::numeric_limits<uint32_t>::max()) {
+    LOG(ERROR) << "Too many nodes for the linear octree format.";
+    return false;
+  }
+
+  log_odds->resize(float_log_odds.size() * (log_odds_bits / 8));
+  if (log_odds_bits == 32) {
+    memcpy(log_odds->data(), float_log_odds.data(), log_odds->size());
+  } else {
+    // Level k stands for threshold + (k + 0.5) * step, the center of the
+    // step above it. Occupied values get levels from 0 and free values levels
+    // below 0, and every value within the clamping range is at most half a
+    // step from its level.
+    const int max_level = (1 << (log_odds_bits - 1)) - 1;
+    const int min_level = -max_level - 1;
+    const float threshold = tree.getOccupancyThresLog();
+    const float free_range = threshold - tree.getClampingThresMinLog();
+    const float occupied_range = tree.getClampingThresMaxLog() - threshold;
+    header->log_odds_step = std::max(
+        std::max(free_range / -min_level, occupied_range / (max_level + 1)),
+        std::numeric_limits<float>::epsilon());
+    header->log_odds_offset = threshold + header->log_odds_step / 2.0f;
+    for (size_t i = 0; i < float_log_odds.size(); ++i) {
+      const float value = float_log_odds[i];
+      int level = static_cast<int>(
+          std::floor((value - threshold) / header->log_odds_step));
+      // Guards against rounding of the division right at the threshold.
+      level = value >= threshold ? std::max(level, 0) : std::min(level, -1);
+      level = std::min(std::max(level, min_level), max_level);
+      if (log_odds_bits == 16) {
+        reinterpret_cast<int16_t*>(log_odds->data())[i] = level;
+      } else {
+        reinterpret_cast<int8_t*>(log_odds->data())[i] = level;
+      }
+    }
+  }
+
+  // The root is node 0, so the children of the first node of a block start
+  // after the root and the children of all previous nodes.
+  uint32_t next_child = 1;
+  ranks->clear();
+  for (size_t i = 0; i < child_masks->size(); ++i) {
+    if (i % kRankBlockSize == 0) {
+      ranks->push_back(next_child);
+    }
+    next_child += std::bitset<8>((*child_masks)[i]).count();
+  }
+  return true;
+}
+
+bool LinearOctree::writeToFile(const octomap::OcTree& tree,
+                               unsigned int log_odds_bits,
+                               const std::string& filename) {
+  Header header;
+  std::vector<uint8_t> child_masks;
+  std::vector<char> log_odds;
+  std::vector<uint32_t> ranks;
+  if (!buildArrays(tree, log_odds_bits, &header, &child_masks, &log_odds,
+                   &ranks)) {
+    return false;
+  }
+  std::ofstream file(filename.c_str(), std::ios_base::out |
+                                           std::ios_base::binary |
+                                           std::ios_base::trunc);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open " << filename << " for writing.";
+    return false;
+  }
+
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(child_masks.data()),
+             child_masks.size());
+  writePadding(child_masks.size(), &file);
+  file.write(log_odds.data(), log_odds.size());
+  writePadding(log_odds.size(), &file);
+  file.write(reinterpret_cast<const char*>(ranks.data()),
+             ranks.size() * sizeof(uint32_t));
+  writePadding(ranks.size() * sizeof(uint32_t), &file);
+
+  file.close();
+  if (file.fail()) {
+    LOG(ERROR) << "Could not write linear octree to " << filename;
+    return false;
+  }
+  return true;
+}
+
+bool LinearOctree::build(const octomap::OcTree& tree,
+                         unsigned int log_odds_bits) {
+  clear();
+  if (!buildArrays(tree, log_odds_bits, &built_header_, &built_child_masks_,
+                   &built_log_odds_, &built_ranks_)) {
+    clear();
+    return false;
+  }
+  header_ = &built_header_;
+  child_masks_ = built_child_masks_.data();
+  log_odds_ = built_log_odds_.data();
+  ranks_ = built_ranks_.data();
+  buildIndex();
+  return true;
+}
+
+bool LinearOctree::mapFile(const std::string& filename) {
+  clear();
+
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not open " << filename;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      static_cast<size_t>(file_stat.st_size) < sizeof(Header)) {
+    LOG(ERROR) << filename << " is not a linear octree file.";
+    close(fd);
+    return false;
+  }
+  mapped_size_ = file_stat.st_size;
+  mapped_data_ = mmap(NULL, mapped_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after closing the file.
+  close(fd);
+  if (mapped_data_ == MAP_FAILED) {
+    LOG(ERROR) << "Could not map " << filename;
+    mapped_data_ = NULL;
+    mapped_size_ = 0;
+    return false;
+  }
+
+  const Header* header = static_cast<const Header*>(mapped_data_);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+    LOG(ERROR) << filename << " is not a linear octree file.";
+    clear();
+    return false;
+  }
+  if (header->version != kVersion) {
+    LOG(ERROR) << filename << " has the unsupported linear octree version "
+               << header->version << ", save the map to it again.";
+    clear();
+    return false;
+  }
+  const uint64_t num_nodes = header->num_nodes;
+  if ((header->log_odds_bits != 8 && header->log_odds_bits != 16 &&
+       header->log_odds_bits != 32) ||
+      header->tree_depth == 0 || header->tree_depth > 16 ||
+      !(header->resolution > 0.0) ||
+      num_nodes > std::numeric_limits<uint32_t>::max() ||
+      mapped_size_ != sizeof(Header) + getMasksSize(num_nodes) +
+                          getLogOddsSize(num_nodes, header->log_odds_bits) +
+                          getRanksSize(num_nodes)) {
+    LOG(ERROR) << filename << " is not a linear octree file.";
+    clear();
+    return false;
+  }
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(header + 1);
+  const uint8_t* child_masks = data;
+  data += getMasksSize(num_nodes);
+  const void* log_odds = data;
+  data += getLogOddsSize(num_nodes, header->log_odds_bits);
+  const uint32_t* ranks = reinterpret_cast<const uint32_t*>(data);
+  // The ranks are trusted by getChildIndex() as far as they go, so a corrupt
+  // file can not make it index past the arrays. Only the ranks are read here,
+  // the other pages are still only read once queries need them.
+  const size_t num_ranks = (num_nodes + kRankBlockSize - 1) / kRankBlockSize;
+  for (size_t i = 0; i < num_ranks; ++i) {
+    if (ranks[i] > num_nodes || (i == 0 && ranks[i] != 1) ||
+        (i > 0 && ranks[i] < ranks[i - 1])) {
+      LOG(ERROR) << filename << " is a corrupt linear octree file.";
+      clear();
+      return false;
+    }
+  }
+  // Queries jump between distant nodes, read-ahead does not help.
+  madvise(mapped_data_, mapped_size_, MADV_RANDOM);
+
+  header_ = header;
+  child_masks_ = child_masks;
+  log_odds_ = log_odds;
+  ranks_ = ranks;
+  buildIndex();
+  return true;
+}
+
+void LinearOctree::clear() {
+  if (mapped_data_ != NULL) {
+    munmap(mapped_data_, mapped_size_);
+  }
+  mapped_data_ = NULL;
+  mapped_size_ = 0;
+  // Swap with empty vectors, as clear() keeps their memory.
+  std::vector<uint8_t>().swap(built_child_masks_);
+  std::vector<char>().swap(built_log_odds_);
+  std::vector<uint32_t>().swap(built_ranks_);
+  index_depth_ = 0;
+  std::vector<uint32_t>().swap(index_nodes_);
+  std::vector<uint8_t>().swap(index_depths_);
+  header_ = NULL;
+  child_masks_ = NULL;
+  log_odds_ = NULL;
+  ranks_ = NULL;
+}
+
+size_t LinearOctree::memoryUsage() const {
+  const size_t index_size =
+      index_nodes_.capacity() * sizeof(uint32_t) + index_depths_.capacity();
+  if (mapped_data_ != NULL) {
+    return mapped_size_ + index_size;
+  }
+  return sizeof(built_header_) + built_child_masks_.capacity() +
+         built_log_odds_.capacity() +
+         built_ranks_.capacity() * sizeof(uint32_t) + index_size;
+}
+
+void LinearOctree::buildIndex() {
+  const uint64_t num_nodes = header_->num_nodes;
+  if (num_nodes == 0) {
+    return;
+  }
+
+  // Keys of the first and last cells within the metric bounds, which enclose
+  // all leaves.
+  const unsigned int tree_depth = header_->tree_depth;
+  const int key_offset = 1 << (tree_depth - 1);
+  const int max_key_value = 2 * key_offset - 1;
+  int min_key[3], max_key[3];
+  for (unsigned int i = 0; i < 3; ++i) {
+    min_key[i] = std::lround(header_->metric_min[i] / header_->resolution) +
+                 key_offset;
+    max_key[i] = std::lround(header_->metric_max[i] / header_->resolution) +
+                 key_offset - 1;
+    min_key[i] = std::min(std::max(min_key[i], 0), max_key_value);
+    max_key[i] = std::min(std::max(max_key[i], min_key[i]), max_key_value);
+  }
+
+  const size_t max_entries =
+      std::max<size_t>(num_nodes / kNodesPerIndexEntry, 1);
+  for (unsigned int depth = tree_depth; depth > 0; --depth) {
+    const unsigned int shift = tree_depth - depth;
+    size_t num_entries = 1;
+    for (unsigned int i = 0; i < 3; ++i) {
+      index_min_[i] = min_key[i] >> shift;
+      index_size_[i] = (max_key[i] >> shift) - index_min_[i] + 1;
+      num_entries *= index_size_[i];
+    }
+    if (num_entries <= max_entries) {
+      index_depth_ = depth;
+      index_nodes_.assign(num_entries, kNoIndexNode);
+      index_depths_.assign(num_entries, 0);
+      fillIndexRecurs(0, octomap::OcTreeKey(0, 0, 0), 0);
+      return;
+    }
+  }
+}
+
+void LinearOctree::fillIndexRecurs(uint64_t index,
+                                   const octomap::OcTreeKey& node_min_key,
+                                   unsigned int depth) {
+  const unsigned int tree_depth = header_->tree_depth;
+  if (depth < index_depth_ && child_masks_[index] != 0) {
+    const unsigned int child_size = 1u << (tree_depth - depth - 1);
+    uint64_t child_index;
+    if (!getChildIndex(index, 0, &child_index)) {
+      return;
+    }
+    for (unsigned int i = 0; i < 8; ++i) {
+      if (child_masks_[index] & (1 << i)) {
+        octomap::OcTreeKey child_min_key;
+        for (unsigned int j = 0; j < 3; ++j) {
+          child_min_key[j] =
+              node_min_key[j] + ((i & (1 << j)) ? child_size : 0);
+        }
+        fillIndexRecurs(child_index++, child_min_key, depth + 1);
+      }
+    }
+    return;
+  }
+
+  // Leaves above the index depth cover several entries.
+  const unsigned int shift = tree_depth - index_depth_;
+  const unsigned int node_size = 1u << (tree_depth - depth);
+  unsigned int first[3], last[3];
+  for (unsigned int i = 0; i < 3; ++i) {
+    first[i] =
+        std::max(static_cast<unsigned int>(node_min_key[i]) >> shift,
+                 index_min_[i]);
+    last[i] = std::min((node_min_key[i] + node_size - 1) >> shift,
+                       index_min_[i] + index_size_[i] - 1);
+    if (first[i] > last[i]) {
+      return;
+    }
+  }
+  for (unsigned int z = first[2]; z <= last[2]; ++z) {
+    for (unsigned int y = first[1]; y <= last[1]; ++y) {
+      for (unsigned int x = first[0]; x <= last[0]; ++x) {
+        const size_t entry =
+            ((z - index_min_[2]) * index_size_[1] + (y - index_min_[1])) *
+                index_size_[0] +
+            (x - index_min_[0]);
+        index_nodes_[entry] = index;
+        index_depths_[entry] = depth;
+      }
+    }
+  }
+}
+
+bool LinearOctree::getIndexEntry(const octomap::OcTreeKey& key,
+                                 size_t* entry) const {
+  const unsigned int shift = header_->tree_depth - index_depth_;
+  unsigned int position[3];
+  for (unsigned int i = 0; i < 3; ++i) {
+    // Wraps around below index_min_.
+    position[i] = (key[i] >> shift) - index_min_[i];
+    if (position[i] >= index_size_[i]) {
+      return false;
+    }
+  }
+  *entry = (static_cast<size_t>(position[2]) * index_size_[1] + position[1]) *
+               index_size_[0] +
+           position[0];
+  return true;
+}
+
+void LinearOctree::getMetricMin(double* x, double* y, double* z) const {
+  *CHECK_NOTNULL(x) = header_->metric_min[0];
+  *CHECK_NOTNULL(y) = header_->metric_min[1];
+  *CHECK_NOTNULL(z) = header_->metric_min[2];
+}
+
+void LinearOctree::getMetricMax(double* x, double* y, double* z) const {
+  *CHECK_NOTNULL(x) = header_->metric_max[0];
+  *CHECK_NOTNULL(y) = header_->metric_max[1];
+  *CHECK_NOTNULL(z) = header_->metric_max[2];
+}
+
+bool LinearOctree::getChildIndex(uint64_t index, unsigned int i,
+                                 uint64_t* child_index) const {
+  // Children are stored in order, so skip the children of all nodes before
+  // this one in its block, and all existing children before i.
+  const uint64_t block_start = index - index % kRankBlockSize;
+  uint64_t first_child = ranks_[index / kRankBlockSize];
+  for (uint64_t j = block_start; j < index; ++j) {
+    first_child += std::bitset<8>(child_masks_[j]).count();
+  }
+  // Children come after their parent in breadth-first order. Anything else is
+  // a corrupt file.
+  if (first_child <= index ||
+      first_child + std::bitset<8>(child_masks_[index]).count() >
+          header_->num_nodes) {
+    LOG(ERROR) << "Corrupt linear octree, node " << index
+               << " has children out of range.";
+    return false;
+  }
+  *child_index = first_child +
+                 std::bitset<8>(child_masks_[index] & ((1 << i) - 1)).count();
+  return true;
+}
+
+float LinearOctree::getLogOdds(uint64_t index) const {
+  switch (header_->log_odds_bits) {
+    case 8:
+      return header_->log_odds_offset +
+             static_cast<const int8_t*>(log_odds_)[index] *
+                 header_->log_odds_step;
+    case 16:
+      return header_->log_odds_offset +
+             static_cast<const int16_t*>(log_odds_)[index] *
+                 header_->log_odds_step;
+    default:
+      return static_cast<const float*>(log_odds_)[index];
+  }
+}
+
+bool LinearOctree::search(const octomap::OcTreeKey& key,
+                          float* log_odds) const {
+  CHECK_NOTNULL(log_odds);
+  if (header_->num_nodes == 0) {
+    return false;
+  }
+  // Keys outside of the index are searched from the root.
+  size_t entry;
+  if (!index_nodes_.empty() && getIndexEntry(key, &entry)) {
+    if (index_nodes_[entry] == kNoIndexNode) {
+      return false;
+    }
+    return searchFrom(index_nodes_[entry], index_depths_[entry], key,
+                      log_odds);
+  }
+  return searchFrom(0, 0, key, log_odds);
+}
+
+bool LinearOctree::searchFromRoot(const octomap::OcTreeKey& key,
+                                  float* log_odds) const {
+  CHECK_NOTNULL(log_odds);
+  if (header_->num_nodes == 0) {
+    return false;
+  }
+  return searchFrom(0, 0, key, log_odds);
+}
+
+bool LinearOctree::searchFrom(uint64_t index, unsigned int depth,
+                              const octomap::OcTreeKey& key,
+                              float* log_odds) const {
+  const unsigned int tree_depth = header_->tree_depth;
+  // Stops early at pruned nodes, which are leaves above the maximum depth.
+  for (; depth < tree_depth && child_masks_[index] != 0; ++depth) {
+    const unsigned int child_index =
+        octomap::computeChildIdx(key, tree_depth - 1 - depth);
+    if ((child_masks_[index] & (1 << child_index)) == 0) {
+      return false;
+    }
+    if (!getChildIndex(index, child_index, &index)) {
+      return false;
+    }
+  }
+  *log_odds = getLogOdds(index);
+  return true;
+}
+
+void LinearOctree::forEachLeafInKeyRange(
+    const octomap::OcTreeKey& min_key, const octomap::OcTreeKey& max_key,
+    const LeafVisitor& visit_leaf, bool* contains_unknown) const {
+  CHECK_NOTNULL(contains_unknown);
+  *contains_unknown = false;
+  if (header_->num_nodes == 0) {
+    *contains_unknown = true;
+    return;
+  }
+  forEachLeafRecurs(0, octomap::OcTreeKey(0, 0, 0), 0, min_key, max_key,
+                    visit_leaf, contains_unknown);
+}
+
+bool LinearOctree::forEachLeafRecurs(uint64_t index,
+                                     const octomap::OcTreeKey& node_min_key,
+                                     unsigned int depth,
+                                     const octomap::OcTreeKey& min_key,
+                                     const octomap::OcTreeKey& max_key,
+                                     const LeafVisitor& visit_leaf,
+                                     bool* contains_unknown) const {
+  // Nodes at the maximum depth of a corrupt file may have children as well.
+  if (child_masks_[index] == 0 || depth >= header_->tree_depth) {
+    return visit_leaf(node_min_key, depth, getLogOdds(index));
+  }
+  const unsigned int child_size = 1u << (header_->tree_depth - depth - 1);
+  uint64_t child_index;
+  if (!getChildIndex(index, 0, &child_index)) {
+    *contains_unknown = true;
+    return true;
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    octomap::OcTreeKey child_min_key;
+    bool overlaps = true;
+    for (unsigned int j = 0; j < 3; ++j) {
+      child_min_key[j] = node_min_key[j] + ((i & (1 << j)) ? child_size : 0);
+      overlaps = overlaps && child_min_key[j] <= max_key[j] &&
+                 child_min_key[j] + (child_size - 1) >= min_key[j];
+    }
+    if ((child_masks_[index] & (1 << i)) == 0) {
+      *contains_unknown = *contains_unknown || overlaps;
+      continue;
+    }
+    if (overlaps &&
+        !forEachLeafRecurs(child_index, child_min_key, depth + 1, min_key,
+                           max_key, visit_leaf, contains_unknown)) {
+      return false;
+    }
+    ++child_index;
+  }
+  return true;
+}
+
+void LinearOctree::copyToOcTree(octomap::OcTree* tree) const {
+  CHECK_NOTNULL(tree);
+  CHECK_EQ(tree->getTreeDepth(), header_->tree_depth);
+  tree->clear();
+  if (header_->num_nodes == 0) {
+    return;
+  }
+
+  // Octomap has no way to create just a root, but readData() does so while
+  // also keeping the node count up to date.
+  std::stringstream root_stream;
+  const float root_log_odds = getLogOdds(0);
+  const char no_children = 0;
+  root_stream.write(reinterpret_cast<const char*>(&root_log_odds),
+                    sizeof(float));
+  root_stream.write(&no_children, sizeof(char));
+  tree->readData(root_stream);
+
+  copyNodesRecurs(0, 0, tree->getRoot(), tree);
+}
+
+void LinearOctree::copyNodesRecurs(uint64_t index, unsigned int depth,
+                                   octomap::OcTreeNode* node,
+                                   octomap::OcTree* tree) const {
+  uint64_t child_index;
+  if (child_masks_[index] == 0 || depth >= header_->tree_depth ||
+      !getChildIndex(index, 0, &child_index)) {
+    return;
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (child_masks_[index] & (1 << i)) {
+      octomap::OcTreeNode* child = tree->createNodeChild(node, i);
+      child->setLogOdds(getLogOdds(child_index));
+      copyNodesRecurs(child_index++, depth + 1, child, tree);
+    }
+  }
+}
+
+}  // namespace volumetric_mapping
@@ -0,0 +1,263 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <octomap/octomap.h>
+
+#include "octomap_world/linear_octree.h"
+
+DEFINE_int32(num_random_points, 200000,
+             "Number of random points of the generated map.");
+DEFINE_double(random_extent, 20.0,
+              "Side length in meters of the cube of the generated map.");
+DEFINE_double(resolution, 0.1, "Resolution of the generated map in meters.");
+DEFINE_int32(seed, 0, "Seed of the generated map and the searched keys.");
+DEFINE_int32(num_random_keys, 1000000,
+             "Number of random keys searched in the whole key range, and "
+             "again within the bounds of the map.");
+
+namespace {
+
+// Generates a map with log-odds all over the clamping range: every point is
+// hit or missed a random number of times, and a solid block of occupied cells
+// is pruned to leaves above the maximum depth.
+void generateMap(octomap::OcTree* tree) {
+  std::mt19937 generator(FLAGS_seed);
+  std::uniform_real_distribution<double> position(-FLAGS_random_extent / 2.0,
+                                                  FLAGS_random_extent / 2.0);
+  std::uniform_int_distribution<int> num_updates(1, 8);
+  std::bernoulli_distribution occupied(0.5);
+  for (int i = 0; i < FLAGS_num_random_points; ++i) {
+    const octomap::point3d point(position(generator), position(generator),
+                                 position(generator));
+    const bool hit = occupied(generator);
+    for (int j = num_updates(generator); j > 0; --j) {
+      tree->updateNode(point, hit, true);
+    }
+  }
+  const double block_size = FLAGS_random_extent / 8.0;
+  for (double x = 0.0; x < block_size; x += FLAGS_resolution) {
+    for (double y = 0.0; y < block_size; y += FLAGS_resolution) {
+      for (double z = 0.0; z < block_size; z += FLAGS_resolution) {
+        tree->setNodeValue(octomap::point3d(x, y, z),
+                           tree->getClampingThresMaxLog(), true);
+      }
+    }
+  }
+  tree->updateInnerOccupancy();
+  tree->prune();
+}
+
+// Returns the number of leaves of tree for which the linear octree with
+// log_odds_bits per value differs in occupancy, or by more than half a step
+// in log-odds.
+size_t checkQuantization(const octomap::OcTree& tree,
+                         unsigned int log_odds_bits) {
+  volumetric_mapping::LinearOctree linear_octree;
+  CHECK(linear_octree.build(tree, log_odds_bits));
+  // Float log-odds have to be exact; the slack only absorbs the float
+  // arithmetic of dequantizing.
+  const float max_error = log_odds_bits == 32
+                              ? 0.0f
+                              : linear_octree.getLogOddsStep() * 0.5f * 1.001f;
+  size_t num_errors = 0;
+  size_t num_leaves = 0;
+  float largest_error = 0.0f;
+  for (octomap::OcTree::leaf_iterator it = tree.begin_leafs();
+       it != tree.end_leafs(); ++it) {
+    ++num_leaves;
+    float log_odds;
+    if (!linear_octree.search(it.getKey(), &log_odds)) {
+      if (num_errors++ < 10) {
+        LOG(ERROR) << log_odds_bits << " bits: leaf at " << it.getCoordinate()
+                   << " is unknown.";
+      }
+      continue;
+    }
+    const bool occupied = log_odds >= tree.getOccupancyThresLog();
+    const float value = it->getLogOdds();
+    const float error = std::fabs(log_odds - value);
+    const bool in_clamping_range = value >= tree.getClampingThresMinLog() &&
+                                   value <= tree.getClampingThresMaxLog();
+    if (in_clamping_range) {
+      largest_error = std::max(largest_error, error);
+    }
+    if (occupied != tree.isNodeOccupied(*it) ||
+        (in_clamping_range && error > max_error)) {
+      if (num_errors++ < 10) {
+        LOG(ERROR) << log_odds_bits << " bits: leaf at " << it.getCoordinate()
+                   << " has log-odds " << value << " in the tree and "
+                   << log_odds << " in the linear octree.";
+      }
+    }
+  }
+  LOG(INFO) << log_odds_bits << " bits: " << num_leaves << " leaves, "
+            << linear_octree.memoryUsage() << " bytes, largest error "
+            << largest_error << ", " << num_errors << " errors.";
+  return num_errors;
+}
+
+// Returns false if the indexed search, the search from the root of the
+// linear octree and the search of tree disagree about key, and logs it if
+// log_mismatch is set.
+bool checkSearch(const octomap::OcTree& tree,
+                 const volumetric_mapping::LinearOctree& linear_octree,
+                 const octomap::OcTreeKey& key, bool log_mismatch) {
+  float indexed_log_odds = 0.0f;
+  float root_log_odds = 0.0f;
+  const bool indexed_found = linear_octree.search(key, &indexed_log_odds);
+  const bool root_found = linear_octree.searchFromRoot(key, &root_log_odds);
+  const octomap::OcTreeNode* node = tree.search(key);
+  // Float log-odds are copied, so all three have to be identical.
+  if (indexed_found == root_found && root_found == (node != NULL) &&
+      (node == NULL || (indexed_log_odds == root_log_odds &&
+                        root_log_odds == node->getLogOdds()))) {
+    return true;
+  }
+  LOG_IF(ERROR, log_mismatch)
+      << "Key (" << key[0] << ", " << key[1] << ", " << key[2]
+      << "): indexed "
+      << (indexed_found ? std::to_string(indexed_log_odds) : "unknown")
+      << ", from the root "
+      << (root_found ? std::to_string(root_log_odds) : "unknown")
+      << ", octree "
+      << (node != NULL ? std::to_string(node->getLogOdds()) : "unknown");
+  return false;
+}
+
+// Returns the number of keys for which searching the index of a linear octree
+// of tree differs from searching it from the root or searching tree. Searches
+// random keys in the whole key range, which wrap around below the index,
+// random keys in and around the bounds of the map, which include unknown
+// cells, a random key within every leaf, which includes pruned leaves above
+// the index depth, and the corners of the key range.
+size_t checkIndex(const octomap::OcTree& tree) {
+  volumetric_mapping::LinearOctree linear_octree;
+  CHECK(linear_octree.build(tree, 32));
+  const unsigned int tree_depth = tree.getTreeDepth();
+  const unsigned int max_key = (1u << tree_depth) - 1;
+  size_t num_errors = 0;
+  size_t num_keys = 0;
+  const auto check = [&](const octomap::OcTreeKey& key) {
+    ++num_keys;
+    if (!checkSearch(tree, linear_octree, key, num_errors < 10)) {
+      ++num_errors;
+    }
+  };
+
+  std::mt19937 generator(FLAGS_seed);
+  std::uniform_int_distribution<unsigned int> any_key(0, max_key);
+  for (int i = 0; i < FLAGS_num_random_keys; ++i) {
+    check(octomap::OcTreeKey(any_key(generator), any_key(generator),
+                             any_key(generator)));
+  }
+
+  // One meter around the bounds of the map.
+  double min[3], max[3];
+  tree.getMetricMin(min[0], min[1], min[2]);
+  tree.getMetricMax(max[0], max[1], max[2]);
+  const octomap::OcTreeKey min_key = tree.coordToKey(
+      octomap::point3d(min[0] - 1.0, min[1] - 1.0, min[2] - 1.0));
+  const octomap::OcTreeKey max_key_in_bounds = tree.coordToKey(
+      octomap::point3d(max[0] + 1.0, max[1] + 1.0, max[2] + 1.0));
+  std::uniform_int_distribution<unsigned int> x_key(min_key[0],
+                                                    max_key_in_bounds[0]);
+  std::uniform_int_distribution<unsigned int> y_key(min_key[1],
+                                                    max_key_in_bounds[1]);
+  std::uniform_int_distribution<unsigned int> z_key(min_key[2],
+                                                    max_key_in_bounds[2]);
+  for (int i = 0; i < FLAGS_num_random_keys; ++i) {
+    check(octomap::OcTreeKey(x_key(generator), y_key(generator),
+                             z_key(generator)));
+  }
+
+  size_t num_leaves_above_index = 0;
+  for (octomap::OcTree::leaf_iterator it = tree.begin_leafs();
+       it != tree.end_leafs(); ++it) {
+    if (it.getDepth() < linear_octree.getIndexDepth()) {
+      ++num_leaves_above_index;
+    }
+    // The key of a leaf above the maximum depth is the one of its center,
+    // half its size above its smallest key.
+    const unsigned int size = 1u << (tree_depth - it.getDepth());
+    std::uniform_int_distribution<unsigned int> offset(0, size - 1);
+    octomap::OcTreeKey key = it.getKey();
+    for (unsigned int i = 0; i < 3; ++i) {
+      key[i] = key[i] - size / 2 + offset(generator);
+    }
+    check(key);
+  }
+
+  for (unsigned int corner = 0; corner < 8; ++corner) {
+    check(octomap::OcTreeKey((corner & 1) ? max_key : 0,
+                             (corner & 2) ? max_key : 0,
+                             (corner & 4) ? max_key : 0));
+  }
+
+  LOG(INFO) << "Index at depth " << linear_octree.getIndexDepth() << ": "
+            << num_keys << " keys, " << num_leaves_above_index
+            << " leaves above the index depth, " << num_errors << " errors.";
+  if (linear_octree.getIndexDepth() == 0 || num_leaves_above_index == 0) {
+    LOG(WARNING) << "The map does not exercise the index fully, increase "
+                 << "num_random_points or random_extent.";
+  }
+  return num_errors;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InstallFailureSignalHandler();
+  FLAGS_alsologtostderr = true;
+
+  octomap::OcTree tree(FLAGS_resolution);
+  generateMap(&tree);
+  LOG(INFO) << "Checking a map of " << tree.size() << " nodes.";
+
+  size_t num_errors = 0;
+  for (unsigned int log_odds_bits : {8u, 16u, 32u}) {
+    num_errors += checkQuantization(tree, log_odds_bits);
+  }
+  num_errors += checkIndex(tree);
+  if (num_errors > 0) {
+    LOG(ERROR) << "Linear octree check failed with " << num_errors
+               << " errors.";
+    return 1;
+  }
+  LOG(INFO) << "Linear octree check passed.";
+  return 0;
+}
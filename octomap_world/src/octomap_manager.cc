@@ -33,11 +33,21 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <minkindr_conversions/kindr_msg.h>
 #include <minkindr_conversions/kindr_tf.h>
 #include <minkindr_conversions/kindr_xml.h>
-#include <pcl/io/pcd_io.h>
-#include <pcl/io/ply_io.h>
 
 namespace volumetric_mapping {
 
+namespace {
+
+// Finished background saves whose status can still be queried.
+const size_t kMaxFinishedSaveJobs = 16;
+
+bool isSaveJobFinished(uint8_t status) {
+  return status == volumetric_msgs::GetSaveStatus::Response::SUCCEEDED ||
+         status == volumetric_msgs::GetSaveStatus::Response::FAILED;
+}
+
+}  // namespace
+
 OctomapManager::OctomapManager(const ros::NodeHandle& nh,
                                const ros::NodeHandle& nh_private)
     : nh_(nh),
@@ -50,7 +60,18 @@ OctomapManager::OctomapManager(const ros::NodeHandle& nh,
       Q_initialized_(false),
       Q_(Eigen::Matrix4d::Identity()),
       full_image_size_(752, 480),
-      map_publish_frequency_(0.0) {
+      map_publish_frequency_(0.0),
+      publish_map_updates_(false),
+      map_update_sequence_(0),
+      map_update_subtree_depth_(13),
+      map_keyframe_interval_(1),
+      num_map_publishes_(0),
+      merge_input_octomaps_(false),
+      freeze_map_(false),
+      load_map_cast_rays_(false),
+      save_point_cloud_leaf_centers_(false),
+      next_save_job_id_(1),
+      stop_save_thread_(false) {
   setParametersFromROS();
   subscribe();
   advertiseServices();
@@ -58,18 +79,52 @@ OctomapManager::OctomapManager(const ros::NodeHandle& nh,
 
   // After creating the manager, if the octomap_file parameter is set,
   // load the octomap at that path and publish it.
-  std::string octomap_file;
-  if (nh_private_.getParam("octomap_file", octomap_file)) {
-    if (loadOctomapFromFile(octomap_file)) {
+  bool map_loaded = false;
+  if (nh_private_.getParam("octomap_file", octomap_file_)) {
+    if (loadOctomapFromFile(octomap_file_)) {
       ROS_INFO_STREAM(
-          "Successfully loaded octomap from path: " << octomap_file);
-      publishAll();
+          "Successfully loaded octomap from path: " << octomap_file_);
+      map_loaded = true;
+    } else {
+      ROS_ERROR_STREAM("Could not load octomap from path: " << octomap_file_);
+    }
+  }
+  // The scans inserted since the last checkpoint are replayed from the
+  // journal on top of it.
+  std::string scan_journal_file;
+  if (nh_private_.getParam("scan_journal_file", scan_journal_file)) {
+    if (openScanJournal(scan_journal_file)) {
+      ROS_INFO_STREAM("Opened scan journal: " << scan_journal_file);
+      map_loaded = true;
+    } else {
+      ROS_ERROR_STREAM("Could not open scan journal: " << scan_journal_file);
+    }
+  }
+  if (map_loaded) {
+    invalidateMapUpdates();
+    publishAll();
+  }
+  // Frozen after publishing, which needs the nodes of the map.
+  if (freeze_map_) {
+    if (freeze()) {
+      ROS_INFO_STREAM("Froze the map.");
     } else {
-      ROS_ERROR_STREAM("Could not load octomap from path: " << octomap_file);
+      ROS_ERROR_STREAM("Could not freeze the map.");
     }
   }
 }
 
+OctomapManager::~OctomapManager() {
+  {
+    std::lock_guard<std::mutex> lock(save_mutex_);
+    stop_save_thread_ = true;
+  }
+  save_condition_.notify_one();
+  if (save_thread_.joinable()) {
+    save_thread_.join();
+  }
+}
+
 void OctomapManager::setParametersFromROS() {
   OctomapParameters params;
   nh_private_.param("tf_frame", world_frame_, world_frame_);
@@ -108,6 +163,43 @@ void OctomapManager::setParametersFromROS() {
                     params.treat_unknown_as_occupied);
   nh_private_.param("change_detection_enabled", params.change_detection_enabled,
                     params.change_detection_enabled);
+  nh_private_.param("publish_map_updates", publish_map_updates_,
+                    publish_map_updates_);
+  nh_private_.param("map_update_subtree_depth", map_update_subtree_depth_,
+                    map_update_subtree_depth_);
+  nh_private_.param("map_keyframe_interval", map_keyframe_interval_,
+                    map_keyframe_interval_);
+  nh_private_.param("compress_map_msgs", params.compress_map_msgs,
+                    params.compress_map_msgs);
+  nh_private_.param("num_threads", params.num_threads, params.num_threads);
+  nh_private_.param("tile_depth", params.tile_depth, params.tile_depth);
+  nh_private_.param("linear_octree_log_odds_bits",
+                    params.linear_octree_log_odds_bits,
+                    params.linear_octree_log_odds_bits);
+  nh_private_.param("journal_sync_interval", params.journal_sync_interval,
+                    params.journal_sync_interval);
+  nh_private_.param("merge_input_octomaps", merge_input_octomaps_,
+                    merge_input_octomaps_);
+  nh_private_.param("freeze_map", freeze_map_, freeze_map_);
+  nh_private_.param("load_map_cast_rays", load_map_cast_rays_,
+                    load_map_cast_rays_);
+  nh_private_.param("save_point_cloud_leaf_centers",
+                    save_point_cloud_leaf_centers_,
+                    save_point_cloud_leaf_centers_);
+  // Map updates are built from the change detection.
+  if (publish_map_updates_) {
+    params.change_detection_enabled = true;
+  }
+
+  // Region of the map owned by this manager, if it is one shard of a sharded
+  // map (see OctomapShardRouter).
+  std::vector<double> bound;
+  if (nh_private_.getParam("update_min_bound", bound) && bound.size() == 3) {
+    params.update_min_bound << bound[0], bound[1], bound[2];
+  }
+  if (nh_private_.getParam("update_max_bound", bound) && bound.size() == 3) {
+    params.update_max_bound << bound[0], bound[1], bound[2];
+  }
 
   // Try to initialize Q matrix from parameters, if available.
   std::vector<double> Q_vec;
@@ -183,16 +275,30 @@ void OctomapManager::subscribe() {
                                  &OctomapManager::leftCameraInfoCallback, this);
   right_info_sub_ = nh_.subscribe(
       "cam1/camera_info", 1, &OctomapManager::rightCameraInfoCallback, this);
+  // A frozen map only answers queries; inserting data would convert it back.
+  if (freeze_map_) {
+    return;
+  }
   disparity_sub_ = nh_.subscribe(
       "disparity", 40, &OctomapManager::insertDisparityImageWithTf, this);
   pointcloud_sub_ = nh_.subscribe(
       "pointcloud", 40, &OctomapManager::insertPointcloudWithTf, this);
+  world_pointcloud_sub_ = nh_private_.subscribe(
+      "world_pointcloud", 40, &OctomapManager::insertWorldPointcloud, this);
   octomap_sub_ =
       nh_.subscribe("input_octomap", 1, &OctomapManager::octomapCallback, this);
 }
 
 void OctomapManager::octomapCallback(const octomap_msgs::Octomap& msg) {
-  setOctomapFromMsg(msg);
+  if (merge_input_octomaps_) {
+    // Maps of other robots are expected in the same world frame.
+    OctomapWorld other(params_);
+    other.setOctomapFromMsg(msg);
+    merge(other, Transformation());
+  } else {
+    setOctomapFromMsg(msg);
+  }
+  invalidateMapUpdates();
   publishAll();
   ROS_INFO_ONCE("Got octomap from message.");
 }
@@ -204,10 +310,18 @@ void OctomapManager::advertiseServices() {
       "publish_all", &OctomapManager::publishAllCallback, this);
   get_map_service_ = nh_private_.advertiseService(
       "get_map", &OctomapManager::getOctomapCallback, this);
+  get_map_region_service_ = nh_private_.advertiseService(
+      "get_map_region", &OctomapManager::getOctomapRegionCallback, this);
   save_octree_service_ = nh_private_.advertiseService(
       "save_map", &OctomapManager::saveOctomapCallback, this);
+  save_octree_async_service_ = nh_private_.advertiseService(
+      "save_map_async", &OctomapManager::saveOctomapAsyncCallback, this);
+  get_save_status_service_ = nh_private_.advertiseService(
+      "get_save_status", &OctomapManager::getSaveStatusCallback, this);
   load_octree_service_ = nh_private_.advertiseService(
       "load_map", &OctomapManager::loadOctomapCallback, this);
+  checkpoint_map_service_ = nh_private_.advertiseService(
+      "checkpoint_map", &OctomapManager::checkpointMapCallback, this);
   save_point_cloud_service_ = nh_private_.advertiseService(
       "save_point_cloud", &OctomapManager::savePointCloudCallback, this);
   set_box_occupancy_service_ = nh_private_.advertiseService(
@@ -229,12 +343,19 @@ void OctomapManager::advertisePublishers() {
   full_map_pub_ = nh_private_.advertise<octomap_msgs::Octomap>(
       "octomap_full", 1, latch_topics_);
 
+  if (publish_map_updates_) {
+    // Not latched: updates are only meaningful as a complete sequence.
+    map_update_pub_ = nh_private_.advertise<volumetric_msgs::OctomapUpdate>(
+        "octomap_updates", 10, false);
+  }
+
   pcl_pub_ = nh_private_.advertise<sensor_msgs::PointCloud2>("octomap_pcl", 1,
                                                              latch_topics_);
   nearest_obstacle_pub_ = nh_private_.advertise<sensor_msgs::PointCloud2>(
       "nearest_obstacle", 1, false);
 
-  if (map_publish_frequency_ > 0.0) {
+  // Publishing walks the nodes, which would convert a frozen map back.
+  if (map_publish_frequency_ > 0.0 && !freeze_map_) {
     map_publish_timer_ =
         nh_private_.createTimer(ros::Duration(1.0 / map_publish_frequency_),
                                 &OctomapManager::publishAllEvent, this);
@@ -250,20 +371,31 @@ void OctomapManager::publishAll() {
     free_nodes_pub_.publish(free_nodes);
   }
 
-  if (latch_topics_ || binary_map_pub_.getNumSubscribers() > 0) {
+  // Between keyframes, subscribers get the changes from the map updates.
+  bool publish_full_map = true;
+  if (publish_map_updates_ && map_keyframe_interval_ > 1) {
+    publish_full_map = (num_map_publishes_ % map_keyframe_interval_ == 0);
+  }
+  ++num_map_publishes_;
+
+  if (publish_full_map &&
+      (latch_topics_ || binary_map_pub_.getNumSubscribers() > 0)) {
     octomap_msgs::Octomap binary_map;
     getOctomapBinaryMsg(&binary_map);
     binary_map.header.frame_id = world_frame_;
     binary_map_pub_.publish(binary_map);
   }
 
-  if (latch_topics_ || full_map_pub_.getNumSubscribers() > 0) {
+  if (publish_full_map &&
+      (latch_topics_ || full_map_pub_.getNumSubscribers() > 0)) {
     octomap_msgs::Octomap full_map;
-    getOctomapBinaryMsg(&full_map);
+    getOctomapFullMsg(&full_map);
     full_map.header.frame_id = world_frame_;
     full_map_pub_.publish(full_map);
   }
 
+  publishMapUpdate(false);
+
   if (latch_topics_ || pcl_pub_.getNumSubscribers() > 0) {
     pcl::PointCloud<pcl::PointXYZ> point_cloud;
     getOccupiedPointCloud(&point_cloud);
@@ -292,9 +424,40 @@ void OctomapManager::publishAll() {
 
 void OctomapManager::publishAllEvent(const ros::TimerEvent& e) { publishAll(); }
 
+void OctomapManager::publishMapUpdate(bool force) {
+  if (!publish_map_updates_) {
+    return;
+  }
+  volumetric_msgs::OctomapUpdate update;
+  getOctomapUpdateMsg(map_update_subtree_depth_, &update);
+  if (update.keys.empty() && !force) {
+    return;
+  }
+  update.header.frame_id = world_frame_;
+  update.header.stamp = ros::Time::now();
+  update.sequence = ++map_update_sequence_;
+  map_update_pub_.publish(update);
+}
+
+void OctomapManager::invalidateMapUpdates() {
+  if (!publish_map_updates_) {
+    return;
+  }
+  // Whatever changes were tracked so far are contained in the new full map.
+  detachOctree(true);
+  octree_->resetChangeDetection();
+  ++map_update_sequence_;
+  publishMapUpdate(true);
+  // Also make the next publish a keyframe.
+  num_map_publishes_ = 0;
+}
+
 bool OctomapManager::resetMapCallback(std_srvs::Empty::Request& request,
                                       std_srvs::Empty::Response& response) {
   resetMap();
+  // Otherwise a restart would replay the scans from before the reset.
+  clearScanJournal();
+  invalidateMapUpdates();
   return true;
 }
 
@@ -310,36 +473,38 @@ bool OctomapManager::getOctomapCallback(
   return getOctomapFullMsg(&response.map);
 }
 
+bool OctomapManager::getOctomapRegionCallback(
+    volumetric_msgs::GetOctomapRegion::Request& request,
+    volumetric_msgs::GetOctomapRegion::Response& response) {
+  const Eigen::Vector3d box_center(request.box_center.x, request.box_center.y,
+                                   request.box_center.z);
+  const Eigen::Vector3d box_size(request.box_size.x, request.box_size.y,
+                                 request.box_size.z);
+  response.map.header.frame_id = world_frame_;
+  return getOctomapRegionMsg(box_center, box_size, request.max_depth,
+                             &response.map);
+}
+
 bool OctomapManager::loadOctomapCallback(
     volumetric_msgs::LoadMap::Request& request,
     volumetric_msgs::LoadMap::Response& response) {
   std::string extension =
       request.file_path.substr(request.file_path.find_last_of(".") + 1);
-  if (extension == "bt") {
-    return loadOctomapFromFile(request.file_path);
-  } else {
-    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(
-        new pcl::PointCloud<pcl::PointXYZ>);
-    if (extension == "pcd") {
-      pcl::io::loadPCDFile<pcl::PointXYZ>(request.file_path, *cloud);
-    } else if (extension == "ply") {
-      pcl::io::loadPLYFile<pcl::PointXYZ>(request.file_path, *cloud);
-    } else {
-      ROS_ERROR_STREAM(
-          "No known file extension (.bt, .pcd, .ply): " << request.file_path);
-      return false;
+  if (extension == "bt" || extension == "btz" || extension == "lbt" ||
+      extension == "tiles") {
+    const bool success = loadOctomapFromFile(request.file_path);
+    if (success) {
+      clearScanJournal();
     }
-    octomap::KeySet free_cells, occupied_cells;
-    for (size_t i = 0u; i < cloud->size(); ++i) {
-      const octomap::point3d p_G_point((*cloud)[i].x, (*cloud)[i].y,
-                                       (*cloud)[i].z);
-      octomap::OcTreeKey key;
-      if (octree_->coordToKeyChecked(p_G_point, key)) {
-        occupied_cells.insert(key);
-      }
-    }
-    updateOccupancy(&free_cells, &occupied_cells);
-    return true;
+    invalidateMapUpdates();
+    return success;
+  } else if (extension == "pcd" || extension == "ply") {
+    return insertPointCloudFile(request.file_path, load_map_cast_rays_);
+  } else {
+    ROS_ERROR_STREAM(
+        "No known file extension (.bt, .btz, .lbt, .tiles, .pcd, .ply): "
+        << request.file_path);
+    return false;
   }
 }
 
@@ -349,13 +514,112 @@ bool OctomapManager::saveOctomapCallback(
   return writeOctomapToFile(request.file_path);
 }
 
+bool OctomapManager::checkpointMapCallback(
+    std_srvs::Empty::Request& request, std_srvs::Empty::Response& response) {
+  if (octomap_file_.empty()) {
+    ROS_ERROR("Can not checkpoint the map without an octomap_file.");
+    return false;
+  }
+  // The journal can only be cleared once the checkpoint is safely on disk,
+  // so the old checkpoint is only replaced by a complete new one.
+  if (!writeOctomapToFileAtomically(octomap_file_)) {
+    ROS_ERROR_STREAM("Could not save octomap to path: " << octomap_file_);
+    return false;
+  }
+  // A crash right before this replays the journal onto a checkpoint that
+  // already contains its scans, which only makes those cells more certain.
+  clearScanJournal();
+  return true;
+}
+
+bool OctomapManager::saveOctomapAsyncCallback(
+    volumetric_msgs::SaveMapAsync::Request& request,
+    volumetric_msgs::SaveMapAsync::Response& response) {
+  reapSaveJobs();
+  std::shared_ptr<SaveJob> job(new SaveJob());
+  // The clone shares the octree until the map is next changed, which copies
+  // it then, so the map keeps updating during the write.
+  job->snapshot = getCopyOnWriteClone();
+  job->file_path = request.file_path;
+  job->status = volumetric_msgs::GetSaveStatus::Response::PENDING;
+  response.job_id = next_save_job_id_++;
+  save_jobs_[response.job_id] = job;
+
+  {
+    std::lock_guard<std::mutex> lock(save_mutex_);
+    save_queue_.push_back(job);
+  }
+  save_condition_.notify_one();
+  if (!save_thread_.joinable()) {
+    save_thread_ = std::thread(&OctomapManager::runSaveThread, this);
+  }
+  return true;
+}
+
+void OctomapManager::runSaveThread() {
+  while (true) {
+    std::shared_ptr<SaveJob> job;
+    {
+      std::unique_lock<std::mutex> lock(save_mutex_);
+      save_condition_.wait(lock, [this]() {
+        return stop_save_thread_ || !save_queue_.empty();
+      });
+      if (save_queue_.empty()) {
+        return;
+      }
+      job = save_queue_.front();
+      save_queue_.pop_front();
+    }
+    job->status = volumetric_msgs::GetSaveStatus::Response::RUNNING;
+    if (job->snapshot->writeOctomapToFile(job->file_path)) {
+      job->status = volumetric_msgs::GetSaveStatus::Response::SUCCEEDED;
+    } else {
+      ROS_ERROR_STREAM("Could not save octomap to path: " << job->file_path);
+      job->status = volumetric_msgs::GetSaveStatus::Response::FAILED;
+    }
+    job->snapshot.reset();
+  }
+}
+
+bool OctomapManager::getSaveStatusCallback(
+    volumetric_msgs::GetSaveStatus::Request& request,
+    volumetric_msgs::GetSaveStatus::Response& response) {
+  std::map<uint64_t, std::shared_ptr<SaveJob>>::iterator it =
+      save_jobs_.find(request.job_id);
+  if (it == save_jobs_.end()) {
+    response.status = volumetric_msgs::GetSaveStatus::Response::UNKNOWN_JOB;
+    return true;
+  }
+  response.status = it->second->status;
+  return true;
+}
+
+void OctomapManager::reapSaveJobs() {
+  size_t num_finished_jobs = 0;
+  for (const std::pair<const uint64_t, std::shared_ptr<SaveJob>>& job :
+       save_jobs_) {
+    if (isSaveJobFinished(job.second->status)) {
+      ++num_finished_jobs;
+    }
+  }
+  // Job IDs increase, so the oldest finished jobs come first.
+  std::map<uint64_t, std::shared_ptr<SaveJob>>::iterator it =
+      save_jobs_.begin();
+  while (num_finished_jobs > kMaxFinishedSaveJobs && it != save_jobs_.end()) {
+    if (isSaveJobFinished(it->second->status)) {
+      it = save_jobs_.erase(it);
+      --num_finished_jobs;
+    } else {
+      ++it;
+    }
+  }
+}
+
 bool OctomapManager::savePointCloudCallback(
     volumetric_msgs::SaveMap::Request& request,
     volumetric_msgs::SaveMap::Response& response) {
-  pcl::PointCloud<pcl::PointXYZ> point_cloud;
-  getOccupiedPointCloud(&point_cloud);
-  pcl::io::savePLYFileASCII(request.file_path, point_cloud);
-  return true;
+  return writeOccupiedPointCloudFile(request.file_path,
+                                     save_point_cloud_leaf_centers_);
 }
 
 bool OctomapManager::setBoxOccupancyCallback(
@@ -456,6 +720,18 @@ void OctomapManager::insertPointcloudWithTf(
   }
 }
 
+void OctomapManager::insertWorldPointcloud(
+    const sensor_msgs::PointCloud2::ConstPtr& pointcloud) {
+  if (pointcloud->header.frame_id != world_frame_) {
+    ROS_ERROR_STREAM("Expected a pointcloud in the " << world_frame_
+                     << " frame, got " << pointcloud->header.frame_id);
+    return;
+  }
+  pcl::PointCloud<pcl::PointWithViewpoint> cloud;
+  pcl::fromROSMsg(*pointcloud, cloud);
+  insertPointcloudWithOrigins(cloud);
+}
+
 bool OctomapManager::lookupTransform(const std::string& from_frame,
                                      const std::string& to_frame,
                                      const ros::Time& timestamp,
@@ -0,0 +1,161 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/octomap_map_builder.h"
+
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "octomap_world/parallel_for.h"
+#include "octomap_world/point_cloud_io.h"
+
+namespace volumetric_mapping {
+
+OctomapMapBuilder::OctomapMapBuilder(const OctomapParameters& params)
+    : OctomapWorld(params) {}
+
+bool OctomapMapBuilder::readPoseFile(const std::string& pose_file,
+                                     const std::string& cloud_directory,
+                                     CloudVector* clouds) {
+  CHECK_NOTNULL(clouds)->clear();
+  std::ifstream file(pose_file.c_str());
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open pose file " << pose_file;
+    return false;
+  }
+  std::string line;
+  size_t line_number = 0;
+  while (std::getline(file, line)) {
+    ++line_number;
+    std::istringstream tokens(line);
+    std::string filename;
+    if (!(tokens >> filename) || filename[0] == '#') {
+      continue;
+    }
+    double x, y, z, qx, qy, qz, qw;
+    if (!(tokens >> x >> y >> z >> qx >> qy >> qz >> qw)) {
+      LOG(ERROR) << "Invalid pose in line " << line_number << " of "
+                 << pose_file;
+      return false;
+    }
+    Cloud cloud;
+    cloud.filename = cloud_directory + "/" + filename;
+    cloud.T_G_sensor = Transformation(
+        Eigen::Quaterniond(qw, qx, qy, qz).normalized(),
+        Eigen::Vector3d(x, y, z));
+    clouds->push_back(cloud);
+  }
+  return true;
+}
+
+bool OctomapMapBuilder::insertClouds(const CloudVector& clouds,
+                                     size_t* num_points) {
+  CHECK_NOTNULL(num_points);
+  *num_points = 0;
+  // Twice the number of threads, to even out clouds of different sizes.
+  const size_t batch_size = 2 * std::max(params_.num_threads, 1);
+
+  std::vector<CloudUpdate> updates, next_updates;
+  computeBatchUpdates(clouds, 0, batch_size, &updates);
+  for (size_t begin = 0; begin < clouds.size(); begin += batch_size) {
+    // The next batch is read and ray cast while this one is inserted.
+    std::future<void> next_batch =
+        std::async(std::launch::async, [&, begin]() {
+          computeBatchUpdates(clouds, begin + batch_size, batch_size,
+                              &next_updates);
+        });
+
+    bool success = true;
+    for (size_t i = 0; i < updates.size(); ++i) {
+      if (!updates[i].success) {
+        LOG(ERROR) << "Could not read " << clouds[begin + i].filename;
+        success = false;
+        break;
+      }
+      updateOccupancy(&updates[i].free_cells, &updates[i].occupied_cells);
+      *num_points += updates[i].num_points;
+    }
+    next_batch.wait();
+    if (!success) {
+      return false;
+    }
+    updates.swap(next_updates);
+  }
+  return true;
+}
+
+void OctomapMapBuilder::computeCloudUpdate(const Cloud& cloud,
+                                           CloudUpdate* update) const {
+  CHECK_NOTNULL(update);
+  PointCloudReader reader;
+  std::vector<octomap::point3d> points;
+  update->success = reader.open(cloud.filename) &&
+                    reader.readPoints(reader.getNumPoints(), &points, NULL);
+  if (!update->success) {
+    return;
+  }
+  update->num_points = points.size();
+
+  const Eigen::Vector3d& position = cloud.T_G_sensor.getPosition();
+  const octomap::point3d p_G_sensor(position.x(), position.y(), position.z());
+  octomap::KeyRay key_ray;
+  for (const octomap::point3d& p_S_point : points) {
+    const Eigen::Vector3d p_G = cloud.T_G_sensor * Eigen::Vector3d(
+        p_S_point.x(), p_S_point.y(), p_S_point.z());
+    const octomap::point3d p_G_point(p_G.x(), p_G.y(), p_G.z());
+    // Same as insertPointcloudIntoMapImpl().
+    octomap::OcTreeKey key;
+    if (!octree_->coordToKeyChecked(p_G_point, key) ||
+        update->occupied_cells.count(key) > 0) {
+      continue;
+    }
+    castRay(p_G_sensor, p_G_point, &key_ray, &update->free_cells,
+            &update->occupied_cells);
+  }
+}
+
+void OctomapMapBuilder::computeBatchUpdates(
+    const CloudVector& clouds, size_t begin, size_t batch_size,
+    std::vector<CloudUpdate>* updates) const {
+  CHECK_NOTNULL(updates)->clear();
+  if (begin >= clouds.size()) {
+    return;
+  }
+  const size_t end = std::min(begin + batch_size, clouds.size());
+  updates->resize(end - begin);
+  parallelFor(end - begin, params_.num_threads, [&](size_t i) {
+    computeCloudUpdate(clouds[begin + i], &(*updates)[i]);
+  });
+}
+
+}  // namespace volumetric_mapping
@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <chrono>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "octomap_world/octomap_map_builder.h"
+
+DEFINE_string(cloud_directory, ".",
+              "Directory containing the .pcd or .ply point clouds.");
+DEFINE_string(pose_file, "",
+              "File with one line per cloud: file name, then the sensor pose "
+              "in the world frame as x y z qx qy qz qw.");
+DEFINE_string(output_file, "map.bt",
+              "Path to write the map to, in any format of save_map.");
+DEFINE_double(resolution, 0.15, "Resolution of the map in meters.");
+DEFINE_double(probability_hit, 0.65, "Hit probability of a point.");
+DEFINE_double(probability_miss, 0.4, "Miss probability of a ray.");
+DEFINE_double(threshold_min, 0.12, "Lower clamping threshold.");
+DEFINE_double(threshold_max, 0.97, "Upper clamping threshold.");
+DEFINE_double(sensor_max_range, 5.0,
+              "Maximum range of points to insert, negative for unlimited.");
+DEFINE_int32(num_threads, 0, "Number of threads, 0 for all cores.");
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InstallFailureSignalHandler();
+  FLAGS_alsologtostderr = true;
+
+  volumetric_mapping::OctomapParameters params;
+  params.resolution = FLAGS_resolution;
+  params.probability_hit = FLAGS_probability_hit;
+  params.probability_miss = FLAGS_probability_miss;
+  params.threshold_min = FLAGS_threshold_min;
+  params.threshold_max = FLAGS_threshold_max;
+  params.sensor_max_range = FLAGS_sensor_max_range;
+  if (FLAGS_num_threads > 0) {
+    params.num_threads = FLAGS_num_threads;
+  }
+
+  volumetric_mapping::OctomapMapBuilder::CloudVector clouds;
+  if (!volumetric_mapping::OctomapMapBuilder::readPoseFile(
+          FLAGS_pose_file, FLAGS_cloud_directory, &clouds)) {
+    return 1;
+  }
+
+  volumetric_mapping::OctomapMapBuilder builder(params);
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  size_t num_points = 0;
+  if (!builder.insertClouds(clouds, &num_points)) {
+    return 1;
+  }
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  LOG(INFO) << "Inserted " << num_points << " points of " << clouds.size()
+            << " clouds in " << seconds << " s on " << params.num_threads
+            << " threads (" << num_points / std::max(seconds, 1e-9)
+            << " points/s).";
+
+  if (!builder.writeOctomapToFile(FLAGS_output_file)) {
+    LOG(ERROR) << "Could not write the map to " << FLAGS_output_file;
+    return 1;
+  }
+  LOG(INFO) << "Wrote the map to " << FLAGS_output_file;
+  return 0;
+}
@@ -0,0 +1,312 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/octomap_overlay.h"
+
+#include <cmath>
+#include <map>
+
+#include <glog/logging.h>
+
+namespace volumetric_mapping {
+
+OctomapOverlay::OctomapOverlay(const std::shared_ptr<OctomapWorld>& base)
+    : base_(base) {
+  CHECK(base_);
+}
+
+void OctomapOverlay::setFree(const Eigen::Vector3d& position,
+                             const Eigen::Vector3d& bounding_box_size,
+                             const BoundHandling& insertion_method) {
+  setLogOddsBoundingBox(std::vector<Eigen::Vector3d>(1, position),
+                        bounding_box_size,
+                        base_->octree_->getClampingThresMinLog(),
+                        insertion_method);
+}
+
+void OctomapOverlay::setFree(const std::vector<Eigen::Vector3d>& positions,
+                             const Eigen::Vector3d& bounding_box_size,
+                             const BoundHandling& insertion_method) {
+  setLogOddsBoundingBox(positions, bounding_box_size,
+                        base_->octree_->getClampingThresMinLog(),
+                        insertion_method);
+}
+
+void OctomapOverlay::setOccupied(const Eigen::Vector3d& position,
+                                 const Eigen::Vector3d& bounding_box_size,
+                                 const BoundHandling& insertion_method) {
+  setLogOddsBoundingBox(std::vector<Eigen::Vector3d>(1, position),
+                        bounding_box_size,
+                        base_->octree_->getClampingThresMaxLog(),
+                        insertion_method);
+}
+
+void OctomapOverlay::setOccupied(const std::vector<Eigen::Vector3d>& positions,
+                                 const Eigen::Vector3d& bounding_box_size,
+                                 const BoundHandling& insertion_method) {
+  setLogOddsBoundingBox(positions, bounding_box_size,
+                        base_->octree_->getClampingThresMaxLog(),
+                        insertion_method);
+}
+
+void OctomapOverlay::setLogOddsBoundingBox(
+    const std::vector<Eigen::Vector3d>& positions,
+    const Eigen::Vector3d& bounding_box_size, float log_odds_value,
+    const BoundHandling& insertion_method) {
+  const bool check_bounds = base_->hasUpdateBounds();
+  octomap::KeySet keys;
+  for (const Eigen::Vector3d& position : positions) {
+    base_->getKeysBoundingBox(position, bounding_box_size, &keys,
+                              insertion_method);
+  }
+  for (const octomap::OcTreeKey& key : keys) {
+    // Same as OctomapWorld, which would not change these cells either.
+    if (check_bounds && !base_->isInUpdateBounds(key)) {
+      continue;
+    }
+    edits_[key] = log_odds_value;
+  }
+}
+
+void OctomapOverlay::commit() {
+  // Cell centers by log-odds value, for one bounding box update of the base
+  // map per value. A zero size box contains only the cell at its center.
+  std::map<float, std::vector<Eigen::Vector3d>> positions_by_log_odds;
+  for (const KeyLogOddsMap::value_type& edit : edits_) {
+    Eigen::Vector3d position;
+    base_->keyToCoord(edit.first, &position);
+    positions_by_log_odds[edit.second].push_back(position);
+  }
+  for (const std::pair<const float, std::vector<Eigen::Vector3d>>&
+           positions : positions_by_log_odds) {
+    base_->setLogOddsBoundingBox(positions.second, Eigen::Vector3d::Zero(),
+                                 positions.first, BoundHandling::kDefault);
+  }
+  edits_.clear();
+}
+
+OctomapOverlay::CellStatus OctomapOverlay::getCellStatusBoundingBox(
+    const Eigen::Vector3d& point,
+    const Eigen::Vector3d& bounding_box_size) const {
+  octomap::OcTreeKey min_key, max_key;
+  base_->getKeyRange(point - bounding_box_size / 2,
+                     point + bounding_box_size / 2, &min_key, &max_key);
+  if (!hasEditsInKeyRange(min_key, max_key)) {
+    return base_->getCellStatusBoundingBox(point, bounding_box_size);
+  }
+
+  const CellStatus center_status = getCellStatusPoint(point);
+  if (center_status != CellStatus::kFree) {
+    return center_status;
+  }
+  // Unlike OctomapWorld, which iterates over the leaves of the base map,
+  // every cell has to be checked here since edits can split leaves.
+  const float occupancy_threshold_log =
+      base_->octree_->getOccupancyThresLog();
+  bool unknown_found = false;
+  octomap::OcTreeKey key;
+  for (key[2] = min_key[2]; key[2] <= max_key[2]; ++key[2]) {
+    for (key[1] = min_key[1]; key[1] <= max_key[1]; ++key[1]) {
+      for (key[0] = min_key[0]; key[0] <= max_key[0]; ++key[0]) {
+        float log_odds;
+        if (!searchLogOdds(key, &log_odds)) {
+          unknown_found = true;
+        } else if (log_odds >= occupancy_threshold_log &&
+                   !(base_->params_.filter_speckles && isSpeckleNode(key))) {
+          return CellStatus::kOccupied;
+        }
+        if (key[0] == max_key[0]) {
+          break;
+        }
+      }
+      if (key[1] == max_key[1]) {
+        break;
+      }
+    }
+    if (key[2] == max_key[2]) {
+      break;
+    }
+  }
+  return unknown_found ? unknownStatus() : CellStatus::kFree;
+}
+
+OctomapOverlay::CellStatus OctomapOverlay::getCellStatusPoint(
+    const Eigen::Vector3d& point) const {
+  octomap::OcTreeKey key;
+  float log_odds;
+  if (!base_->octree_->coordToKeyChecked(point.x(), point.y(), point.z(),
+                                         key) ||
+      !searchLogOdds(key, &log_odds)) {
+    return unknownStatus();
+  } else if (log_odds >= base_->octree_->getOccupancyThresLog()) {
+    return CellStatus::kOccupied;
+  } else {
+    return CellStatus::kFree;
+  }
+}
+
+OctomapOverlay::CellStatus OctomapOverlay::getLineStatus(
+    const Eigen::Vector3d& start, const Eigen::Vector3d& end) const {
+  octomap::KeyRay key_ray;
+  base_->octree_->computeRayKeys(
+      octomap::point3d(start.x(), start.y(), start.z()),
+      octomap::point3d(end.x(), end.y(), end.z()), key_ray);
+  const float occupancy_threshold_log =
+      base_->octree_->getOccupancyThresLog();
+  for (const octomap::OcTreeKey& key : key_ray) {
+    float log_odds;
+    if (!searchLogOdds(key, &log_odds)) {
+      return unknownStatus();
+    } else if (log_odds >= occupancy_threshold_log) {
+      return CellStatus::kOccupied;
+    }
+  }
+  return CellStatus::kFree;
+}
+
+OctomapOverlay::CellStatus OctomapOverlay::getLineStatusBoundingBox(
+    const Eigen::Vector3d& start, const Eigen::Vector3d& end,
+    const Eigen::Vector3d& bounding_box_size) const {
+  // Same sampling of parallel lines as in OctomapWorld.
+  const double epsilon = 0.001;
+  const double resolution = getResolution();
+  Eigen::Vector3d step;
+  for (int i = 0; i < 3; ++i) {
+    step[i] = bounding_box_size[i] /
+              std::ceil((bounding_box_size[i] + epsilon) / resolution);
+    if (step[i] <= 0.0) {
+      step[i] = 1.0;
+    }
+  }
+
+  const Eigen::Vector3d bounding_box_half_size = bounding_box_size * 0.5;
+  for (double x = -bounding_box_half_size.x(); x <= bounding_box_half_size.x();
+       x += step.x()) {
+    for (double y = -bounding_box_half_size.y();
+         y <= bounding_box_half_size.y(); y += step.y()) {
+      for (double z = -bounding_box_half_size.z();
+           z <= bounding_box_half_size.z(); z += step.z()) {
+        const Eigen::Vector3d offset(x, y, z);
+        const CellStatus status = getLineStatus(start + offset, end + offset);
+        if (status != CellStatus::kFree) {
+          return status;
+        }
+      }
+    }
+  }
+  return CellStatus::kFree;
+}
+
+Eigen::Vector3d OctomapOverlay::getRobotSize() const {
+  return base_->getRobotSize();
+}
+
+bool OctomapOverlay::checkCollisionWithRobot(
+    const Eigen::Vector3d& robot_position) {
+  return checkSinglePoseCollision(robot_position);
+}
+
+bool OctomapOverlay::checkPathForCollisionsWithRobot(
+    const std::vector<Eigen::Vector3d>& robot_positions,
+    size_t* collision_index) {
+  for (size_t i = 0; i < robot_positions.size(); ++i) {
+    if (checkSinglePoseCollision(robot_positions[i])) {
+      if (collision_index != nullptr) {
+        *collision_index = i;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+bool OctomapOverlay::checkSinglePoseCollision(
+    const Eigen::Vector3d& robot_position) const {
+  const CellStatus status =
+      getCellStatusBoundingBox(robot_position, getRobotSize());
+  if (base_->params_.treat_unknown_as_occupied) {
+    return status != CellStatus::kFree;
+  } else {
+    return status == CellStatus::kOccupied;
+  }
+}
+
+bool OctomapOverlay::searchLogOdds(const octomap::OcTreeKey& key,
+                                   float* log_odds) const {
+  KeyLogOddsMap::const_iterator it = edits_.find(key);
+  if (it != edits_.end()) {
+    *log_odds = it->second;
+    return true;
+  }
+  return base_->searchLogOdds(key, log_odds);
+}
+
+bool OctomapOverlay::isSpeckleNode(const octomap::OcTreeKey& key) const {
+  const float occupancy_threshold_log =
+      base_->octree_->getOccupancyThresLog();
+  octomap::OcTreeKey neighbor_key;
+  for (int dz = -1; dz <= 1; ++dz) {
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        if (dx == 0 && dy == 0 && dz == 0) {
+          continue;
+        }
+        neighbor_key[0] = key[0] + dx;
+        neighbor_key[1] = key[1] + dy;
+        neighbor_key[2] = key[2] + dz;
+        float log_odds;
+        if (searchLogOdds(neighbor_key, &log_odds) &&
+            log_odds >= occupancy_threshold_log) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool OctomapOverlay::hasEditsInKeyRange(
+    const octomap::OcTreeKey& min_key,
+    const octomap::OcTreeKey& max_key) const {
+  for (const KeyLogOddsMap::value_type& edit : edits_) {
+    if (edit.first[0] >= min_key[0] && edit.first[0] <= max_key[0] &&
+        edit.first[1] >= min_key[1] && edit.first[1] <= max_key[1] &&
+        edit.first[2] >= min_key[2] && edit.first[2] <= max_key[2]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+OctomapOverlay::CellStatus OctomapOverlay::unknownStatus() const {
+  return base_->params_.treat_unknown_as_occupied ? CellStatus::kOccupied
+                                                  : CellStatus::kUnknown;
+}
+
+}  // namespace volumetric_mapping
@@ -0,0 +1,99 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/octomap_replica.h"
+
+#include <octomap_msgs/GetOctomap.h>
+
+namespace volumetric_mapping {
+
+OctomapReplica::OctomapReplica(const ros::NodeHandle& nh,
+                               const ros::NodeHandle& nh_private)
+    : nh_(nh),
+      nh_private_(nh_private),
+      initialized_(false),
+      last_sequence_(0) {
+  // Only the query parameters matter here, the rest comes with the map.
+  OctomapParameters params;
+  nh_private_.param("treat_unknown_as_occupied",
+                    params.treat_unknown_as_occupied,
+                    params.treat_unknown_as_occupied);
+  nh_private_.param("filter_speckles", params.filter_speckles,
+                    params.filter_speckles);
+  nh_private_.param("threshold_occupancy", params.threshold_occupancy,
+                    params.threshold_occupancy);
+  setOctomapParameters(params);
+
+  get_map_client_ = nh_.serviceClient<octomap_msgs::GetOctomap>("get_map");
+  map_update_sub_ = nh_.subscribe("octomap_updates", 10,
+                                  &OctomapReplica::mapUpdateCallback, this);
+
+  // Bootstrap right away if the manager is already up, otherwise this happens
+  // with the first update.
+  if (get_map_client_.exists()) {
+    requestFullMap();
+  }
+}
+
+void OctomapReplica::mapUpdateCallback(
+    const volumetric_msgs::OctomapUpdate& msg) {
+  // A restarted manager also starts a new sequence.
+  if (!initialized_ || msg.sequence != last_sequence_ + 1) {
+    ROS_INFO_STREAM_COND(initialized_, "Missed octomap updates (expected "
+                                           << last_sequence_ + 1 << ", got "
+                                           << msg.sequence
+                                           << "), requesting full map.");
+    if (!requestFullMap()) {
+      return;
+    }
+  }
+  // Updates carry absolute values, so applying one that is already contained
+  // in a freshly requested full map is harmless.
+  if (applyOctomapUpdateMsg(msg)) {
+    last_sequence_ = msg.sequence;
+  } else {
+    initialized_ = false;
+  }
+}
+
+bool OctomapReplica::requestFullMap() {
+  octomap_msgs::GetOctomap srv;
+  if (!get_map_client_.call(srv)) {
+    ROS_WARN_STREAM_THROTTLE(
+        10, "Could not get full map from " << get_map_client_.getService());
+    initialized_ = false;
+    return false;
+  }
+  setOctomapFromMsg(srv.response.map);
+  initialized_ = true;
+  ROS_INFO_ONCE("Got full map for octomap replica.");
+  return true;
+}
+
+}  // namespace volumetric_mapping
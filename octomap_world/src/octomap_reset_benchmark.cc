@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <octomap/octomap.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <unistd.h>
+
+#include "octomap_world/octomap_world.h"
+
+DEFINE_int32(num_random_points, 200000,
+             "Number of random points of the inserted scan.");
+DEFINE_double(random_extent, 20.0,
+              "Side length in meters of the cube of the inserted scan.");
+DEFINE_double(resolution, 0.1, "Resolution of the map in meters.");
+DEFINE_string(map_file, "/tmp/octomap_reset_benchmark.bt",
+              "Temporary file the map is saved to and reloaded from.");
+
+namespace {
+
+// Resident set size of this process in MB.
+double getResidentMegabytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t total_pages = 0;
+  size_t resident_pages = 0;
+  statm >> total_pages >> resident_pages;
+  return resident_pages * static_cast<double>(sysconf(_SC_PAGESIZE)) /
+         (1024.0 * 1024.0);
+}
+
+double timeSeconds(const std::function<void()>& run) {
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  run();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Rays from a few sensor positions around the center to random points.
+void generateScan(pcl::PointCloud<pcl::PointWithViewpoint>* cloud) {
+  std::mt19937 generator(0);
+  std::uniform_real_distribution<float> position(-FLAGS_random_extent / 2.0,
+                                                 FLAGS_random_extent / 2.0);
+  std::uniform_real_distribution<float> viewpoint(-1.0f, 1.0f);
+  cloud->clear();
+  for (int i = 0; i < FLAGS_num_random_points; ++i) {
+    pcl::PointWithViewpoint point;
+    point.x = position(generator);
+    point.y = position(generator);
+    point.z = position(generator);
+    point.vp_x = viewpoint(generator);
+    point.vp_y = viewpoint(generator);
+    point.vp_z = viewpoint(generator);
+    cloud->push_back(point);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InstallFailureSignalHandler();
+  FLAGS_alsologtostderr = true;
+
+  pcl::PointCloud<pcl::PointWithViewpoint> cloud;
+  generateScan(&cloud);
+  volumetric_mapping::OctomapParameters params;
+  params.resolution = FLAGS_resolution;
+  volumetric_mapping::OctomapWorld world(params);
+  LOG(INFO) << "Before inserting: " << getResidentMegabytes() << " MB RSS.";
+
+  const double insert_seconds =
+      timeSeconds([&]() { world.insertPointcloudWithOrigins(cloud); });
+  LOG(INFO) << "Insertion: " << insert_seconds << " s, "
+            << getResidentMegabytes() << " MB RSS.";
+  if (!world.writeOctomapToFile(FLAGS_map_file)) {
+    return 1;
+  }
+
+  // What resetting and reloading used to cost: reading the map, and deleting
+  // its nodes before the call returned.
+  std::unique_ptr<octomap::OcTree> tree(
+      new octomap::OcTree(FLAGS_resolution));
+  const double read_seconds =
+      timeSeconds([&]() { tree->readBinary(FLAGS_map_file); });
+  LOG(INFO) << "Map of " << tree->size() << " nodes, octomap read "
+            << read_seconds << " s.";
+  const double delete_seconds = timeSeconds([&]() { tree.reset(); });
+
+  const double reset_seconds = timeSeconds([&]() { world.resetMap(); });
+  LOG(INFO) << "Reset: " << reset_seconds << " s, deleting in place "
+            << delete_seconds << " s, " << getResidentMegabytes()
+            << " MB RSS.";
+
+  // Inserting again while the old nodes are deleted in the background.
+  const double reinsert_seconds =
+      timeSeconds([&]() { world.insertPointcloudWithOrigins(cloud); });
+  LOG(INFO) << "Insertion after reset: " << reinsert_seconds << " s, "
+            << getResidentMegabytes() << " MB RSS.";
+
+  const double reload_seconds =
+      timeSeconds([&]() { world.loadOctomapFromFile(FLAGS_map_file); });
+  LOG(INFO) << "Reload: " << reload_seconds << " s, reading and deleting in "
+            << "place " << read_seconds + delete_seconds << " s, "
+            << getResidentMegabytes() << " MB RSS.";
+
+  // Gives the release thread time to return the freed heap.
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  LOG(INFO) << "After releasing: " << getResidentMegabytes() << " MB RSS.";
+  std::remove(FLAGS_map_file.c_str());
+  return 0;
+}
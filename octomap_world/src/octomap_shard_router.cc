@@ -0,0 +1,364 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/octomap_shard_router.h"
+
+#include <cmath>
+#include <limits>
+
+#include <minkindr_conversions/kindr_msg.h>
+#include <minkindr_conversions/kindr_tf.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+namespace volumetric_mapping {
+
+OctomapShardRouter::OctomapShardRouter(const ros::NodeHandle& nh,
+                                       const ros::NodeHandle& nh_private)
+    : nh_(nh), nh_private_(nh_private), world_frame_("world") {
+  nh_private_.param("tf_frame", world_frame_, world_frame_);
+  if (!setupShards()) {
+    ROS_ERROR("No valid shards given, not routing anything.");
+    return;
+  }
+  pointcloud_sub_ = nh_.subscribe(
+      "pointcloud", 40, &OctomapShardRouter::insertPointcloudWithTf, this);
+  advertiseServices();
+}
+
+bool OctomapShardRouter::setupShards() {
+  std::vector<std::string> shard_names;
+  if (!nh_private_.getParam("shards", shard_names) || shard_names.empty()) {
+    return false;
+  }
+
+  for (const std::string& name : shard_names) {
+    Shard shard;
+    shard.name = name;
+    shard.resolution = 0.15;
+    nh_.param(name + "/resolution", shard.resolution, shard.resolution);
+
+    // Same defaults as OctomapParameters: unbounded.
+    shard.min_bound.setConstant(-std::numeric_limits<double>::max());
+    shard.max_bound.setConstant(std::numeric_limits<double>::max());
+    std::vector<double> bound;
+    if (nh_.getParam(name + "/update_min_bound", bound) && bound.size() == 3) {
+      shard.min_bound << bound[0], bound[1], bound[2];
+    }
+    if (nh_.getParam(name + "/update_max_bound", bound) && bound.size() == 3) {
+      shard.max_bound << bound[0], bound[1], bound[2];
+    }
+    ROS_INFO_STREAM("Shard " << name << " owns ["
+                             << shard.min_bound.transpose() << "] to ["
+                             << shard.max_bound.transpose() << "]");
+
+    shard.pointcloud_pub = nh_.advertise<sensor_msgs::PointCloud2>(
+        name + "/world_pointcloud", 40);
+    shard.reset_map_client =
+        nh_.serviceClient<std_srvs::Empty>(name + "/reset_map");
+    shard.publish_all_client =
+        nh_.serviceClient<std_srvs::Empty>(name + "/publish_all");
+    shard.get_map_client =
+        nh_.serviceClient<octomap_msgs::GetOctomap>(name + "/get_map");
+    shard.load_map_client =
+        nh_.serviceClient<volumetric_msgs::LoadMap>(name + "/load_map");
+    shard.save_map_client =
+        nh_.serviceClient<volumetric_msgs::SaveMap>(name + "/save_map");
+    shard.set_box_occupancy_client =
+        nh_.serviceClient<volumetric_msgs::SetBoxOccupancy>(
+            name + "/set_box_occupancy");
+    shard.get_changed_points_client =
+        nh_.serviceClient<volumetric_msgs::GetChangedPoints>(
+            name + "/get_changed_points");
+    shards_.push_back(shard);
+  }
+  return true;
+}
+
+void OctomapShardRouter::advertiseServices() {
+  reset_map_service_ = nh_private_.advertiseService(
+      "reset_map", &OctomapShardRouter::resetMapCallback, this);
+  publish_all_service_ = nh_private_.advertiseService(
+      "publish_all", &OctomapShardRouter::publishAllCallback, this);
+  get_map_service_ = nh_private_.advertiseService(
+      "get_map", &OctomapShardRouter::getOctomapCallback, this);
+  load_octree_service_ = nh_private_.advertiseService(
+      "load_map", &OctomapShardRouter::loadOctomapCallback, this);
+  save_octree_service_ = nh_private_.advertiseService(
+      "save_map", &OctomapShardRouter::saveOctomapCallback, this);
+  set_box_occupancy_service_ = nh_private_.advertiseService(
+      "set_box_occupancy", &OctomapShardRouter::setBoxOccupancyCallback, this);
+  get_changed_points_service_ = nh_private_.advertiseService(
+      "get_changed_points", &OctomapShardRouter::getChangedPointsCallback,
+      this);
+}
+
+void OctomapShardRouter::insertPointcloudWithTf(
+    const sensor_msgs::PointCloud2::ConstPtr& pointcloud) {
+  Transformation T_G_sensor;
+  if (!lookupTransformTf(pointcloud->header.frame_id, world_frame_,
+                         pointcloud->header.stamp, &T_G_sensor)) {
+    return;
+  }
+  const Eigen::Vector3d p_G_sensor = T_G_sensor.getPosition();
+
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  pcl::fromROSMsg(*pointcloud, cloud);
+
+  // Points are forwarded in the world frame with the sensor position as their
+  // viewpoint, so all shards insert the scan with the same transform. The
+  // shards only cast the part of every ray within their bounds.
+  std::vector<pcl::PointCloud<pcl::PointWithViewpoint> > shard_clouds(
+      shards_.size());
+  for (const pcl::PointXYZ& point : cloud) {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+        !std::isfinite(point.z)) {
+      continue;
+    }
+    const Eigen::Vector3d p_G_point =
+        T_G_sensor * Eigen::Vector3d(point.x, point.y, point.z);
+    pcl::PointWithViewpoint world_point;
+    world_point.x = p_G_point.x();
+    world_point.y = p_G_point.y();
+    world_point.z = p_G_point.z();
+    world_point.vp_x = p_G_sensor.x();
+    world_point.vp_y = p_G_sensor.y();
+    world_point.vp_z = p_G_sensor.z();
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      // Pad by one cell: a ray can touch a cell owned by the shard without
+      // entering its bounds.
+      const Eigen::Vector3d padding =
+          Eigen::Vector3d::Constant(shards_[i].resolution);
+      if (segmentIntersectsBox(p_G_sensor, p_G_point,
+                               shards_[i].min_bound - padding,
+                               shards_[i].max_bound + padding)) {
+        shard_clouds[i].push_back(world_point);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (shard_clouds[i].empty()) {
+      continue;
+    }
+    sensor_msgs::PointCloud2 shard_cloud;
+    pcl::toROSMsg(shard_clouds[i], shard_cloud);
+    shard_cloud.header.stamp = pointcloud->header.stamp;
+    shard_cloud.header.frame_id = world_frame_;
+    shards_[i].pointcloud_pub.publish(shard_cloud);
+  }
+}
+
+bool OctomapShardRouter::segmentIntersectsBox(
+    const Eigen::Vector3d& start, const Eigen::Vector3d& end,
+    const Eigen::Vector3d& min_bound, const Eigen::Vector3d& max_bound) {
+  // Slab test, with the segment parametrized as start + t * (end - start) for
+  // t in [0, 1].
+  const Eigen::Vector3d direction = end - start;
+  double t_min = 0.0;
+  double t_max = 1.0;
+  for (int i = 0; i < 3; ++i) {
+    if (std::abs(direction[i]) < std::numeric_limits<double>::epsilon()) {
+      if (start[i] < min_bound[i] || start[i] > max_bound[i]) {
+        return false;
+      }
+      continue;
+    }
+    double t_1 = (min_bound[i] - start[i]) / direction[i];
+    double t_2 = (max_bound[i] - start[i]) / direction[i];
+    if (t_1 > t_2) {
+      std::swap(t_1, t_2);
+    }
+    t_min = std::max(t_min, t_1);
+    t_max = std::min(t_max, t_2);
+    if (t_min > t_max) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool OctomapShardRouter::resetMapCallback(std_srvs::Empty::Request& request,
+                                          std_srvs::Empty::Response& response) {
+  bool success = true;
+  for (Shard& shard : shards_) {
+    std_srvs::Empty srv;
+    success &= shard.reset_map_client.call(srv);
+  }
+  return success;
+}
+
+bool OctomapShardRouter::publishAllCallback(
+    std_srvs::Empty::Request& request, std_srvs::Empty::Response& response) {
+  bool success = true;
+  for (Shard& shard : shards_) {
+    std_srvs::Empty srv;
+    success &= shard.publish_all_client.call(srv);
+  }
+  return success;
+}
+
+bool OctomapShardRouter::getOctomapCallback(
+    octomap_msgs::GetOctomap::Request& request,
+    octomap_msgs::GetOctomap::Response& response) {
+  // Shards only update their own region, but may have loaded more. Clipped to
+  // their bounds, the shard maps are disjoint and merging just combines them.
+  OctomapParameters params;
+  params.resolution = shards_.front().resolution;
+  OctomapWorld map(params);
+  for (Shard& shard : shards_) {
+    octomap_msgs::GetOctomap srv;
+    if (!shard.get_map_client.call(srv)) {
+      ROS_ERROR_STREAM("Could not get the map of shard " << shard.name);
+      return false;
+    }
+    OctomapWorld shard_map(params);
+    shard_map.setOctomapFromMsg(srv.response.map);
+    map.merge(*shard_map.extractSubmap(shard.min_bound, shard.max_bound),
+              Transformation());
+  }
+  return map.getOctomapFullMsg(&response.map);
+}
+
+bool OctomapShardRouter::loadOctomapCallback(
+    volumetric_msgs::LoadMap::Request& request,
+    volumetric_msgs::LoadMap::Response& response) {
+  bool success = true;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    volumetric_msgs::LoadMap srv;
+    srv.request.file_path = getShardFilePath(request.file_path, i);
+    success &= shards_[i].load_map_client.call(srv);
+  }
+  return success;
+}
+
+bool OctomapShardRouter::saveOctomapCallback(
+    volumetric_msgs::SaveMap::Request& request,
+    volumetric_msgs::SaveMap::Response& response) {
+  bool success = true;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    volumetric_msgs::SaveMap srv;
+    srv.request.file_path = getShardFilePath(request.file_path, i);
+    success &= shards_[i].save_map_client.call(srv);
+  }
+  return success;
+}
+
+bool OctomapShardRouter::setBoxOccupancyCallback(
+    volumetric_msgs::SetBoxOccupancy::Request& request,
+    volumetric_msgs::SetBoxOccupancy::Response& response) {
+  Eigen::Vector3d box_center;
+  Eigen::Vector3d box_size;
+  tf::vectorMsgToKindr(request.box_center, &box_center);
+  tf::vectorMsgToKindr(request.box_size, &box_size);
+  const Eigen::Vector3d box_min = box_center - box_size / 2;
+  const Eigen::Vector3d box_max = box_center + box_size / 2;
+
+  bool success = true;
+  for (Shard& shard : shards_) {
+    if ((box_max.array() < shard.min_bound.array()).any() ||
+        (box_min.array() > shard.max_bound.array()).any()) {
+      continue;
+    }
+    volumetric_msgs::SetBoxOccupancy srv;
+    srv.request = request;
+    success &= shard.set_box_occupancy_client.call(srv);
+  }
+  return success;
+}
+
+bool OctomapShardRouter::getChangedPointsCallback(
+    volumetric_msgs::GetChangedPoints::Request& request,
+    volumetric_msgs::GetChangedPoints::Response& response) {
+  // The shards are disjoint, so their changes can just be concatenated.
+  response.size = 0;
+  response.changed_points.clear();
+  response.changed_states.clear();
+  for (Shard& shard : shards_) {
+    volumetric_msgs::GetChangedPoints srv;
+    if (!shard.get_changed_points_client.call(srv)) {
+      return false;
+    }
+    response.size += srv.response.size;
+    response.changed_points.insert(response.changed_points.end(),
+                                   srv.response.changed_points.begin(),
+                                   srv.response.changed_points.end());
+    response.changed_states.insert(response.changed_states.end(),
+                                   srv.response.changed_states.begin(),
+                                   srv.response.changed_states.end());
+  }
+  return true;
+}
+
+std::string OctomapShardRouter::getShardFilePath(const std::string& file_path,
+                                                 size_t shard_index) const {
+  const std::string suffix = "_shard" + std::to_string(shard_index);
+  const size_t extension_start = file_path.find_last_of('.');
+  if (extension_start == std::string::npos ||
+      extension_start < file_path.find_last_of('/') + 1) {
+    return file_path + suffix;
+  }
+  return file_path.substr(0, extension_start) + suffix +
+         file_path.substr(extension_start);
+}
+
+bool OctomapShardRouter::lookupTransformTf(const std::string& from_frame,
+                                           const std::string& to_frame,
+                                           const ros::Time& timestamp,
+                                           Transformation* transform) {
+  tf::StampedTransform tf_transform;
+
+  ros::Time time_to_lookup = timestamp;
+
+  // Same fallback as OctomapManager.
+  if (!tf_listener_.canTransform(to_frame, from_frame, time_to_lookup)) {
+    ros::Duration timestamp_age = ros::Time::now() - time_to_lookup;
+    if (timestamp_age < tf_listener_.getCacheLength()) {
+      time_to_lookup = ros::Time(0);
+    } else {
+      ROS_ERROR("Requested transform time older than cache limit.");
+      return false;
+    }
+  }
+
+  try {
+    tf_listener_.lookupTransform(to_frame, from_frame, time_to_lookup,
+                                 tf_transform);
+  } catch (tf::TransformException& ex) {
+    ROS_ERROR_STREAM(
+        "Error getting TF transform from sensor data: " << ex.what());
+    return false;
+  }
+
+  tf::transformTFToKindr(tf_transform, transform);
+  return true;
+}
+
+}  // namespace volumetric_mapping
@@ -29,15 +29,211 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "octomap_world/octomap_world.h"
 
+#include <algorithm>
+#include <bitset>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
 #include <glog/logging.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <octomap_msgs/conversions.h>
 #include <octomap_ros/conversions.h>
 #include <pcl/conversions.h>
 #include <pcl/filters/filter.h>
+#include <fcntl.h>
 #include <pcl_ros/transforms.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "octomap_world/compression.h"
+#include "octomap_world/octree_serialization.h"
+#include "octomap_world/parallel_for.h"
+#include "octomap_world/point_cloud_io.h"
 
 namespace volumetric_mapping {
 
+namespace {
+
+// Points read from a point cloud file at once, while the previous ones are
+// inserted.
+const size_t kPointCloudFileChunkSize = 1 << 20;
+
+// Depth of the subtrees tracked for incremental pruning. Subtrees of 64 cells
+// per side keep both the number of tracked keys and the work per key small.
+const unsigned int kPruneSubtreeDepth = 10;
+
+// Octrees with fewer nodes are deleted right away when replaced, as handing
+// them to the release thread costs more than that.
+const size_t kBackgroundReleaseMinNodes = 1 << 16;
+
+// Deletes octrees that are no longer used on one thread of its own, as freeing
+// millions of separately allocated nodes takes long, and returns the freed
+// heap to the operating system afterwards. The thread is started with the
+// first octree and joined when the queue is destroyed at exit, after deleting
+// the octrees still queued.
+class OctreeReleaseQueue {
+ public:
+  OctreeReleaseQueue() : stop_(false) {}
+
+  ~OctreeReleaseQueue() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    condition_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  void push(std::shared_ptr<octomap::OcTree> octree) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(octree));
+      if (!thread_.joinable()) {
+        thread_ = std::thread(&OctreeReleaseQueue::run, this);
+      }
+    }
+    condition_.notify_one();
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      condition_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      std::shared_ptr<octomap::OcTree> octree = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+      octree.reset();
+#ifdef __GLIBC__
+      malloc_trim(0);
+#endif
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<std::shared_ptr<octomap::OcTree>> queue_;
+  bool stop_;
+  std::thread thread_;
+};
+
+// Deletes an octree that is no longer used, large ones on the release thread.
+void releaseOctree(std::shared_ptr<octomap::OcTree> octree) {
+  // Octrees shared with copy-on-write clones stay alive anyway.
+  if (!octree || octree.use_count() > 1 ||
+      octree->size() < kBackgroundReleaseMinNodes) {
+    return;
+  }
+  // Destroyed at exit, after all octrees released while running.
+  static OctreeReleaseQueue release_queue;
+  release_queue.push(std::move(octree));
+}
+
+// Lower-case extension of the file name without the dot, or an empty string.
+std::string getFileExtension(const std::string& filename) {
+  const size_t extension_start = filename.find_last_of('.');
+  if (extension_start == std::string::npos ||
+      extension_start < filename.find_last_of('/') + 1) {
+    return std::string();
+  }
+  std::string extension = filename.substr(extension_start + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 ::tolower);
+  return extension;
+}
+
+// Read-only stream over memory it does not own, to read from a buffer without
+// copying it into a stringstream first.
+class MemoryStreamBuffer : public std::streambuf {
+ public:
+  MemoryStreamBuffer(char* data, size_t size) { setg(data, data, data + size); }
+};
+
+std::string getTilePath(const std::string& directory,
+                        const octomap::OcTreeKey& tile_key) {
+  std::stringstream path;
+  path << directory << "/tile_" << tile_key[0] << "_" << tile_key[1] << "_"
+       << tile_key[2] << ".ot";
+  return path.str();
+}
+
+// The index of a tiled map store is a text file with the resolution and tile
+// depth on the first line, followed by the keys of all tiles, one per line.
+std::string getTileIndexPath(const std::string& directory) {
+  return directory + "/index";
+}
+
+bool readTileIndex(const std::string& directory, double* resolution,
+                   unsigned int* tile_depth, octomap::KeySet* tile_keys) {
+  std::ifstream file(getTileIndexPath(directory).c_str());
+  if (!(file >> *resolution >> *tile_depth)) {
+    return false;
+  }
+  unsigned int x, y, z;
+  while (file >> x >> y >> z) {
+    tile_keys->insert(octomap::OcTreeKey(x, y, z));
+  }
+  return file.eof();
+}
+
+bool writeTileIndex(const std::string& directory, double resolution,
+                    unsigned int tile_depth,
+                    const octomap::KeySet& tile_keys) {
+  // Replace the index in one step, so it never lists missing tiles.
+  const std::string path = getTileIndexPath(directory);
+  const std::string temporary_path = path + ".tmp";
+  std::ofstream file(temporary_path.c_str(), std::ios_base::trunc);
+  file << std::setprecision(17) << resolution << " " << tile_depth << "\n";
+  for (const octomap::OcTreeKey& tile_key : tile_keys) {
+    file << tile_key[0] << " " << tile_key[1] << " " << tile_key[2] << "\n";
+  }
+  file.close();
+  return !file.fail() && std::rename(temporary_path.c_str(), path.c_str()) == 0;
+}
+
+// Syncs the file at temporary_path to disk and renames it to path, so a crash
+// leaves either the old or the new file at path, but never a partial one.
+bool syncAndReplaceFile(const std::string& temporary_path,
+                        const std::string& path) {
+  const int fd = open(temporary_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool synced = fsync(fd) == 0;
+  close(fd);
+  if (!synced || std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    return false;
+  }
+  // The rename itself is only durable once the directory is synced.
+  const size_t directory_end = path.find_last_of('/');
+  const std::string directory =
+      directory_end == std::string::npos ? "." : path.substr(0, directory_end);
+  const int directory_fd = open(directory.c_str(), O_RDONLY);
+  if (directory_fd >= 0) {
+    fsync(directory_fd);
+    close(directory_fd);
+  }
+  return true;
+}
+
+}  // namespace
+
 // Convenience functions for octomap point <-> eigen conversions.
 octomap::point3d pointEigenToOctomap(const Eigen::Vector3d& point) {
   return octomap::point3d(point.x(), point.y(), point.z());
@@ -51,56 +247,200 @@ OctomapWorld::OctomapWorld() : OctomapWorld(OctomapParameters()) {}
 
 // Creates an octomap with the correct parameters.
 OctomapWorld::OctomapWorld(const OctomapParameters& params)
-    : robot_size_(Eigen::Vector3d::Ones()) {
+    : map_version_(0),
+      binary_msg_version_(0),
+      full_msg_version_(0),
+      map_bounds_version_(0),
+      map_bounds_empty_(true),
+      tile_depth_(0),
+      all_tiles_dirty_(false),
+      all_unpruned_(false),
+      robot_size_(Eigen::Vector3d::Ones()) {
   setOctomapParameters(params);
 }
 
-// Creates deepcopy of OctomapWorld
-OctomapWorld::OctomapWorld(const OctomapWorld& rhs) {
+// Creates deepcopy of OctomapWorld by copying the nodes of the octree.
+OctomapWorld::OctomapWorld(const OctomapWorld& rhs)
+    : map_version_(0),
+      binary_msg_version_(0),
+      full_msg_version_(0),
+      map_bounds_version_(0),
+      map_bounds_empty_(true),
+      tile_depth_(0),
+      all_tiles_dirty_(false),
+      unpruned_subtrees_(rhs.unpruned_subtrees_),
+      all_unpruned_(rhs.all_unpruned_) {
   OctomapParameters params;
   rhs.getOctomapParameters(&params);
   setOctomapParameters(params);
   robot_size_ = rhs.getRobotSize();
 
-  // Get rhs octomap binary
-  std::stringstream datastream;
-  rhs.writeOctomapToBinaryConst(datastream);
-  // Write octomap binary
-  if (!octree_->readBinary(datastream)) {
-    std::cerr << "Could not copy octree!\n";
+  rhs.loadFullMap();
+  octree_.reset(new octomap::OcTree(*rhs.octree_));
+  applyParametersToOctree();
+}
+
+std::shared_ptr<OctomapWorld> OctomapWorld::getSnapshot() const {
+  loadFullMap();
+  std::shared_ptr<OctomapWorld> snapshot(new OctomapWorld(params_));
+  snapshot->octree_.reset(new octomap::OcTree(*octree_));
+  snapshot->applyParametersToOctree();
+  snapshot->robot_size_ = robot_size_;
+  snapshot->unpruned_subtrees_ = unpruned_subtrees_;
+  snapshot->all_unpruned_ = all_unpruned_;
+  return snapshot;
+}
+
+std::shared_ptr<OctomapWorld> OctomapWorld::getCopyOnWriteClone() const {
+  std::lock_guard<std::recursive_mutex> lock(lazy_load_mutex_);
+  std::shared_ptr<OctomapWorld> clone(new OctomapWorld(params_));
+  clone->octree_ = octree_;
+  // Parts of the map not loaded yet are loaded by whichever of the two needs
+  // them, from the same read-only linear octree or tiled map store.
+  clone->linear_octree_ = linear_octree_;
+  clone->tile_directory_ = tile_directory_;
+  clone->tile_depth_ = tile_depth_;
+  clone->stored_tiles_ = stored_tiles_;
+  clone->unloaded_tiles_ = unloaded_tiles_;
+  clone->dirty_tiles_ = dirty_tiles_;
+  clone->all_tiles_dirty_ = all_tiles_dirty_;
+  clone->robot_size_ = robot_size_;
+  clone->unpruned_subtrees_ = unpruned_subtrees_;
+  clone->all_unpruned_ = all_unpruned_;
+  return clone;
+}
+
+std::shared_ptr<OctomapWorld> OctomapWorld::extractSubmap(
+    const Eigen::Vector3d& bbx_min, const Eigen::Vector3d& bbx_max) const {
+  std::shared_ptr<OctomapWorld> submap(new OctomapWorld(params_));
+  submap->robot_size_ = robot_size_;
+  promoteLinearOctree();
+  octomap::OcTreeKey min_key, max_key;
+  getKeyRange(bbx_min, bbx_max, &min_key, &max_key);
+  loadTilesInKeyRange(min_key, max_key);
+  if (octree_->getRoot() == NULL) {
+    return submap;
   }
-  octree_->prune();
+
+  const octomap::OcTreeKey root_key(0, 0, 0);
+  bool created;
+  octomap::OcTreeNode* submap_root =
+      submap->getOrCreateNodeAtDepth(root_key, 0, &created);
+  if (copySubmapRecurs(octree_->getRoot(), root_key, 0, min_key, max_key,
+                       submap_root, submap.get())) {
+    submap->octree_->updateInnerOccupancy();
+    // Clipped nodes are split into equal children.
+    submap->octree_->prune();
+  } else {
+    submap->octree_->clear();
+  }
+  return submap;
 }
 
 void OctomapWorld::resetMap() {
-  if (!octree_) {
-    octree_.reset(new octomap::OcTree(params_.resolution));
+  replaceOctree(new octomap::OcTree(params_.resolution));
+  applyParametersToOctree();
+  linear_octree_.reset();
+  closeTiledMapStore();
+  unpruned_subtrees_.clear();
+  all_unpruned_ = false;
+  incrementMapVersion();
+}
+
+void OctomapWorld::prune() {
+  // Nothing to do also means no copy of an octree shared with clones.
+  if (!all_unpruned_ && unpruned_subtrees_.empty()) {
+    return;
+  }
+  promoteLinearOctree();
+  detachOctree(true);
+  if (all_unpruned_) {
+    octree_->prune();
+  } else {
+    for (const octomap::OcTreeKey& key : unpruned_subtrees_) {
+      pruneSubtree(key, std::min(kPruneSubtreeDepth, octree_->getTreeDepth()));
+    }
+  }
+  unpruned_subtrees_.clear();
+  all_unpruned_ = false;
+}
+
+void OctomapWorld::pruneLossy(double log_odds_tolerance,
+                              LossyPruneReport* report) {
+  loadFullMap();
+  detachOctree(true);
+  markAllTilesDirty();
+  LossyPruneReport local_report;
+  if (report == NULL) {
+    report = &local_report;
   }
-  octree_->clear();
+  report->num_nodes_before = octree_->size();
+  report->memory_before = octree_->memoryUsage();
+  report->max_probability_error = 0.0;
+  if (octree_->getRoot() != NULL) {
+    float min_log_odds, max_log_odds;
+    bool full;
+    pruneLossyRecurs(octree_->getRoot(), log_odds_tolerance, &min_log_odds,
+                     &max_log_odds, &full, &report->max_probability_error);
+  }
+  // Equal children are merged as well.
+  unpruned_subtrees_.clear();
+  all_unpruned_ = false;
+  report->num_nodes_after = octree_->size();
+  report->memory_after = octree_->memoryUsage();
+  incrementMapVersion();
 }
 
-void OctomapWorld::prune() { octree_->prune(); }
+bool OctomapWorld::freeze() {
+  if (linear_octree_) {
+    return true;
+  }
+  loadFullMap();
+  prune();
+  std::unique_ptr<LinearOctree> linear_octree(new LinearOctree());
+  if (!linear_octree->build(*octree_,
+                            params_.linear_octree_log_odds_bits)) {
+    return false;
+  }
+  replaceOctree(new octomap::OcTree(octree_->getResolution()));
+  applyParametersToOctree();
+  linear_octree_ = std::move(linear_octree);
+  return true;
+}
 
 void OctomapWorld::setOctomapParameters(const OctomapParameters& params) {
   if (octree_) {
     if (octree_->getResolution() != params.resolution) {
       LOG(WARNING) << "Octomap resolution has changed! Resetting tree!";
-      octree_.reset(new octomap::OcTree(params.resolution));
+      replaceOctree(new octomap::OcTree(params.resolution));
+      linear_octree_.reset();
+      closeTiledMapStore();
+      if (scan_journal_) {
+        LOG(WARNING) << "Closing the scan journal of the old resolution.";
+        closeScanJournal();
+      }
     }
   } else {
     octree_.reset(new octomap::OcTree(params.resolution));
   }
 
-  octree_->setProbHit(params.probability_hit);
-  octree_->setProbMiss(params.probability_miss);
-  octree_->setClampingThresMin(params.threshold_min);
-  octree_->setClampingThresMax(params.threshold_max);
-  octree_->setOccupancyThres(params.threshold_occupancy);
-  octree_->enableChangeDetection(params.change_detection_enabled);
-
   // Copy over all the parameters for future use (some are not used just for
   // creating the octree).
   params_ = params;
+  applyParametersToOctree();
+}
+
+void OctomapWorld::applyParametersToOctree() {
+  detachOctree(true);
+  octree_->setProbHit(params_.probability_hit);
+  octree_->setProbMiss(params_.probability_miss);
+  octree_->setClampingThresMin(params_.threshold_min);
+  octree_->setClampingThresMax(params_.threshold_max);
+  octree_->setOccupancyThres(params_.threshold_occupancy);
+  octree_->enableChangeDetection(params_.change_detection_enabled);
+  // Thresholds affect the binary serialization, and this is also called
+  // whenever the octree is replaced.
+  incrementMapVersion();
 }
 
 void OctomapWorld::getOctomapParameters(OctomapParameters* params) const {
@@ -140,6 +480,24 @@ void OctomapWorld::insertPointcloudIntoMapImpl(
   updateOccupancy(&free_cells, &occupied_cells);
 }
 
+void OctomapWorld::insertPointcloudWithOrigins(
+    const pcl::PointCloud<pcl::PointWithViewpoint>& cloud) {
+  octomap::KeySet free_cells, occupied_cells;
+  for (const pcl::PointWithViewpoint& point : cloud) {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+        !std::isfinite(point.z)) {
+      continue;
+    }
+    const octomap::point3d p_G_point(point.x, point.y, point.z);
+    const octomap::OcTreeKey key = octree_->coordToKey(p_G_point);
+    if (occupied_cells.find(key) == occupied_cells.end()) {
+      castRay(octomap::point3d(point.vp_x, point.vp_y, point.vp_z), p_G_point,
+              &free_cells, &occupied_cells);
+    }
+  }
+  updateOccupancy(&free_cells, &occupied_cells);
+}
+
 void OctomapWorld::insertProjectedDisparityIntoMapImpl(
     const Transformation& sensor_to_world, const cv::Mat& projected_points) {
   // Get the sensor origin in the world frame.
@@ -174,22 +532,115 @@ void OctomapWorld::insertProjectedDisparityIntoMapImpl(
   updateOccupancy(&free_cells, &occupied_cells);
 }
 
+bool OctomapWorld::insertPointCloudFile(const std::string& filename,
+                                        bool cast_rays) {
+  // Imported files are not journaled, like loaded maps. The journal is moved
+  // aside so updateOccupancy() does not append to it.
+  std::unique_ptr<ScanJournal> scan_journal;
+  scan_journal.swap(scan_journal_);
+  const bool success = insertPointCloudFileChunks(filename, cast_rays);
+  scan_journal_.swap(scan_journal);
+  return success;
+}
+
+bool OctomapWorld::insertPointCloudFileChunks(const std::string& filename,
+                                              bool cast_rays) {
+  PointCloudReader reader;
+  if (!reader.open(filename)) {
+    return false;
+  }
+  if (cast_rays && !reader.hasOrigins()) {
+    LOG(ERROR) << filename << " has no sensor origins to cast rays from.";
+    return false;
+  }
+
+  std::vector<octomap::point3d> points, origins, next_points, next_origins;
+  if (!reader.readPoints(kPointCloudFileChunkSize, &points, &origins)) {
+    return false;
+  }
+  while (!points.empty()) {
+    std::future<bool> next_read = std::async(std::launch::async, [&]() {
+      return reader.readPoints(kPointCloudFileChunkSize, &next_points,
+                               &next_origins);
+    });
+
+    // More slices than threads, so threads with cheaper slices (e.g. shorter
+    // rays) can take over others.
+    const size_t num_slices = 4 * std::max(params_.num_threads, 1);
+    std::vector<octomap::KeySet> free_slices(num_slices);
+    std::vector<octomap::KeySet> occupied_slices(num_slices);
+    parallelFor(num_slices, params_.num_threads, [&](size_t slice) {
+      octomap::KeyRay key_ray;
+      octomap::KeySet& free_cells = free_slices[slice];
+      octomap::KeySet& occupied_cells = occupied_slices[slice];
+      const size_t end = points.size() * (slice + 1) / num_slices;
+      for (size_t i = points.size() * slice / num_slices; i < end; ++i) {
+        octomap::OcTreeKey key;
+        if (!octree_->coordToKeyChecked(points[i], key) ||
+            occupied_cells.count(key) > 0) {
+          continue;
+        }
+        if (cast_rays) {
+          castRay(origins[i], points[i], &key_ray, &free_cells,
+                  &occupied_cells);
+        } else {
+          occupied_cells.insert(key);
+        }
+      }
+    });
+    for (size_t slice = 1; slice < num_slices; ++slice) {
+      free_slices[0].insert(free_slices[slice].begin(),
+                            free_slices[slice].end());
+      occupied_slices[0].insert(occupied_slices[slice].begin(),
+                                occupied_slices[slice].end());
+    }
+    updateOccupancy(&free_slices[0], &occupied_slices[0]);
+
+    if (!next_read.get()) {
+      return false;
+    }
+    points.swap(next_points);
+    origins.swap(next_origins);
+  }
+  return true;
+}
+
 void OctomapWorld::castRay(const octomap::point3d& sensor_origin,
                            const octomap::point3d& point,
                            octomap::KeySet* free_cells,
                            octomap::KeySet* occupied_cells) {
+  castRay(sensor_origin, point, &key_ray_, free_cells, occupied_cells);
+}
+
+void OctomapWorld::castRay(const octomap::point3d& sensor_origin,
+                           const octomap::point3d& point,
+                           octomap::KeyRay* key_ray,
+                           octomap::KeySet* free_cells,
+                           octomap::KeySet* occupied_cells) const {
+  CHECK_NOTNULL(key_ray);
   CHECK_NOTNULL(free_cells);
   CHECK_NOTNULL(occupied_cells);
 
-  if (params_.sensor_max_range < 0.0 ||
-      (point - sensor_origin).norm() <= params_.sensor_max_range) {
-    // Cast a ray to compute all the free cells.
-    key_ray_.reset();
-    if (octree_->computeRayKeys(sensor_origin, point, key_ray_)) {
+  // If the ray is longer than the max range, just update free space.
+  const bool in_range =
+      params_.sensor_max_range < 0.0 ||
+      (point - sensor_origin).norm() <= params_.sensor_max_range;
+  octomap::point3d ray_start = sensor_origin;
+  octomap::point3d ray_end =
+      in_range ? point
+               : sensor_origin +
+                     (point - sensor_origin).normalized() *
+                         params_.sensor_max_range;
+  // Cells outside the update bounds are dropped anyway, so the ray is only
+  // cast through the bounds padded by a cell. This keeps shards of a map from
+  // all casting the full rays.
+  if (!hasUpdateBounds() || clipRayToUpdateBounds(&ray_start, &ray_end)) {
+    key_ray->reset();
+    if (octree_->computeRayKeys(ray_start, ray_end, *key_ray)) {
       if (params_.max_free_space == 0.0) {
-        free_cells->insert(key_ray_.begin(), key_ray_.end());
+        free_cells->insert(key_ray->begin(), key_ray->end());
       } else {
-        for (const auto& key : key_ray_) {
+        for (const auto& key : *key_ray) {
           octomap::point3d voxel_coordinate = octree_->keyToCoord(key);
           if ((voxel_coordinate - sensor_origin).norm() <
                   params_.max_free_space ||
@@ -200,33 +651,48 @@ void OctomapWorld::castRay(const octomap::point3d& sensor_origin,
         }
       }
     }
+  }
+  if (in_range) {
     // Mark endpoing as occupied.
     octomap::OcTreeKey key;
     if (octree_->coordToKeyChecked(point, key)) {
       occupied_cells->insert(key);
     }
-  } else {
-    // If the ray is longer than the max range, just update free space.
-    octomap::point3d new_end =
-        sensor_origin +
-        (point - sensor_origin).normalized() * params_.sensor_max_range;
-    key_ray_.reset();
-    if (octree_->computeRayKeys(sensor_origin, new_end, key_ray_)) {
-      if (params_.max_free_space == 0.0) {
-        free_cells->insert(key_ray_.begin(), key_ray_.end());
-      } else {
-        for (const auto& key : key_ray_) {
-          octomap::point3d voxel_coordinate = octree_->keyToCoord(key);
-          if ((voxel_coordinate - sensor_origin).norm() <
-                  params_.max_free_space ||
-              voxel_coordinate.z() >
-                  (sensor_origin.z() - params_.min_height_free_space)) {
-            free_cells->insert(key);
-          }
-        }
+  }
+}
+
+bool OctomapWorld::clipRayToUpdateBounds(octomap::point3d* start,
+                                         octomap::point3d* end) const {
+  // Slab test, with the ray parametrized as start + t * (end - start) for t
+  // in [0, 1].
+  const double padding = octree_->getResolution();
+  const octomap::point3d direction = *end - *start;
+  double t_min = 0.0;
+  double t_max = 1.0;
+  for (unsigned int i = 0; i < 3; ++i) {
+    const double min_bound = params_.update_min_bound[i] - padding;
+    const double max_bound = params_.update_max_bound[i] + padding;
+    if (std::abs(direction(i)) < std::numeric_limits<float>::epsilon()) {
+      if ((*start)(i) < min_bound || (*start)(i) > max_bound) {
+        return false;
       }
+      continue;
+    }
+    double t_1 = (min_bound - (*start)(i)) / direction(i);
+    double t_2 = (max_bound - (*start)(i)) / direction(i);
+    if (t_1 > t_2) {
+      std::swap(t_1, t_2);
+    }
+    t_min = std::max(t_min, t_1);
+    t_max = std::min(t_max, t_2);
+    if (t_min > t_max) {
+      return false;
     }
   }
+  const octomap::point3d clipped_start = *start + direction * t_min;
+  *end = *start + direction * t_max;
+  *start = clipped_start;
+  return true;
 }
 
 bool OctomapWorld::isValidPoint(const cv::Vec3f& point) const {
@@ -235,16 +701,67 @@ bool OctomapWorld::isValidPoint(const cv::Vec3f& point) const {
   return point[2] != 10000.0f && !std::isinf(point[2]);
 }
 
+bool OctomapWorld::hasUpdateBounds() const {
+  return params_.update_min_bound.maxCoeff() >
+             -std::numeric_limits<double>::max() ||
+         params_.update_max_bound.minCoeff() <
+             std::numeric_limits<double>::max();
+}
+
+bool OctomapWorld::isInUpdateBounds(const octomap::OcTreeKey& key) const {
+  Eigen::Vector3d center;
+  keyToCoord(key, &center);
+  return (center.array() >= params_.update_min_bound.array()).all() &&
+         (center.array() < params_.update_max_bound.array()).all();
+}
+
 void OctomapWorld::updateOccupancy(octomap::KeySet* free_cells,
                                    octomap::KeySet* occupied_cells) {
+  // Insertions only extend the map bounds, so they stay up to date.
+  const bool map_bounds_up_to_date = (map_bounds_version_ == map_version_);
+  applyOccupancyUpdate(free_cells, occupied_cells, false);
+  octree_->updateInnerOccupancy();
+  if (scan_journal_) {
+    // Occupied cells have been removed from the free cells at this point.
+    scan_journal_->append(*free_cells, *occupied_cells);
+  }
+  incrementMapVersion();
+  if (map_bounds_up_to_date) {
+    map_bounds_version_ = map_version_;
+  }
+}
+
+void OctomapWorld::applyOccupancyUpdate(octomap::KeySet* free_cells,
+                                        octomap::KeySet* occupied_cells,
+                                        bool lazy_eval) {
   CHECK_NOTNULL(free_cells);
   CHECK_NOTNULL(occupied_cells);
+  promoteLinearOctree();
+  detachOctree(true);
+  if (!tile_directory_.empty()) {
+    // Tiles have to be read before they can be changed.
+    octomap::KeySet tile_keys;
+    for (const octomap::KeySet* cells : {free_cells, occupied_cells}) {
+      for (const octomap::OcTreeKey& key : *cells) {
+        tile_keys.insert(octree_->adjustKeyAtDepth(key, tile_depth_));
+      }
+    }
+    for (const octomap::OcTreeKey& tile_key : tile_keys) {
+      loadTile(tile_key);
+    }
+    markTilesDirty(tile_keys);
+  }
+  const bool check_bounds = hasUpdateBounds();
 
   // Mark occupied cells.
   for (octomap::KeySet::iterator it = occupied_cells->begin(),
                                  end = occupied_cells->end();
        it != end; it++) {
-    octree_->updateNode(*it, true);
+    if (check_bounds && !isInUpdateBounds(*it)) {
+      continue;
+    }
+    octree_->updateNode(*it, true, lazy_eval);
+    extendMapBounds(*it);
 
     // Remove any occupied cells from free cells - assume there are far fewer
     // occupied cells than free cells, so this is much faster than checking on
@@ -258,9 +775,12 @@ void OctomapWorld::updateOccupancy(octomap::KeySet* free_cells,
   for (octomap::KeySet::iterator it = free_cells->begin(),
                                  end = free_cells->end();
        it != end; ++it) {
-    octree_->updateNode(*it, false);
+    if (check_bounds && !isInUpdateBounds(*it)) {
+      continue;
+    }
+    octree_->updateNode(*it, false, lazy_eval);
+    extendMapBounds(*it);
   }
-  octree_->updateInnerOccupancy();
 }
 
 void OctomapWorld::enableTreatUnknownAsOccupied() {
@@ -297,6 +817,12 @@ OctomapWorld::CellStatus OctomapWorld::getCellStatusBoundingBox(
   octomap::point3d bbx_min = pointEigenToOctomap(bbx_min_eigen);
   octomap::point3d bbx_max = pointEigenToOctomap(bbx_max_eigen);
 
+  octomap::OcTreeKey min_key, max_key;
+  getKeyRange(bbx_min_eigen, bbx_max_eigen, &min_key, &max_key);
+  if (linear_octree_) {
+    return getLinearOctreeStatusKeyRange(min_key, max_key);
+  }
+  loadTilesInKeyRange(min_key, max_key);
   for (octomap::OcTree::leaf_bbx_iterator
            iter = octree_->begin_leafs_bbx(bbx_min, bbx_max),
            end = octree_->end_leafs_bbx();
@@ -343,16 +869,43 @@ OctomapWorld::CellStatus OctomapWorld::getCellStatusBoundingBox(
   return CellStatus::kFree;
 }
 
+OctomapWorld::CellStatus OctomapWorld::getLinearOctreeStatusKeyRange(
+    const octomap::OcTreeKey& min_key,
+    const octomap::OcTreeKey& max_key) const {
+  const float occupancy_threshold = octree_->getOccupancyThresLog();
+  bool occupied = false;
+  bool unknown;
+  linear_octree_->forEachLeafInKeyRange(
+      min_key, max_key,
+      [&](const octomap::OcTreeKey& leaf_min_key, unsigned int depth,
+          float log_odds) {
+        if (log_odds < occupancy_threshold ||
+            (params_.filter_speckles &&
+             isSpeckleNode(octree_->adjustKeyAtDepth(leaf_min_key, depth)))) {
+          return true;
+        }
+        occupied = true;
+        return false;
+      },
+      &unknown);
+  if (occupied || (unknown && params_.treat_unknown_as_occupied)) {
+    return CellStatus::kOccupied;
+  }
+  return unknown ? CellStatus::kUnknown : CellStatus::kFree;
+}
+
 OctomapWorld::CellStatus OctomapWorld::getCellStatusPoint(
     const Eigen::Vector3d& point) const {
-  octomap::OcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
-  if (node == NULL) {
+  octomap::OcTreeKey key;
+  float log_odds;
+  if (!octree_->coordToKeyChecked(point.x(), point.y(), point.z(), key) ||
+      !searchLogOdds(key, &log_odds)) {
     if (params_.treat_unknown_as_occupied) {
       return CellStatus::kOccupied;
     } else {
       return CellStatus::kUnknown;
     }
-  } else if (octree_->isNodeOccupied(node)) {
+  } else if (log_odds >= octree_->getOccupancyThresLog()) {
     return CellStatus::kOccupied;
   } else {
     return CellStatus::kFree;
@@ -362,10 +915,12 @@ OctomapWorld::CellStatus OctomapWorld::getCellStatusPoint(
 // Returns kUnknown even if treat_unknown_as_occupied is true.
 OctomapWorld::CellStatus OctomapWorld::getCellTrueStatusPoint(
     const Eigen::Vector3d& point) const {
-  octomap::OcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
-  if (node == NULL) {
+  octomap::OcTreeKey key;
+  float log_odds;
+  if (!octree_->coordToKeyChecked(point.x(), point.y(), point.z(), key) ||
+      !searchLogOdds(key, &log_odds)) {
     return CellStatus::kUnknown;
-  } else if (octree_->isNodeOccupied(node)) {
+  } else if (log_odds >= octree_->getOccupancyThresLog()) {
     return CellStatus::kOccupied;
   } else {
     return CellStatus::kFree;
@@ -374,17 +929,19 @@ OctomapWorld::CellStatus OctomapWorld::getCellTrueStatusPoint(
 
 OctomapWorld::CellStatus OctomapWorld::getCellProbabilityPoint(
     const Eigen::Vector3d& point, double* probability) const {
-  octomap::OcTreeNode* node = octree_->search(point.x(), point.y(), point.z());
-  if (node == NULL) {
+  octomap::OcTreeKey key;
+  float log_odds;
+  if (!octree_->coordToKeyChecked(point.x(), point.y(), point.z(), key) ||
+      !searchLogOdds(key, &log_odds)) {
     if (probability) {
       *probability = -1.0;
     }
     return CellStatus::kUnknown;
   } else {
     if (probability) {
-      *probability = node->getOccupancy();
+      *probability = octomap::probability(log_odds);
     }
-    if (octree_->isNodeOccupied(node)) {
+    if (log_odds >= octree_->getOccupancyThresLog()) {
       return CellStatus::kOccupied;
     } else {
       return CellStatus::kFree;
@@ -402,15 +959,16 @@ OctomapWorld::CellStatus OctomapWorld::getLineStatus(
                           key_ray);
 
   // Now check if there are any unknown or occupied nodes in the ray.
+  const float occupancy_threshold_log = octree_->getOccupancyThresLog();
   for (octomap::OcTreeKey key : key_ray) {
-    octomap::OcTreeNode* node = octree_->search(key);
-    if (node == NULL) {
+    float log_odds;
+    if (!searchLogOdds(key, &log_odds)) {
       if (params_.treat_unknown_as_occupied) {
         return CellStatus::kOccupied;
       } else {
         return CellStatus::kUnknown;
       }
-    } else if (octree_->isNodeOccupied(node)) {
+    } else if (log_odds >= occupancy_threshold_log) {
       return CellStatus::kOccupied;
     }
   }
@@ -433,14 +991,15 @@ OctomapWorld::CellStatus OctomapWorld::getVisibility(
 
   // Now check if there are any unknown or occupied nodes in the ray,
   // except for the voxel_to_test key.
+  const float occupancy_threshold_log = octree_->getOccupancyThresLog();
   for (octomap::OcTreeKey key : key_ray) {
     if (key != voxel_to_test_key) {
-      octomap::OcTreeNode* node = octree_->search(key);
-      if (node == NULL) {
+      float log_odds;
+      if (!searchLogOdds(key, &log_odds)) {
         if (stop_at_unknown_cell) {
           return CellStatus::kUnknown;
         }
-      } else if (octree_->isNodeOccupied(node)) {
+      } else if (log_odds >= occupancy_threshold_log) {
         return CellStatus::kOccupied;
       }
     }
@@ -524,6 +1083,9 @@ void OctomapWorld::setOccupied(const std::vector<Eigen::Vector3d>& positions,
 
 void OctomapWorld::setBordersOccupied(const Eigen::Vector3d& cropping_size) {
   // Crop map size by setting borders occupied
+  loadFullMap();
+  detachOctree(true);
+  markAllTilesDirty();
   const bool lazy_eval = true;
   const double log_odds_value = octree_->getClampingThresMaxLog();
   octomap::KeySet occupied_keys;
@@ -571,12 +1133,15 @@ void OctomapWorld::setBordersOccupied(const Eigen::Vector3d& cropping_size) {
   if (lazy_eval) {
     octree_->updateInnerOccupancy();
   }
-  octree_->prune();
+  markUnpruned(occupied_keys);
+  prune();
+  incrementMapVersion();
 }
 
 void OctomapWorld::getOccupiedPointCloud(
     pcl::PointCloud<pcl::PointXYZ>* output_cloud) const {
   CHECK_NOTNULL(output_cloud)->clear();
+  loadFullMap();
   unsigned int max_tree_depth = octree_->getTreeDepth();
   double resolution = octree_->getResolution();
   for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs();
@@ -616,6 +1181,43 @@ void OctomapWorld::getOccupiedPointCloud(
   }
 }
 
+bool OctomapWorld::writeOccupiedPointCloudFile(const std::string& filename,
+                                               bool leaf_centers) const {
+  PointCloudWriter writer;
+  if (!writer.open(filename, leaf_centers)) {
+    return false;
+  }
+  loadFullMap();
+  const unsigned int max_tree_depth = octree_->getTreeDepth();
+  const double resolution = octree_->getResolution();
+  for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs();
+       it != octree_->end_leafs(); ++it) {
+    if (!octree_->isNodeOccupied(*it)) {
+      continue;
+    }
+    if (leaf_centers) {
+      writer.addPoint(it.getX(), it.getY(), it.getZ(), it.getSize());
+      continue;
+    }
+    // Same points as getOccupiedPointCloud(): the centers of all cells of
+    // the leaf.
+    const unsigned int num_cells = 1u << (max_tree_depth - it.getDepth());
+    const double offset = (num_cells - 1) * resolution / 2.0;
+    const Eigen::Vector3d bbx_min =
+        Eigen::Vector3d(it.getX(), it.getY(), it.getZ()).array() - offset;
+    for (unsigned int x = 0; x < num_cells; ++x) {
+      for (unsigned int y = 0; y < num_cells; ++y) {
+        for (unsigned int z = 0; z < num_cells; ++z) {
+          writer.addPoint(bbx_min.x() + x * resolution,
+                          bbx_min.y() + y * resolution,
+                          bbx_min.z() + z * resolution);
+        }
+      }
+    }
+  }
+  return writer.close();
+}
+
 void OctomapWorld::getOccupiedPointcloudInBoundingBox(
     const Eigen::Vector3d& center, const Eigen::Vector3d& bounding_box_size,
     pcl::PointCloud<pcl::PointXYZ>* output_cloud,
@@ -650,8 +1252,9 @@ void OctomapWorld::getOccupiedPointcloudInBoundingBox(
         octomap::point3d point =
             octomap::point3d(x_position, y_position, z_position);
         octomap::OcTreeKey key = octree_->coordToKey(point);
-        octomap::OcTreeNode* node = octree_->search(key);
-        if (node != NULL && octree_->isNodeOccupied(node)) {
+        float log_odds;
+        if (searchLogOdds(key, &log_odds) &&
+            log_odds >= octree_->getOccupancyThresLog()) {
           output_cloud->push_back(
               pcl::PointXYZ(point.x(), point.y(), point.z()));
         }
@@ -677,6 +1280,7 @@ void OctomapWorld::getAllBoxes(
     bool occupied_boxes,
     std::vector<std::pair<Eigen::Vector3d, double>>* box_vector) const {
   box_vector->clear();
+  loadFullMap();
   box_vector->reserve(octree_->size());
   for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs(),
                                       end = octree_->end_leafs();
@@ -695,6 +1299,8 @@ void OctomapWorld::getAllBoxes(
 
 void OctomapWorld::getBox(const octomap::OcTreeKey& key,
                           std::pair<Eigen::Vector3d, double>* box) const {
+  promoteLinearOctree();
+  loadTilesInKeyRange(key, key);
   // bbx_iterator begins "too early", and the last leaf is the expected one
   for (octomap::OcTree::leaf_bbx_iterator
            it = octree_->begin_leafs_bbx(key, key),
@@ -727,7 +1333,15 @@ void OctomapWorld::getBoxesBoundingBox(
     const Eigen::Vector3d& bounding_box_size,
     std::vector<std::pair<Eigen::Vector3d, double>>* box_vector) const {
   box_vector->clear();
-  if (bounding_box_size.maxCoeff() <= 0.0 || octree_->size() == 0) {
+  promoteLinearOctree();
+  if (bounding_box_size.maxCoeff() <= 0.0) {
+    return;
+  }
+  octomap::OcTreeKey min_key, max_key;
+  getKeyRange(position - bounding_box_size / 2,
+              position + bounding_box_size / 2, &min_key, &max_key);
+  loadTilesInKeyRange(min_key, max_key);
+  if (octree_->size() == 0) {
     return;
   }
   const Eigen::Vector3d max_boxes =
@@ -791,13 +1405,23 @@ void OctomapWorld::setLogOddsBoundingBox(
     const std::vector<Eigen::Vector3d>& positions,
     const Eigen::Vector3d& bounding_box_size, double log_odds_value,
     const BoundHandling& insertion_method) {
+  promoteLinearOctree();
+  detachOctree(true);
   const bool lazy_eval = true;
+  const bool check_bounds = hasUpdateBounds();
   const double resolution = octree_->getResolution();
   Eigen::Vector3d bbx_min, bbx_max;
 
   for (const Eigen::Vector3d& position : positions) {
     adjustBoundingBox(position, bounding_box_size, insertion_method, &bbx_min,
                       &bbx_max);
+    octomap::OcTreeKey min_key, max_key;
+    getKeyRange(bbx_min, bbx_max, &min_key, &max_key);
+    if (!tile_directory_.empty()) {
+      loadTilesInKeyRange(min_key, max_key);
+      markTilesDirtyInKeyRange(min_key, max_key);
+    }
+    markUnprunedInKeyRange(min_key, max_key);
 
     for (double x_position = bbx_min.x(); x_position <= bbx_max.x();
          x_position += resolution) {
@@ -807,6 +1431,9 @@ void OctomapWorld::setLogOddsBoundingBox(
              z_position += resolution) {
           octomap::point3d point =
               octomap::point3d(x_position, y_position, z_position);
+          if (check_bounds && !isInUpdateBounds(octree_->coordToKey(point))) {
+            continue;
+          }
           octree_->setNodeValue(point, log_odds_value, lazy_eval);
         }
       }
@@ -815,17 +1442,115 @@ void OctomapWorld::setLogOddsBoundingBox(
 
   // This is necessary since lazy_eval is set to true.
   octree_->updateInnerOccupancy();
+  incrementMapVersion();
 }
 
 bool OctomapWorld::getOctomapBinaryMsg(octomap_msgs::Octomap* msg) const {
-  return octomap_msgs::binaryMapToMsg(*octree_, *msg);
+  CHECK_NOTNULL(msg);
+  if (binary_msg_version_ != map_version_) {
+    loadFullMap();
+    std::string data;
+    writeBinaryDataParallel(*octree_, params_.num_threads, &data);
+    binary_msg_cache_.binary = true;
+    binary_msg_cache_.id = octree_->getTreeType();
+    binary_msg_cache_.resolution = octree_->getResolution();
+    binary_msg_cache_.data.assign(data.begin(), data.end());
+    if (params_.compress_map_msgs) {
+      compressOctomapMsg(&binary_msg_cache_);
+    }
+    binary_msg_version_ = map_version_;
+  }
+  *msg = binary_msg_cache_;
+  return true;
 }
 
 bool OctomapWorld::getOctomapFullMsg(octomap_msgs::Octomap* msg) const {
-  return octomap_msgs::fullMapToMsg(*octree_, *msg);
+  CHECK_NOTNULL(msg);
+  if (full_msg_version_ != map_version_) {
+    loadFullMap();
+    std::string data;
+    writeFullDataParallel(*octree_, params_.num_threads, &data);
+    full_msg_cache_.binary = false;
+    full_msg_cache_.id = octree_->getTreeType();
+    full_msg_cache_.resolution = octree_->getResolution();
+    full_msg_cache_.data.assign(data.begin(), data.end());
+    if (params_.compress_map_msgs) {
+      compressOctomapMsg(&full_msg_cache_);
+    }
+    full_msg_version_ = map_version_;
+  }
+  *msg = full_msg_cache_;
+  return true;
+}
+
+bool OctomapWorld::getOctomapRegionMsg(const Eigen::Vector3d& center,
+                                       const Eigen::Vector3d& bounding_box_size,
+                                       unsigned int max_depth,
+                                       octomap_msgs::Octomap* msg) const {
+  CHECK_NOTNULL(msg);
+  promoteLinearOctree();
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  if (max_depth == 0 || max_depth > tree_depth) {
+    max_depth = tree_depth;
+  }
+
+  if ((bounding_box_size.array() < 0.0).any()) {
+    LOG(ERROR) << "Bounding box has negative size.";
+    return false;
+  }
+  octomap::OcTreeKey min_key, max_key;
+  getKeyRange(center - bounding_box_size / 2, center + bounding_box_size / 2,
+              &min_key, &max_key);
+  loadTilesInKeyRange(min_key, max_key);
+
+  msg->resolution = octree_->getResolution();
+  msg->id = octree_->getTreeType();
+  msg->binary = false;
+  msg->data.clear();
+
+  const octomap::OcTreeNode* root = octree_->getRoot();
+  if (root == NULL) {
+    return true;
+  }
+  std::stringstream datastream;
+  writeNodesInBoxRecurs(root, octomap::OcTreeKey(0, 0, 0), 0, min_key,
+                        max_key, max_depth, datastream);
+  // Skipped nodes are rolled back by seeking, so the buffer may be longer
+  // than the actual data.
+  const size_t data_size = static_cast<size_t>(datastream.tellp());
+  const std::string datastring = datastream.str();
+  msg->data.assign(datastring.begin(), datastring.begin() + data_size);
+  return true;
+}
+
+void OctomapWorld::compressOctomapMsg(octomap_msgs::Octomap* msg) const {
+  CHECK_NOTNULL(msg);
+  std::string compressed;
+  compressData(reinterpret_cast<const char*>(msg->data.data()),
+               msg->data.size(), params_.num_threads, &compressed);
+  msg->data.assign(compressed.begin(), compressed.end());
 }
 
 void OctomapWorld::setOctomapFromMsg(const octomap_msgs::Octomap& msg) {
+  const char* data = reinterpret_cast<const char*>(msg.data.data());
+  if (isCompressedData(data, msg.data.size())) {
+    octomap_msgs::Octomap decompressed_msg;
+    decompressed_msg.header = msg.header;
+    decompressed_msg.binary = msg.binary;
+    decompressed_msg.id = msg.id;
+    decompressed_msg.resolution = msg.resolution;
+    decompressed_msg.data.resize(getDecompressedSize(data, msg.data.size()));
+    char* decompressed_data =
+        reinterpret_cast<char*>(decompressed_msg.data.data());
+    if (!decompressData(data, msg.data.size(), params_.num_threads,
+                        decompressed_data)) {
+      LOG(ERROR) << "Could not decompress octomap message.";
+      return;
+    }
+    setOctomapFromMsg(decompressed_msg);
+    return;
+  }
+
   if (msg.binary) {
     setOctomapFromBinaryMsg(msg);
   } else {
@@ -834,96 +1559,1279 @@ void OctomapWorld::setOctomapFromMsg(const octomap_msgs::Octomap& msg) {
 }
 
 void OctomapWorld::setOctomapFromBinaryMsg(const octomap_msgs::Octomap& msg) {
-  octree_.reset(
+  linear_octree_.reset();
+  closeTiledMapStore();
+  replaceOctree(
       dynamic_cast<octomap::OcTree*>(octomap_msgs::binaryMsgToMap(msg)));
+  markAllUnpruned();
+  // The new octree only has default parameters.
+  params_.resolution = octree_->getResolution();
+  applyParametersToOctree();
 }
 
 void OctomapWorld::setOctomapFromFullMsg(const octomap_msgs::Octomap& msg) {
-  octree_.reset(
+  linear_octree_.reset();
+  closeTiledMapStore();
+  replaceOctree(
       dynamic_cast<octomap::OcTree*>(octomap_msgs::fullMsgToMap(msg)));
-}
-
-bool OctomapWorld::loadOctomapFromFile(const std::string& filename) {
-  return octree_->readBinary(filename);
-}
+  markAllUnpruned();
+  params_.resolution = octree_->getResolution();
+  applyParametersToOctree();
+}
+
+void OctomapWorld::getOctomapUpdateMsg(unsigned int subtree_depth,
+                                       volumetric_msgs::OctomapUpdate* msg) {
+  CHECK_NOTNULL(msg);
+  promoteLinearOctree();
+  detachOctree(true);
+  subtree_depth =
+      std::min(std::max(subtree_depth, 1u), octree_->getTreeDepth());
+  msg->resolution = octree_->getResolution();
+  msg->subtree_depth = subtree_depth;
+  msg->keys.clear();
+  msg->data.clear();
+
+  // As in getChangedPoints(), these are always *leaf node* keys.
+  octomap::KeySet subtree_keys;
+  for (octomap::KeyBoolMap::const_iterator
+           iter = octree_->changedKeysBegin(),
+           end = octree_->changedKeysEnd();
+       iter != end; ++iter) {
+    subtree_keys.insert(octree_->adjustKeyAtDepth(iter->first, subtree_depth));
+  }
 
-bool OctomapWorld::writeOctomapToFile(const std::string& filename) {
-  return octree_->writeBinary(filename);
+  const unsigned int subtree_size =
+      1u << (octree_->getTreeDepth() - subtree_depth);
+  std::stringstream datastream;
+  for (const octomap::OcTreeKey& key : subtree_keys) {
+    msg->keys.push_back(key[0]);
+    msg->keys.push_back(key[1]);
+    msg->keys.push_back(key[2]);
+
+    // The subtree may be larger than a tile and contain unread ones.
+    octomap::OcTreeKey min_key, max_key;
+    for (unsigned int i = 0; i < 3; ++i) {
+      min_key[i] = key[i] & ~(subtree_size - 1);
+      max_key[i] = min_key[i] + subtree_size - 1;
+    }
+    loadTilesInKeyRange(min_key, max_key);
+
+    // If the subtree is part of a larger pruned node, this returns that node,
+    // which then gets written as a single leaf.
+    const octomap::OcTreeNode* node = octree_->search(key, subtree_depth);
+    const char known = (node != NULL);
+    datastream.write(&known, sizeof(char));
+    if (node != NULL) {
+      writeNodesRecurs(node, datastream);
+    }
+  }
+  const std::string data = datastream.str();
+  msg->data.assign(data.begin(), data.end());
+  octree_->resetChangeDetection();
 }
 
-bool OctomapWorld::writeOctomapToBinaryConst(std::ostream& s) const {
-  return octree_->writeBinaryConst(s);
-}
+bool OctomapWorld::applyOctomapUpdateMsg(
+    const volumetric_msgs::OctomapUpdate& msg) {
+  loadFullMap();
+  detachOctree(true);
+  markAllTilesDirty();
+  if (std::abs(msg.resolution - octree_->getResolution()) > 1e-6) {
+    LOG(ERROR) << "Octomap update resolution " << msg.resolution
+               << " does not match map resolution "
+               << octree_->getResolution();
+    return false;
+  }
+  if (msg.keys.size() % 3 != 0 || msg.subtree_depth < 1 ||
+      msg.subtree_depth > octree_->getTreeDepth()) {
+    LOG(ERROR) << "Malformed octomap update.";
+    return false;
+  }
 
-bool OctomapWorld::isSpeckleNode(const octomap::OcTreeKey& key) const {
-  octomap::OcTreeKey current_key;
-  // Search neighbors in a +/-1 key range cube. If there are neighbors, it's
-  // not a speckle.
-  bool neighbor_found = false;
-  for (current_key[2] = key[2] - 1; current_key[2] <= key[2] + 1;
-       ++current_key[2]) {
-    for (current_key[1] = key[1] - 1; current_key[1] <= key[1] + 1;
-         ++current_key[1]) {
-      for (current_key[0] = key[0] - 1; current_key[0] <= key[0] + 1;
-           ++current_key[0]) {
-        if (current_key != key) {
-          octomap::OcTreeNode* node = octree_->search(key);
-          if (node && octree_->isNodeOccupied(node)) {
-            // We have a neighbor => not a speckle!
-            return false;
-          }
-        }
-      }
+  incrementMapVersion();
+  std::stringstream datastream(std::string(msg.data.begin(), msg.data.end()));
+  for (size_t i = 0; i < msg.keys.size(); i += 3) {
+    const octomap::OcTreeKey key(msg.keys[i], msg.keys[i + 1],
+                                 msg.keys[i + 2]);
+    char known = 0;
+    if (!datastream.read(&known, sizeof(char))) {
+      LOG(ERROR) << "Octomap update data ends early.";
+      return false;
     }
+    if (!known) {
+      octree_->deleteNode(key, msg.subtree_depth);
+    } else if (!readNodesRecurs(
+                   datastream, createNodeAtDepth(key, msg.subtree_depth))) {
+      LOG(ERROR) << "Octomap update data ends early.";
+      return false;
+    }
+    octomap::OcTreeKey min_key, max_key;
+    const unsigned int shift = octree_->getTreeDepth() - msg.subtree_depth;
+    for (unsigned int j = 0; j < 3; ++j) {
+      min_key[j] = key[j] >> shift << shift;
+      max_key[j] = min_key[j] + (1u << shift) - 1;
+    }
+    markUnprunedInKeyRange(min_key, max_key);
   }
+  octree_->updateInnerOccupancy();
   return true;
 }
 
-void OctomapWorld::generateMarkerArray(
-    const std::string& tf_frame,
-    visualization_msgs::MarkerArray* occupied_nodes,
-    visualization_msgs::MarkerArray* free_nodes) {
-  CHECK_NOTNULL(occupied_nodes);
-  CHECK_NOTNULL(free_nodes);
+void OctomapWorld::writeNodesRecurs(const octomap::OcTreeNode* node,
+                                    std::ostream& s) const {
+  // Same layout as octomap's writeData(): log-odds, then one bit per existing
+  // child, then the children.
+  const float log_odds = node->getLogOdds();
+  s.write(reinterpret_cast<const char*>(&log_odds), sizeof(log_odds));
 
-  // Prune the octree first.
-  octree_->prune();
-  int tree_depth = octree_->getTreeDepth() + 1;
+  std::bitset<8> children;
+  for (unsigned int i = 0; i < 8; ++i) {
+    children[i] = octree_->nodeChildExists(node, i);
+  }
+  const char children_char = static_cast<char>(children.to_ulong());
+  s.write(&children_char, sizeof(char));
 
-  // In the marker array, assign each node to its respective depth level, since
-  // all markers in a CUBE_LIST must have the same scale.
-  occupied_nodes->markers.resize(tree_depth);
-  free_nodes->markers.resize(tree_depth);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (children[i]) {
+      writeNodesRecurs(octree_->getNodeChild(node, i), s);
+    }
+  }
+}
 
-  // Metric min and max z of the map:
-  double min_x, min_y, min_z, max_x, max_y, max_z;
-  octree_->getMetricMin(min_x, min_y, min_z);
-  octree_->getMetricMax(max_x, max_y, max_z);
+bool OctomapWorld::readNodesRecurs(std::istream& s,
+                                   octomap::OcTreeNode* node) {
+  float log_odds;
+  char children_char;
+  if (!s.read(reinterpret_cast<char*>(&log_odds), sizeof(log_odds)) ||
+      !s.read(&children_char, sizeof(char))) {
+    return false;
+  }
+  node->setLogOdds(log_odds);
 
-  // Update values from params if necessary.
-  if (params_.visualize_min_z > min_z) {
-    min_z = params_.visualize_min_z;
+  const std::bitset<8> children(static_cast<unsigned char>(children_char));
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (children[i] &&
+        !readNodesRecurs(s, octree_->createNodeChild(node, i))) {
+      return false;
+    }
   }
-  if (params_.visualize_max_z < max_z) {
-    max_z = params_.visualize_max_z;
+  return true;
+}
+
+void OctomapWorld::getKeyRange(const Eigen::Vector3d& bbx_min,
+                               const Eigen::Vector3d& bbx_max,
+                               octomap::OcTreeKey* min_key,
+                               octomap::OcTreeKey* max_key) const {
+  CHECK_NOTNULL(min_key);
+  CHECK_NOTNULL(max_key);
+  // Clamp the box to the keys the tree can represent.
+  const octomap::key_type max_key_value =
+      (1u << octree_->getTreeDepth()) - 1;
+  for (unsigned int i = 0; i < 3; ++i) {
+    if (!octree_->coordToKeyChecked(bbx_min[i], (*min_key)[i])) {
+      (*min_key)[i] = bbx_min[i] < 0.0 ? 0 : max_key_value;
+    }
+    if (!octree_->coordToKeyChecked(bbx_max[i], (*max_key)[i])) {
+      (*max_key)[i] = bbx_max[i] < 0.0 ? 0 : max_key_value;
+    }
   }
+}
 
-  for (int i = 0; i < tree_depth; ++i) {
-    double size = octree_->getNodeSize(i);
+bool OctomapWorld::writeNodesInBoxRecurs(
+    const octomap::OcTreeNode* node, const octomap::OcTreeKey& node_min_key,
+    unsigned int depth, const octomap::OcTreeKey& min_key,
+    const octomap::OcTreeKey& max_key, unsigned int max_depth,
+    std::ostream& s) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  const unsigned int node_size = 1u << (tree_depth - depth);
 
-    occupied_nodes->markers[i].header.frame_id = tf_frame;
-    occupied_nodes->markers[i].ns = "map";
-    occupied_nodes->markers[i].id = i;
-    occupied_nodes->markers[i].type = visualization_msgs::Marker::CUBE_LIST;
-    occupied_nodes->markers[i].scale.x = size;
-    occupied_nodes->markers[i].scale.y = size;
-    occupied_nodes->markers[i].scale.z = size;
+  bool inside_box = true;
+  for (unsigned int i = 0; i < 3; ++i) {
+    inside_box = inside_box && node_min_key[i] >= min_key[i] &&
+                 node_min_key[i] + node_size - 1 <= max_key[i];
+  }
+  if (inside_box && max_depth == tree_depth) {
+    writeNodesRecurs(node, s);
+    return true;
+  }
 
-    free_nodes->markers[i] = occupied_nodes->markers[i];
+  const float log_odds = node->getLogOdds();
+  const std::streampos start = s.tellp();
+  s.write(reinterpret_cast<const char*>(&log_odds), sizeof(log_odds));
+  const std::streampos children_pos = s.tellp();
+  char children_char = 0;
+  s.write(&children_char, sizeof(char));
+  const bool is_leaf = !octree_->nodeHasChildren(node) || depth >= max_depth;
+  if (is_leaf && inside_box) {
+    return true;
   }
 
-  for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs(),
-                                      end = octree_->end_leafs();
+  // Leaves on the border of the box, including nodes cut off at max_depth,
+  // are split up into children with the same value down to the box, so no
+  // cells outside of it become known.
+  const unsigned int child_size = node_size / 2;
+  std::bitset<8> children;
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!is_leaf && !octree_->nodeChildExists(node, i)) {
+      continue;
+    }
+    // Bit 0 of the child index is x, bit 1 is y and bit 2 is z.
+    octomap::OcTreeKey child_min_key;
+    bool overlaps_box = true;
+    for (unsigned int j = 0; j < 3; ++j) {
+      child_min_key[j] = node_min_key[j] + (((i >> j) & 1) ? child_size : 0);
+      overlaps_box = overlaps_box && child_min_key[j] <= max_key[j] &&
+                     child_min_key[j] + child_size - 1 >= min_key[j];
+    }
+    if (overlaps_box) {
+      children[i] = writeNodesInBoxRecurs(
+          is_leaf ? node : octree_->getNodeChild(node, i), child_min_key,
+          depth + 1, min_key, max_key, max_depth, s);
+    }
+  }
+
+  if (children.none()) {
+    // Only has data outside of the box. Writing it as a leaf would mark the
+    // whole node as known.
+    s.seekp(start);
+    return false;
+  }
+  const std::streampos end = s.tellp();
+  children_char = static_cast<char>(children.to_ulong());
+  s.seekp(children_pos);
+  s.write(&children_char, sizeof(char));
+  s.seekp(end);
+  return true;
+}
+
+octomap::OcTreeNode* OctomapWorld::createNodeAtDepth(
+    const octomap::OcTreeKey& key, unsigned int depth) {
+  bool created;
+  octomap::OcTreeNode* node = getOrCreateNodeAtDepth(key, depth, &created);
+  if (octree_->nodeHasChildren(node)) {
+    deleteChildren(node);
+  }
+  return node;
+}
+
+void OctomapWorld::deleteChildren(octomap::OcTreeNode* node) {
+  // pruneNode() is the only public way to free the array of children, so the
+  // children are turned into eight equal leaves first.
+  const float log_odds = node->getLogOdds();
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
+      octree_->createNodeChild(node, i);
+    } else if (octree_->nodeHasChildren(octree_->getNodeChild(node, i))) {
+      deleteChildren(octree_->getNodeChild(node, i));
+    }
+    octree_->getNodeChild(node, i)->setLogOdds(log_odds);
+  }
+  octree_->pruneNode(node);
+}
+
+octomap::OcTreeNode* OctomapWorld::getOrCreateNodeAtDepth(
+    const octomap::OcTreeKey& key, unsigned int depth, bool* created) {
+  CHECK_NOTNULL(created);
+  *created = false;
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  octomap::OcTreeNode* node = octree_->getRoot();
+  if (node == NULL) {
+    // Octomap has no way to create just a root, but readData() does so while
+    // also keeping the node count up to date.
+    std::stringstream root_stream;
+    const float root_log_odds = 0.0f;
+    const char no_children = 0;
+    root_stream.write(reinterpret_cast<const char*>(&root_log_odds),
+                      sizeof(float));
+    root_stream.write(&no_children, sizeof(char));
+    octree_->readData(root_stream);
+    node = octree_->getRoot();
+    *created = true;
+  }
+
+  for (unsigned int level = 0; level < depth; ++level) {
+    const unsigned int child_index =
+        octomap::computeChildIdx(key, tree_depth - 1 - level);
+    if (!octree_->nodeChildExists(node, child_index)) {
+      if (!*created && !octree_->nodeHasChildren(node)) {
+        // Pruned node, expanding keeps the state of the siblings.
+        octree_->expandNode(node);
+      } else {
+        octree_->createNodeChild(node, child_index);
+        *created = true;
+      }
+    }
+    node = octree_->getNodeChild(node, child_index);
+  }
+  return node;
+}
+
+void OctomapWorld::merge(const OctomapWorld& other,
+                         const Transformation& T_this_other) {
+  if (&other == this) {
+    const OctomapWorld copy(other);
+    merge(copy, T_this_other);
+    return;
+  }
+  other.loadFullMap();
+  if (other.octree_->getRoot() == NULL) {
+    return;
+  }
+  loadFullMap();
+  detachOctree(true);
+  markAllTilesDirty();
+
+  // Translation in cells, if the grids of both maps line up.
+  const double resolution = octree_->getResolution();
+  const Eigen::Vector3d cell_offset = T_this_other.getPosition() / resolution;
+  const Eigen::Vector3d rounded_cell_offset =
+      cell_offset.array().round().matrix();
+  const double kEpsilon = 1e-6;
+  const bool aligned =
+      std::abs(other.octree_->getResolution() - resolution) <
+          kEpsilon * resolution &&
+      other.octree_->getTreeDepth() == octree_->getTreeDepth() &&
+      T_this_other.getRotationMatrix().isIdentity(kEpsilon) &&
+      (cell_offset - rounded_cell_offset).cwiseAbs().maxCoeff() < 1e-3;
+
+  if (aligned) {
+    const Eigen::Vector3i key_offset = rounded_cell_offset.cast<int>();
+    // The subtrees of other line up with the nodes of this map down from the
+    // depth of the largest power of two dividing all offsets.
+    unsigned int aligned_levels = octree_->getTreeDepth();
+    for (int i = 0; i < 3; ++i) {
+      unsigned int levels = 0;
+      while (levels < aligned_levels && (key_offset[i] >> levels & 1) == 0) {
+        ++levels;
+      }
+      aligned_levels = levels;
+    }
+    mergeAlignedRecurs(other, other.octree_->getRoot(),
+                       octomap::OcTreeKey(0, 0, 0), 0,
+                       octree_->getTreeDepth() - aligned_levels, key_offset);
+  } else {
+    mergeResampled(other, T_this_other);
+  }
+  octree_->updateInnerOccupancy();
+  markAllUnpruned();
+  prune();
+  incrementMapVersion();
+}
+
+void OctomapWorld::mergeAlignedRecurs(const OctomapWorld& other,
+                                      const octomap::OcTreeNode* other_node,
+                                      const octomap::OcTreeKey& node_min_key,
+                                      unsigned int depth,
+                                      unsigned int align_depth,
+                                      const Eigen::Vector3i& key_offset) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  if (depth < align_depth) {
+    // Pruned nodes of other are split up until they line up as well.
+    const bool has_children = other.octree_->nodeHasChildren(other_node);
+    const unsigned int child_size = 1u << (tree_depth - depth - 1);
+    for (unsigned int i = 0; i < 8; ++i) {
+      if (has_children && !other.octree_->nodeChildExists(other_node, i)) {
+        continue;
+      }
+      octomap::OcTreeKey child_min_key = node_min_key;
+      for (unsigned int j = 0; j < 3; ++j) {
+        if (i & (1u << j)) {
+          child_min_key[j] += child_size;
+        }
+      }
+      mergeAlignedRecurs(
+          other,
+          has_children ? other.octree_->getNodeChild(other_node, i)
+                       : other_node,
+          child_min_key, depth + 1, align_depth, key_offset);
+    }
+    return;
+  }
+
+  octomap::OcTreeKey key;
+  const int max_key_value = (1 << tree_depth) - 1;
+  for (unsigned int i = 0; i < 3; ++i) {
+    const int shifted_key = node_min_key[i] + key_offset[i];
+    if (shifted_key < 0 || shifted_key > max_key_value) {
+      // Outside of this map.
+      return;
+    }
+    key[i] = shifted_key;
+  }
+  bool created;
+  octomap::OcTreeNode* node = getOrCreateNodeAtDepth(key, depth, &created);
+  mergeNodeRecurs(other, other_node, node, created);
+}
+
+void OctomapWorld::mergeNodeRecurs(const OctomapWorld& other,
+                                   const octomap::OcTreeNode* other_node,
+                                   octomap::OcTreeNode* node, bool unknown) {
+  if (!other.octree_->nodeHasChildren(other_node)) {
+    addLogOddsRecurs(other_node->getLogOdds(), node, unknown);
+    return;
+  }
+  if (!unknown && !octree_->nodeHasChildren(node)) {
+    octree_->expandNode(node);
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!other.octree_->nodeChildExists(other_node, i)) {
+      continue;
+    }
+    bool child_unknown = false;
+    if (!octree_->nodeChildExists(node, i)) {
+      octree_->createNodeChild(node, i);
+      child_unknown = true;
+    }
+    mergeNodeRecurs(other, other.octree_->getNodeChild(other_node, i),
+                    octree_->getNodeChild(node, i), child_unknown);
+  }
+}
+
+void OctomapWorld::addLogOddsRecurs(float log_odds, octomap::OcTreeNode* node,
+                                    bool unknown) {
+  if (unknown || !octree_->nodeHasChildren(node)) {
+    const float sum = unknown ? log_odds : node->getLogOdds() + log_odds;
+    node->setLogOdds(
+        std::min(std::max(sum, octree_->getClampingThresMinLog()),
+                 octree_->getClampingThresMaxLog()));
+    return;
+  }
+  // Inner node values are updated afterwards.
+  for (unsigned int i = 0; i < 8; ++i) {
+    bool child_unknown = false;
+    if (!octree_->nodeChildExists(node, i)) {
+      octree_->createNodeChild(node, i);
+      child_unknown = true;
+    }
+    addLogOddsRecurs(log_odds, octree_->getNodeChild(node, i), child_unknown);
+  }
+}
+
+bool OctomapWorld::copySubmapRecurs(const octomap::OcTreeNode* node,
+                                    const octomap::OcTreeKey& node_min_key,
+                                    unsigned int depth,
+                                    const octomap::OcTreeKey& min_key,
+                                    const octomap::OcTreeKey& max_key,
+                                    octomap::OcTreeNode* submap_node,
+                                    OctomapWorld* submap) const {
+  const unsigned int node_size = 1u << (octree_->getTreeDepth() - depth);
+  bool inside = true;
+  for (unsigned int i = 0; i < 3; ++i) {
+    if (node_min_key[i] < min_key[i] ||
+        node_min_key[i] + node_size - 1 > max_key[i]) {
+      inside = false;
+    }
+  }
+  if (inside) {
+    copyNodesRecurs(node, submap_node, submap);
+    return true;
+  }
+
+  // Pruned nodes on the border are clipped by splitting them up.
+  const bool has_children = octree_->nodeHasChildren(node);
+  const unsigned int child_size = node_size / 2;
+  bool has_data = false;
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (has_children && !octree_->nodeChildExists(node, i)) {
+      continue;
+    }
+    octomap::OcTreeKey child_min_key = node_min_key;
+    bool overlaps = true;
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (i & (1u << j)) {
+        child_min_key[j] += child_size;
+      }
+      if (child_min_key[j] > max_key[j] ||
+          child_min_key[j] + child_size - 1 < min_key[j]) {
+        overlaps = false;
+      }
+    }
+    if (!overlaps) {
+      continue;
+    }
+    octomap::OcTreeNode* submap_child =
+        submap->octree_->createNodeChild(submap_node, i);
+    if (copySubmapRecurs(
+            has_children ? octree_->getNodeChild(node, i) : node,
+            child_min_key, depth + 1, min_key, max_key, submap_child,
+            submap)) {
+      has_data = true;
+    } else {
+      // The child overlaps the box, so its array of children was allocated
+      // even though all of them have been deleted again.
+      submap->deleteChildren(submap_child);
+      submap->octree_->deleteNodeChild(submap_node, i);
+    }
+  }
+  return has_data;
+}
+
+void OctomapWorld::copyNodesRecurs(const octomap::OcTreeNode* node,
+                                   octomap::OcTreeNode* submap_node,
+                                   OctomapWorld* submap) const {
+  submap_node->setLogOdds(node->getLogOdds());
+  if (!octree_->nodeHasChildren(node)) {
+    return;
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (octree_->nodeChildExists(node, i)) {
+      copyNodesRecurs(octree_->getNodeChild(node, i),
+                      submap->octree_->createNodeChild(submap_node, i),
+                      submap);
+    }
+  }
+}
+
+void OctomapWorld::mergeResampled(const OctomapWorld& other,
+                                  const Transformation& T_this_other) {
+  // Bounding box of other in this map.
+  Eigen::Vector3d other_min, other_max;
+  other.getMapBounds(&other_min, &other_max);
+  Eigen::Vector3d bbx_min =
+      Eigen::Vector3d::Constant(std::numeric_limits<double>::max());
+  Eigen::Vector3d bbx_max = -bbx_min;
+  for (unsigned int i = 0; i < 8; ++i) {
+    const Eigen::Vector3d corner((i & 1) ? other_max.x() : other_min.x(),
+                                 (i & 2) ? other_max.y() : other_min.y(),
+                                 (i & 4) ? other_max.z() : other_min.z());
+    const Eigen::Vector3d corner_this = T_this_other * corner;
+    bbx_min = bbx_min.cwiseMin(corner_this);
+    bbx_max = bbx_max.cwiseMax(corner_this);
+  }
+  octomap::OcTreeKey min_key, max_key;
+  getKeyRange(bbx_min, bbx_max, &min_key, &max_key);
+
+  // Other is looked up in parallel one z slice each, and the results are
+  // applied in order.
+  const Transformation T_other_this = T_this_other.inverse();
+  const size_t num_slices = max_key[2] - min_key[2] + 1;
+  std::vector<std::vector<std::pair<octomap::OcTreeKey, float>>> updates(
+      num_slices);
+  parallelFor(num_slices, params_.num_threads, [&](size_t slice) {
+    const unsigned int z = min_key[2] + slice;
+    for (unsigned int y = min_key[1]; y <= max_key[1]; ++y) {
+      for (unsigned int x = min_key[0]; x <= max_key[0]; ++x) {
+        const octomap::OcTreeKey key(x, y, z);
+        Eigen::Vector3d position;
+        keyToCoord(key, &position);
+        const octomap::point3d other_position =
+            pointEigenToOctomap(T_other_this * position);
+        octomap::OcTreeKey other_key;
+        float log_odds;
+        if (other.octree_->coordToKeyChecked(other_position, other_key) &&
+            other.searchLogOdds(other_key, &log_odds)) {
+          updates[slice].emplace_back(key, log_odds);
+        }
+      }
+    }
+  });
+
+  const bool lazy_eval = true;
+  for (const std::vector<std::pair<octomap::OcTreeKey, float>>& slice :
+       updates) {
+    for (const std::pair<octomap::OcTreeKey, float>& update : slice) {
+      octree_->updateNode(update.first, update.second, lazy_eval);
+    }
+  }
+}
+
+bool OctomapWorld::loadOctomapFromFile(const std::string& filename) {
+  incrementMapVersion();
+  markAllUnpruned();
+  const std::string extension = getFileExtension(filename);
+  if (extension == "lbt") {
+    return loadLinearOctreeFromFile(filename);
+  } else if (extension == "tiles") {
+    return openTiledMapStore(filename);
+  }
+  linear_octree_.reset();
+  closeTiledMapStore();
+  replaceOctree(new octomap::OcTree(octree_->getResolution()));
+  applyParametersToOctree();
+  if (extension == "btz") {
+    return loadCompressedOctomapFromFile(filename);
+  }
+  return octree_->readBinary(filename);
+}
+
+bool OctomapWorld::writeOctomapToFile(const std::string& filename) {
+  const std::string extension = getFileExtension(filename);
+  if (extension == "tiles") {
+    return writeTiledMapStore(filename);
+  }
+  return writeOctomapToFile(filename, extension);
+}
+
+bool OctomapWorld::writeOctomapToFileAtomically(const std::string& filename) {
+  const std::string extension = getFileExtension(filename);
+  if (extension == "tiles") {
+    // Every tile and the index are replaced in one step each. Syncing
+    // everything is the only way to sync all of them without a file
+    // descriptor per tile.
+    if (!writeTiledMapStore(filename)) {
+      return false;
+    }
+    sync();
+    return true;
+  }
+  const std::string temporary_path = filename + ".tmp";
+  if (!writeOctomapToFile(temporary_path, extension) ||
+      !syncAndReplaceFile(temporary_path, filename)) {
+    std::remove(temporary_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool OctomapWorld::writeOctomapToFile(const std::string& path,
+                                      const std::string& extension) {
+  loadFullMap();
+  if (extension == "lbt") {
+    return LinearOctree::writeToFile(
+        *octree_, params_.linear_octree_log_odds_bits, path);
+  }
+  // The binary format only stores whether cells are occupied or free, so the
+  // tree is written as it is, like OcTree::writeBinaryConst() does.
+  if (extension == "btz") {
+    return writeCompressedOctomapToFile(path);
+  }
+  std::ofstream file(path.c_str(), std::ios_base::out |
+                                       std::ios_base::binary |
+                                       std::ios_base::trunc);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open " << path << " for writing.";
+    return false;
+  }
+  if (!writeBinaryParallel(*octree_, params_.num_threads, file)) {
+    return false;
+  }
+  file.close();
+  return !file.fail();
+}
+
+bool OctomapWorld::loadCompressedOctomapFromFile(const std::string& filename) {
+  std::ifstream file(filename.c_str(),
+                     std::ios_base::in | std::ios_base::binary);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open " << filename;
+    return false;
+  }
+  file.seekg(0, std::ios_base::end);
+  std::string compressed(static_cast<size_t>(file.tellg()), '\0');
+  file.seekg(0, std::ios_base::beg);
+  if (!file.read(&compressed[0], compressed.size()) ||
+      !isCompressedData(compressed.data(), compressed.size())) {
+    LOG(ERROR) << filename << " is not a compressed octomap.";
+    return false;
+  }
+
+  std::string data(getDecompressedSize(compressed.data(), compressed.size()),
+                   '\0');
+  if (!decompressData(compressed.data(), compressed.size(),
+                      params_.num_threads, &data[0])) {
+    return false;
+  }
+  MemoryStreamBuffer buffer(&data[0], data.size());
+  std::istream datastream(&buffer);
+  return octree_->readBinary(datastream);
+}
+
+bool OctomapWorld::writeCompressedOctomapToFile(const std::string& filename) {
+  std::stringstream datastream;
+  if (!writeBinaryParallel(*octree_, params_.num_threads, datastream)) {
+    return false;
+  }
+  const std::string data = datastream.str();
+  std::string compressed;
+  compressData(data.data(), data.size(), params_.num_threads, &compressed);
+
+  std::ofstream file(filename.c_str(), std::ios_base::out |
+                                           std::ios_base::binary |
+                                           std::ios_base::trunc);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open " << filename << " for writing.";
+    return false;
+  }
+  file.write(compressed.data(), compressed.size());
+  return file.good();
+}
+
+bool OctomapWorld::loadLinearOctreeFromFile(const std::string& filename) {
+  std::unique_ptr<LinearOctree> linear_octree(new LinearOctree());
+  if (!linear_octree->mapFile(filename)) {
+    return false;
+  }
+  if (linear_octree->getTreeDepth() != octree_->getTreeDepth()) {
+    LOG(ERROR) << "Tree depth " << linear_octree->getTreeDepth() << " of "
+               << filename << " is not supported.";
+    return false;
+  }
+  replaceOctree(new octomap::OcTree(linear_octree->getResolution()));
+  params_.resolution = octree_->getResolution();
+  applyParametersToOctree();
+  linear_octree_ = std::move(linear_octree);
+  closeTiledMapStore();
+  return true;
+}
+
+bool OctomapWorld::searchLogOdds(const octomap::OcTreeKey& key,
+                                 float* log_odds) const {
+  CHECK_NOTNULL(log_odds);
+  if (linear_octree_) {
+    return linear_octree_->search(key, log_odds);
+  }
+  if (!unloaded_tiles_.empty()) {
+    loadTile(octree_->adjustKeyAtDepth(key, tile_depth_));
+  }
+  const octomap::OcTreeNode* node = octree_->search(key);
+  if (node == NULL) {
+    return false;
+  }
+  *log_odds = node->getLogOdds();
+  return true;
+}
+
+void OctomapWorld::detachOctree(bool copy_nodes) {
+  if (octree_.use_count() <= 1) {
+    return;
+  }
+  if (copy_nodes) {
+    octree_.reset(new octomap::OcTree(*octree_));
+  } else {
+    octree_.reset(new octomap::OcTree(octree_->getResolution()));
+    applyParametersToOctree();
+  }
+}
+
+void OctomapWorld::replaceOctree(octomap::OcTree* octree) {
+  std::shared_ptr<octomap::OcTree> old_octree = std::move(octree_);
+  octree_.reset(octree);
+  releaseOctree(std::move(old_octree));
+}
+
+void OctomapWorld::promoteLinearOctree() const {
+  std::lock_guard<std::recursive_mutex> lock(lazy_load_mutex_);
+  if (!linear_octree_) {
+    return;
+  }
+  // Copy-on-write clones share the (empty) octree and the linear octree, and
+  // each copies it into an octree of its own.
+  const_cast<OctomapWorld*>(this)->detachOctree(true);
+  linear_octree_->copyToOcTree(octree_.get());
+  linear_octree_.reset();
+}
+
+bool OctomapWorld::openTiledMapStore(const std::string& directory) {
+  double resolution;
+  unsigned int tile_depth;
+  octomap::KeySet tile_keys;
+  if (!readTileIndex(directory, &resolution, &tile_depth, &tile_keys)) {
+    LOG(ERROR) << "Could not read the tile index of " << directory;
+    return false;
+  }
+  if (tile_depth < 1 || tile_depth > octree_->getTreeDepth()) {
+    LOG(ERROR) << "Invalid tile depth " << tile_depth << " in " << directory;
+    return false;
+  }
+
+  replaceOctree(new octomap::OcTree(resolution));
+  params_.resolution = resolution;
+  applyParametersToOctree();
+  linear_octree_.reset();
+  incrementMapVersion();
+
+  tile_directory_ = directory;
+  tile_depth_ = tile_depth;
+  stored_tiles_ = tile_keys;
+  unloaded_tiles_ = tile_keys;
+  dirty_tiles_.clear();
+  all_tiles_dirty_ = false;
+  return true;
+}
+
+bool OctomapWorld::writeTiledMapStore(const std::string& directory) {
+  promoteLinearOctree();
+  octomap::KeySet tiles_to_write;
+  octomap::KeySet tiles_in_store;
+  if (directory == tile_directory_ && !all_tiles_dirty_) {
+    tiles_to_write = dirty_tiles_;
+    tiles_in_store = stored_tiles_;
+  } else {
+    loadFullMap();
+    if (directory != tile_directory_) {
+      tile_depth_ = std::min(
+          std::max(params_.tile_depth, 1),
+          static_cast<int>(octree_->getTreeDepth()));
+    }
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+      LOG(ERROR) << "Could not create directory " << directory;
+      return false;
+    }
+    if (octree_->getRoot() != NULL) {
+      getTileKeysRecurs(octree_->getRoot(), octomap::OcTreeKey(0, 0, 0), 0,
+                        &tiles_to_write);
+    }
+    // Remove the tiles of a previous store in the same directory which are
+    // not overwritten.
+    double old_resolution;
+    unsigned int old_tile_depth;
+    octomap::KeySet old_tile_keys;
+    if (readTileIndex(directory, &old_resolution, &old_tile_depth,
+                      &old_tile_keys)) {
+      for (const octomap::OcTreeKey& tile_key : old_tile_keys) {
+        if (tiles_to_write.count(tile_key) == 0) {
+          std::remove(getTilePath(directory, tile_key).c_str());
+        }
+      }
+    }
+    tiles_in_store = tiles_to_write;
+  }
+
+  for (const octomap::OcTreeKey& tile_key : tiles_to_write) {
+    const std::string path = getTilePath(directory, tile_key);
+    // If the tile is part of a larger pruned node, this returns that node,
+    // which then gets written as a single leaf.
+    const octomap::OcTreeNode* node =
+        octree_->getRoot() == NULL ? NULL
+                                   : octree_->search(tile_key, tile_depth_);
+    if (node == NULL) {
+      std::remove(path.c_str());
+      tiles_in_store.erase(tile_key);
+      continue;
+    }
+    // Replace the tile in one step, so a crash never leaves a partial one.
+    const std::string temporary_path = path + ".tmp";
+    std::ofstream file(temporary_path.c_str(), std::ios_base::out |
+                                                   std::ios_base::binary |
+                                                   std::ios_base::trunc);
+    writeNodesRecurs(node, file);
+    file.close();
+    if (file.fail() ||
+        std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+      LOG(ERROR) << "Could not write tile " << path;
+      return false;
+    }
+    tiles_in_store.insert(tile_key);
+  }
+
+  if (!writeTileIndex(directory, octree_->getResolution(), tile_depth_,
+                      tiles_in_store)) {
+    LOG(ERROR) << "Could not write the tile index of " << directory;
+    return false;
+  }
+  tile_directory_ = directory;
+  stored_tiles_ = tiles_in_store;
+  dirty_tiles_.clear();
+  all_tiles_dirty_ = false;
+  return true;
+}
+
+void OctomapWorld::closeTiledMapStore() {
+  tile_directory_.clear();
+  stored_tiles_.clear();
+  unloaded_tiles_.clear();
+  dirty_tiles_.clear();
+  all_tiles_dirty_ = false;
+}
+
+void OctomapWorld::loadTile(const octomap::OcTreeKey& tile_key) const {
+  std::lock_guard<std::recursive_mutex> lock(lazy_load_mutex_);
+  octomap::KeySet::iterator it = unloaded_tiles_.find(tile_key);
+  if (it == unloaded_tiles_.end()) {
+    return;
+  }
+  unloaded_tiles_.erase(it);
+
+  // Reading a tile only changes which part of the map is in memory, not the
+  // map itself. Copy-on-write clones read their own copy of the tile.
+  OctomapWorld* mutable_this = const_cast<OctomapWorld*>(this);
+  mutable_this->detachOctree(true);
+  const std::string path = getTilePath(tile_directory_, tile_key);
+  std::ifstream file(path.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (!file.is_open() ||
+      !mutable_this->readNodesRecurs(
+          file, mutable_this->createNodeAtDepth(tile_key, tile_depth_))) {
+    LOG(ERROR) << "Could not read tile " << path;
+  }
+
+  // Only the parents of the tile need their inner occupancy updated.
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  std::vector<octomap::OcTreeNode*> parents;
+  octomap::OcTreeNode* node = octree_->getRoot();
+  for (unsigned int level = 0; level < tile_depth_; ++level) {
+    parents.push_back(node);
+    node = octree_->getNodeChild(
+        node, octomap::computeChildIdx(tile_key, tree_depth - 1 - level));
+  }
+  for (std::vector<octomap::OcTreeNode*>::reverse_iterator
+           parent = parents.rbegin();
+       parent != parents.rend(); ++parent) {
+    (*parent)->updateOccupancyChildren();
+  }
+}
+
+void OctomapWorld::loadTilesInKeyRange(
+    const octomap::OcTreeKey& min_key,
+    const octomap::OcTreeKey& max_key) const {
+  std::lock_guard<std::recursive_mutex> lock(lazy_load_mutex_);
+  if (unloaded_tiles_.empty()) {
+    return;
+  }
+  // Tiles overlap the range if their first key, rounded down to the tile
+  // size, lies within the rounded range.
+  const unsigned int shift = octree_->getTreeDepth() - tile_depth_;
+  uint64_t num_tiles_in_range = 1;
+  for (unsigned int i = 0; i < 3; ++i) {
+    num_tiles_in_range *= (max_key[i] >> shift) - (min_key[i] >> shift) + 1;
+  }
+
+  std::vector<octomap::OcTreeKey> tile_keys;
+  if (num_tiles_in_range <= unloaded_tiles_.size()) {
+    for (unsigned int x = min_key[0] >> shift; x <= max_key[0] >> shift; ++x) {
+      for (unsigned int y = min_key[1] >> shift; y <= max_key[1] >> shift;
+           ++y) {
+        for (unsigned int z = min_key[2] >> shift; z <= max_key[2] >> shift;
+             ++z) {
+          tile_keys.push_back(octree_->adjustKeyAtDepth(
+              octomap::OcTreeKey(x << shift, y << shift, z << shift),
+              tile_depth_));
+        }
+      }
+    }
+  } else {
+    for (const octomap::OcTreeKey& tile_key : unloaded_tiles_) {
+      bool overlaps_range = true;
+      for (unsigned int i = 0; i < 3; ++i) {
+        overlaps_range = overlaps_range &&
+                         (tile_key[i] >> shift) >= (min_key[i] >> shift) &&
+                         (tile_key[i] >> shift) <= (max_key[i] >> shift);
+      }
+      if (overlaps_range) {
+        tile_keys.push_back(tile_key);
+      }
+    }
+  }
+  for (const octomap::OcTreeKey& tile_key : tile_keys) {
+    loadTile(tile_key);
+  }
+}
+
+void OctomapWorld::loadAllTiles() const {
+  std::lock_guard<std::recursive_mutex> lock(lazy_load_mutex_);
+  const std::vector<octomap::OcTreeKey> tile_keys(unloaded_tiles_.begin(),
+                                                  unloaded_tiles_.end());
+  for (const octomap::OcTreeKey& tile_key : tile_keys) {
+    loadTile(tile_key);
+  }
+}
+
+void OctomapWorld::loadFullMap() const {
+  std::lock_guard<std::recursive_mutex> lock(lazy_load_mutex_);
+  promoteLinearOctree();
+  loadAllTiles();
+}
+
+void OctomapWorld::markTilesDirty(const octomap::KeySet& keys) {
+  if (tile_directory_.empty()) {
+    return;
+  }
+  for (const octomap::OcTreeKey& key : keys) {
+    dirty_tiles_.insert(octree_->adjustKeyAtDepth(key, tile_depth_));
+  }
+}
+
+void OctomapWorld::markTilesDirtyInKeyRange(const octomap::OcTreeKey& min_key,
+                                            const octomap::OcTreeKey& max_key) {
+  if (tile_directory_.empty()) {
+    return;
+  }
+  const unsigned int shift = octree_->getTreeDepth() - tile_depth_;
+  for (unsigned int x = min_key[0] >> shift; x <= max_key[0] >> shift; ++x) {
+    for (unsigned int y = min_key[1] >> shift; y <= max_key[1] >> shift; ++y) {
+      for (unsigned int z = min_key[2] >> shift; z <= max_key[2] >> shift;
+           ++z) {
+        dirty_tiles_.insert(octree_->adjustKeyAtDepth(
+            octomap::OcTreeKey(x << shift, y << shift, z << shift),
+            tile_depth_));
+      }
+    }
+  }
+}
+
+void OctomapWorld::markUnpruned(const octomap::KeySet& keys) {
+  const unsigned int depth =
+      std::min(kPruneSubtreeDepth, octree_->getTreeDepth());
+  for (const octomap::OcTreeKey& key : keys) {
+    unpruned_subtrees_.insert(octree_->adjustKeyAtDepth(key, depth));
+  }
+}
+
+void OctomapWorld::markUnprunedInKeyRange(const octomap::OcTreeKey& min_key,
+                                          const octomap::OcTreeKey& max_key) {
+  const unsigned int depth =
+      std::min(kPruneSubtreeDepth, octree_->getTreeDepth());
+  const unsigned int shift = octree_->getTreeDepth() - depth;
+  for (unsigned int x = min_key[0] >> shift; x <= max_key[0] >> shift; ++x) {
+    for (unsigned int y = min_key[1] >> shift; y <= max_key[1] >> shift; ++y) {
+      for (unsigned int z = min_key[2] >> shift; z <= max_key[2] >> shift;
+           ++z) {
+        unpruned_subtrees_.insert(octree_->adjustKeyAtDepth(
+            octomap::OcTreeKey(x << shift, y << shift, z << shift), depth));
+      }
+    }
+  }
+}
+
+void OctomapWorld::pruneSubtree(const octomap::OcTreeKey& key,
+                                unsigned int depth) {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  octomap::OcTreeNode* node = octree_->getRoot();
+  std::vector<octomap::OcTreeNode*> parents;
+  for (unsigned int level = 0; node != NULL && level < depth; ++level) {
+    parents.push_back(node);
+    const unsigned int child_index =
+        octomap::computeChildIdx(key, tree_depth - 1 - level);
+    node = octree_->nodeChildExists(node, child_index)
+               ? octree_->getNodeChild(node, child_index)
+               : NULL;
+  }
+  if (node != NULL) {
+    pruneRecurs(node);
+  }
+  for (std::vector<octomap::OcTreeNode*>::reverse_iterator it =
+           parents.rbegin();
+       it != parents.rend(); ++it) {
+    if (!octree_->pruneNode(*it)) {
+      break;
+    }
+  }
+}
+
+void OctomapWorld::pruneRecurs(octomap::OcTreeNode* node) {
+  if (!octree_->nodeHasChildren(node)) {
+    return;
+  }
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (octree_->nodeChildExists(node, i)) {
+      pruneRecurs(octree_->getNodeChild(node, i));
+    }
+  }
+  octree_->pruneNode(node);
+}
+
+void OctomapWorld::pruneLossyRecurs(octomap::OcTreeNode* node,
+                                    float log_odds_tolerance,
+                                    float* min_log_odds, float* max_log_odds,
+                                    bool* full,
+                                    double* max_probability_error) {
+  if (!octree_->nodeHasChildren(node)) {
+    *min_log_odds = node->getLogOdds();
+    *max_log_odds = node->getLogOdds();
+    *full = true;
+    return;
+  }
+
+  *min_log_odds = std::numeric_limits<float>::max();
+  *max_log_odds = -std::numeric_limits<float>::max();
+  *full = true;
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
+      *full = false;
+      continue;
+    }
+    float child_min, child_max;
+    bool child_full;
+    pruneLossyRecurs(octree_->getNodeChild(node, i), log_odds_tolerance,
+                     &child_min, &child_max, &child_full,
+                     max_probability_error);
+    *min_log_odds = std::min(*min_log_odds, child_min);
+    *max_log_odds = std::max(*max_log_odds, child_max);
+    *full = *full && child_full;
+  }
+
+  const float occupancy_threshold_log = octree_->getOccupancyThresLog();
+  const bool same_state = *min_log_odds >= occupancy_threshold_log ||
+                          *max_log_odds < occupancy_threshold_log;
+  if (*full && same_state &&
+      *max_log_odds - *min_log_odds <= log_odds_tolerance) {
+    // The children are leaves here, as they were merged themselves. Giving
+    // them the same value lets pruneNode() delete them along with their array.
+    const float log_odds = (*min_log_odds + *max_log_odds) / 2;
+    for (unsigned int i = 0; i < 8; ++i) {
+      octree_->getNodeChild(node, i)->setLogOdds(log_odds);
+    }
+    octree_->pruneNode(node);
+    const double probability = octomap::probability(log_odds);
+    *max_probability_error = std::max(
+        *max_probability_error,
+        std::max(probability - octomap::probability(*min_log_odds),
+                 octomap::probability(*max_log_odds) - probability));
+  } else {
+    // Merged children may have changed the maximum.
+    node->updateOccupancyChildren();
+  }
+}
+
+void OctomapWorld::getTileKeysRecurs(const octomap::OcTreeNode* node,
+                                     const octomap::OcTreeKey& node_min_key,
+                                     unsigned int depth,
+                                     octomap::KeySet* tile_keys) const {
+  const unsigned int tree_depth = octree_->getTreeDepth();
+  if (depth == tile_depth_) {
+    tile_keys->insert(octree_->adjustKeyAtDepth(node_min_key, tile_depth_));
+    return;
+  }
+  if (!octree_->nodeHasChildren(node)) {
+    // Pruned node above the tile depth, all tiles within it have data.
+    octomap::OcTreeKey max_key;
+    for (unsigned int i = 0; i < 3; ++i) {
+      max_key[i] = node_min_key[i] + (1u << (tree_depth - depth)) - 1;
+    }
+    const unsigned int shift = tree_depth - tile_depth_;
+    for (unsigned int x = node_min_key[0] >> shift; x <= max_key[0] >> shift;
+         ++x) {
+      for (unsigned int y = node_min_key[1] >> shift;
+           y <= max_key[1] >> shift; ++y) {
+        for (unsigned int z = node_min_key[2] >> shift;
+             z <= max_key[2] >> shift; ++z) {
+          tile_keys->insert(octree_->adjustKeyAtDepth(
+              octomap::OcTreeKey(x << shift, y << shift, z << shift),
+              tile_depth_));
+        }
+      }
+    }
+    return;
+  }
+
+  const unsigned int child_size = 1u << (tree_depth - depth - 1);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!octree_->nodeChildExists(node, i)) {
+      continue;
+    }
+    // Bit 0 of the child index is x, bit 1 is y and bit 2 is z.
+    octomap::OcTreeKey child_min_key;
+    for (unsigned int j = 0; j < 3; ++j) {
+      child_min_key[j] = node_min_key[j] + (((i >> j) & 1) ? child_size : 0);
+    }
+    getTileKeysRecurs(octree_->getNodeChild(node, i), child_min_key, depth + 1,
+                      tile_keys);
+  }
+}
+
+bool OctomapWorld::openScanJournal(const std::string& filename) {
+  closeScanJournal();
+  if (std::ifstream(filename.c_str()).good()) {
+    // Replays as fast as possible: the inner nodes are only updated and
+    // pruned once at the end instead of after every scan.
+    size_t num_scans = 0;
+    if (!ScanJournal::replay(
+            filename, octree_->getResolution(),
+            [this](octomap::KeySet* free_cells,
+                   octomap::KeySet* occupied_cells) {
+              applyOccupancyUpdate(free_cells, occupied_cells, true);
+            },
+            &num_scans)) {
+      return false;
+    }
+    if (num_scans > 0) {
+      octree_->updateInnerOccupancy();
+      markAllUnpruned();
+      prune();
+      incrementMapVersion();
+    }
+    LOG(INFO) << "Replayed " << num_scans << " scans from " << filename;
+  }
+
+  scan_journal_.reset(new ScanJournal());
+  if (!scan_journal_->open(filename, octree_->getResolution(),
+                           params_.journal_sync_interval)) {
+    scan_journal_.reset();
+    return false;
+  }
+  return true;
+}
+
+void OctomapWorld::closeScanJournal() { scan_journal_.reset(); }
+
+bool OctomapWorld::clearScanJournal() {
+  return scan_journal_ && scan_journal_->clear();
+}
+
+bool OctomapWorld::writeOctomapToBinaryConst(std::ostream& s) const {
+  loadFullMap();
+  return writeBinaryParallel(*octree_, params_.num_threads, s);
+}
+
+bool OctomapWorld::isSpeckleNode(const octomap::OcTreeKey& key) const {
+  octomap::OcTreeKey current_key;
+  // Search neighbors in a +/-1 key range cube. If there are neighbors, it's
+  // not a speckle.
+  bool neighbor_found = false;
+  for (current_key[2] = key[2] - 1; current_key[2] <= key[2] + 1;
+       ++current_key[2]) {
+    for (current_key[1] = key[1] - 1; current_key[1] <= key[1] + 1;
+         ++current_key[1]) {
+      for (current_key[0] = key[0] - 1; current_key[0] <= key[0] + 1;
+           ++current_key[0]) {
+        if (current_key != key) {
+          float log_odds;
+          if (searchLogOdds(key, &log_odds) &&
+              log_odds >= octree_->getOccupancyThresLog()) {
+            // We have a neighbor => not a speckle!
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void OctomapWorld::generateMarkerArray(
+    const std::string& tf_frame,
+    visualization_msgs::MarkerArray* occupied_nodes,
+    visualization_msgs::MarkerArray* free_nodes) {
+  CHECK_NOTNULL(occupied_nodes);
+  CHECK_NOTNULL(free_nodes);
+
+  // Prune the octree first.
+  loadFullMap();
+  prune();
+  int tree_depth = octree_->getTreeDepth() + 1;
+
+  // In the marker array, assign each node to its respective depth level, since
+  // all markers in a CUBE_LIST must have the same scale.
+  occupied_nodes->markers.resize(tree_depth);
+  free_nodes->markers.resize(tree_depth);
+
+  // Metric min and max z of the map:
+  double min_x, min_y, min_z, max_x, max_y, max_z;
+  octree_->getMetricMin(min_x, min_y, min_z);
+  octree_->getMetricMax(max_x, max_y, max_z);
+
+  // Update values from params if necessary.
+  if (params_.visualize_min_z > min_z) {
+    min_z = params_.visualize_min_z;
+  }
+  if (params_.visualize_max_z < max_z) {
+    max_z = params_.visualize_max_z;
+  }
+
+  for (int i = 0; i < tree_depth; ++i) {
+    double size = octree_->getNodeSize(i);
+
+    occupied_nodes->markers[i].header.frame_id = tf_frame;
+    occupied_nodes->markers[i].ns = "map";
+    occupied_nodes->markers[i].id = i;
+    occupied_nodes->markers[i].type = visualization_msgs::Marker::CUBE_LIST;
+    occupied_nodes->markers[i].scale.x = size;
+    occupied_nodes->markers[i].scale.y = size;
+    occupied_nodes->markers[i].scale.z = size;
+
+    free_nodes->markers[i] = occupied_nodes->markers[i];
+  }
+
+  for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs(),
+                                      end = octree_->end_leafs();
        it != end; ++it) {
     geometry_msgs::Point cube_center;
     cube_center.x = it.getX();
@@ -970,6 +2878,9 @@ void OctomapWorld::convertUnknownToFree() {
 
 void OctomapWorld::convertUnknownToFree(const Eigen::Vector3d& min_bound,
                                         const Eigen::Vector3d& max_bound) {
+  loadFullMap();
+  detachOctree(true);
+  markAllTilesDirty();
   const bool lazy_eval = true;
   const double log_odds_value = octree_->getClampingThresMinLog();
   const double resolution = octree_->getResolution();
@@ -994,13 +2905,20 @@ void OctomapWorld::convertUnknownToFree(const Eigen::Vector3d& min_bound,
   if (lazy_eval) {
     octree_->updateInnerOccupancy();
   }
-  octree_->prune();
+  octomap::OcTreeKey min_key, max_key;
+  getKeyRange(min_bound, max_bound, &min_key, &max_key);
+  markUnprunedInKeyRange(min_key, max_key);
+  prune();
+  incrementMapVersion();
 }
 
 void OctomapWorld::inflateOccupied(const Eigen::Vector3d& safety_space) {
   // Inflate all obstacles by safety_space, such that if a collision free
   // trajectory is generated in this new space, it is guaranteed that
   // safety_space around this trajectory is collision free in the original space
+  loadFullMap();
+  detachOctree(true);
+  markAllTilesDirty();
   const bool lazy_eval = true;
   const double log_odds_value = octree_->getClampingThresMaxLog();
   const double resolution = octree_->getResolution();
@@ -1145,7 +3063,9 @@ void OctomapWorld::inflateOccupied(const Eigen::Vector3d& safety_space) {
   if (lazy_eval) {
     octree_->updateInnerOccupancy();
   }
-  octree_->prune();
+  markUnpruned(occupied_keys);
+  prune();
+  incrementMapVersion();
 }
 
 void OctomapWorld::getKeysBoundingBox(
@@ -1291,37 +3211,81 @@ std_msgs::ColorRGBA OctomapWorld::percentToColor(double h) const {
 }
 
 Eigen::Vector3d OctomapWorld::getMapCenter() const {
-  // Metric min and max z of the map:
-  double min_x, min_y, min_z, max_x, max_y, max_z;
-  octree_->getMetricMin(min_x, min_y, min_z);
-  octree_->getMetricMax(max_x, max_y, max_z);
-
-  Eigen::Vector3d min_3d(min_x, min_y, min_z);
-  Eigen::Vector3d max_3d(max_x, max_y, max_z);
-
+  Eigen::Vector3d min_3d, max_3d;
+  getMapBounds(&min_3d, &max_3d);
   return min_3d + (max_3d - min_3d) / 2;
 }
 
 Eigen::Vector3d OctomapWorld::getMapSize() const {
-  // Metric min and max z of the map:
-  double min_x, min_y, min_z, max_x, max_y, max_z;
-  octree_->getMetricMin(min_x, min_y, min_z);
-  octree_->getMetricMax(max_x, max_y, max_z);
-
-  return Eigen::Vector3d(max_x - min_x, max_y - min_y, max_z - min_z);
+  Eigen::Vector3d min_3d, max_3d;
+  getMapBounds(&min_3d, &max_3d);
+  return max_3d - min_3d;
 }
 
 void OctomapWorld::getMapBounds(Eigen::Vector3d* min_bound,
                                 Eigen::Vector3d* max_bound) const {
   CHECK_NOTNULL(min_bound);
   CHECK_NOTNULL(max_bound);
-  // Metric min and max z of the map:
-  double min_x, min_y, min_z, max_x, max_y, max_z;
-  octree_->getMetricMin(min_x, min_y, min_z);
-  octree_->getMetricMax(max_x, max_y, max_z);
+  // The cached bounds are recomputed and read under the lock of lazy loads,
+  // so several threads can call this at once.
+  std::lock_guard<std::recursive_mutex> lock(lazy_load_mutex_);
+  if (linear_octree_) {
+    linear_octree_->getMetricMin(&min_bound->x(), &min_bound->y(),
+                                 &min_bound->z());
+    linear_octree_->getMetricMax(&max_bound->x(), &max_bound->y(),
+                                 &max_bound->z());
+    return;
+  }
 
-  *min_bound = Eigen::Vector3d(min_x, min_y, min_z);
-  *max_bound = Eigen::Vector3d(max_x, max_y, max_z);
+  // Like octomap::OcTree::getMetricMin(), but without iterating over all
+  // leaves after every change.
+  updateMapBounds();
+  if (map_bounds_empty_) {
+    *min_bound = Eigen::Vector3d::Zero();
+    *max_bound = Eigen::Vector3d::Zero();
+    return;
+  }
+  const double half_resolution = octree_->getResolution() / 2;
+  for (unsigned int i = 0; i < 3; ++i) {
+    (*min_bound)[i] = octree_->keyToCoord(map_min_key_[i]) - half_resolution;
+    (*max_bound)[i] = octree_->keyToCoord(map_max_key_[i]) + half_resolution;
+  }
+}
+
+void OctomapWorld::updateMapBounds() const {
+  if (map_bounds_version_ == map_version_) {
+    return;
+  }
+  loadAllTiles();
+  map_bounds_empty_ = (octree_->getRoot() == NULL);
+  if (!map_bounds_empty_) {
+    // The const overloads do not cache the bounds in the octree, which may
+    // be shared with copy-on-write clones.
+    const octomap::OcTree& octree = *octree_;
+    double min_bound[3], max_bound[3];
+    octree.getMetricMin(min_bound[0], min_bound[1], min_bound[2]);
+    octree.getMetricMax(max_bound[0], max_bound[1], max_bound[2]);
+    // Keys of the cells just inside the bounds.
+    const double half_resolution = octree_->getResolution() / 2;
+    for (unsigned int i = 0; i < 3; ++i) {
+      map_min_key_[i] = octree_->coordToKey(min_bound[i] + half_resolution);
+      map_max_key_[i] = octree_->coordToKey(max_bound[i] - half_resolution);
+    }
+  }
+  map_bounds_version_ = map_version_;
+}
+
+void OctomapWorld::extendMapBounds(const octomap::OcTreeKey& key) {
+  if (map_bounds_empty_) {
+    map_min_key_ = key;
+    map_max_key_ = key;
+    map_bounds_empty_ = false;
+    return;
+  }
+  for (unsigned int i = 0; i < 3; ++i) {
+    map_min_key_[i] = std::min(map_min_key_[i], key[i]);
+    map_max_key_[i] = std::max(map_max_key_[i], key[i]);
+  }
 }
 
 bool OctomapWorld::getNearestFreePoint(const Eigen::Vector3d& position,
@@ -1416,6 +3380,7 @@ void OctomapWorld::getChangedPoints(
   CHECK_NOTNULL(changed_points);
   // These keys are always *leaf node* keys, even if the actual change was in
   // a larger cube (see Octomap docs).
+  detachOctree(true);
   octomap::KeyBoolMap::const_iterator start_key = octree_->changedKeysBegin();
   octomap::KeyBoolMap::const_iterator end_key = octree_->changedKeysEnd();
 
@@ -1439,6 +3404,19 @@ void OctomapWorld::getChangedPoints(
   octree_->resetChangeDetection();
 }
 
+void OctomapWorld::enableChangeDetection() {
+  detachOctree(true);
+  // Also kept in the parameters, so it survives replacing the octree.
+  params_.change_detection_enabled = true;
+  octree_->enableChangeDetection(true);
+}
+
+void OctomapWorld::disableChangeDetection() {
+  detachOctree(true);
+  params_.change_detection_enabled = false;
+  octree_->enableChangeDetection(false);
+}
+
 void OctomapWorld::coordToKey(const Eigen::Vector3d& coord,
                               octomap::OcTreeKey* key) const {
   octomap::point3d position(coord.x(), coord.y(), coord.z());
@@ -0,0 +1,267 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/octree_serialization.h"
+
+#include <cstdint>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "octomap_world/parallel_for.h"
+
+namespace volumetric_mapping {
+
+namespace {
+
+// Subtrees per thread, so threads that finish early can take over the
+// remaining ones.
+const size_t kMinChunksPerThread = 8;
+// Deeper subtrees are too small to be worth splitting the tree further.
+const unsigned int kMaxChunkDepth = 8;
+
+// Finds the depth at which the tree is split, and all nodes at that depth in
+// depth-first order. Returns 0 if the tree is not split.
+unsigned int getChunkNodes(const octomap::OcTree& tree, int num_threads,
+                           std::vector<const octomap::OcTreeNode*>* nodes) {
+  CHECK_NOTNULL(nodes);
+  nodes->clear();
+  if (tree.getRoot() == NULL || num_threads <= 1) {
+    return 0;
+  }
+  const size_t min_chunks = kMinChunksPerThread * num_threads;
+  // Appending the children of every node in order keeps the nodes of each
+  // level in depth-first order.
+  std::vector<const octomap::OcTreeNode*> level(1, tree.getRoot());
+  unsigned int depth = 0;
+  while (level.size() < min_chunks && depth < kMaxChunkDepth) {
+    std::vector<const octomap::OcTreeNode*> children;
+    for (const octomap::OcTreeNode* node : level) {
+      for (unsigned int i = 0; i < 8; ++i) {
+        if (tree.nodeChildExists(node, i)) {
+          children.push_back(tree.getNodeChild(node, i));
+        }
+      }
+    }
+    if (children.empty()) {
+      break;
+    }
+    level.swap(children);
+    ++depth;
+  }
+  if (depth > 0) {
+    nodes->swap(level);
+  }
+  return depth;
+}
+
+// Two bits per child, the first four children in the first byte: 00 for
+// unknown, 01 for free, 10 for occupied and 11 for inner nodes.
+void appendBinaryChildBits(const octomap::OcTree& tree,
+                           const octomap::OcTreeNode* node,
+                           std::string* output) {
+  uint8_t bits[2] = {0, 0};
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!tree.nodeChildExists(node, i)) {
+      continue;
+    }
+    const octomap::OcTreeNode* child = tree.getNodeChild(node, i);
+    uint8_t child_bits = 1;
+    if (tree.nodeHasChildren(child)) {
+      child_bits = 3;
+    } else if (tree.isNodeOccupied(child)) {
+      child_bits = 2;
+    }
+    bits[i / 4] |= child_bits << (2 * (i % 4));
+  }
+  output->append(reinterpret_cast<const char*>(bits), sizeof(bits));
+}
+
+void appendBinaryNodesRecurs(const octomap::OcTree& tree,
+                             const octomap::OcTreeNode* node,
+                             std::string* output) {
+  appendBinaryChildBits(tree, node, output);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (tree.nodeChildExists(node, i)) {
+      const octomap::OcTreeNode* child = tree.getNodeChild(node, i);
+      if (tree.nodeHasChildren(child)) {
+        appendBinaryNodesRecurs(tree, child, output);
+      }
+    }
+  }
+}
+
+// Writes the nodes above chunk_depth, inserting the encoded chunks in place
+// of the nodes at chunk_depth.
+void appendBinaryTopNodesRecurs(const octomap::OcTree& tree,
+                                const octomap::OcTreeNode* node,
+                                unsigned int depth, unsigned int chunk_depth,
+                                const std::vector<std::string>& chunks,
+                                size_t* next_chunk, std::string* output) {
+  appendBinaryChildBits(tree, node, output);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!tree.nodeChildExists(node, i)) {
+      continue;
+    }
+    const octomap::OcTreeNode* child = tree.getNodeChild(node, i);
+    if (depth + 1 == chunk_depth) {
+      output->append(chunks[(*next_chunk)++]);
+    } else if (tree.nodeHasChildren(child)) {
+      appendBinaryTopNodesRecurs(tree, child, depth + 1, chunk_depth, chunks,
+                                 next_chunk, output);
+    }
+  }
+}
+
+// Log-odds, then one bit per existing child.
+void appendFullNode(const octomap::OcTree& tree,
+                    const octomap::OcTreeNode* node, std::string* output) {
+  const float log_odds = node->getLogOdds();
+  output->append(reinterpret_cast<const char*>(&log_odds), sizeof(log_odds));
+  char children = 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (tree.nodeChildExists(node, i)) {
+      children |= (1 << i);
+    }
+  }
+  output->push_back(children);
+}
+
+void appendFullNodesRecurs(const octomap::OcTree& tree,
+                           const octomap::OcTreeNode* node,
+                           std::string* output) {
+  appendFullNode(tree, node, output);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (tree.nodeChildExists(node, i)) {
+      appendFullNodesRecurs(tree, tree.getNodeChild(node, i), output);
+    }
+  }
+}
+
+void appendFullTopNodesRecurs(const octomap::OcTree& tree,
+                              const octomap::OcTreeNode* node,
+                              unsigned int depth, unsigned int chunk_depth,
+                              const std::vector<std::string>& chunks,
+                              size_t* next_chunk, std::string* output) {
+  appendFullNode(tree, node, output);
+  for (unsigned int i = 0; i < 8; ++i) {
+    if (!tree.nodeChildExists(node, i)) {
+      continue;
+    }
+    if (depth + 1 == chunk_depth) {
+      output->append(chunks[(*next_chunk)++]);
+    } else {
+      appendFullTopNodesRecurs(tree, tree.getNodeChild(node, i), depth + 1,
+                               chunk_depth, chunks, next_chunk, output);
+    }
+  }
+}
+
+size_t getTotalSize(const std::vector<std::string>& chunks) {
+  size_t size = 0;
+  for (const std::string& chunk : chunks) {
+    size += chunk.size();
+  }
+  return size;
+}
+
+}  // namespace
+
+void writeBinaryDataParallel(const octomap::OcTree& tree, int num_threads,
+                             std::string* output) {
+  CHECK_NOTNULL(output);
+  if (tree.getRoot() == NULL) {
+    return;
+  }
+  std::vector<const octomap::OcTreeNode*> chunk_nodes;
+  const unsigned int chunk_depth =
+      getChunkNodes(tree, num_threads, &chunk_nodes);
+  if (chunk_depth == 0) {
+    appendBinaryNodesRecurs(tree, tree.getRoot(), output);
+    return;
+  }
+
+  std::vector<std::string> chunks(chunk_nodes.size());
+  parallelFor(chunk_nodes.size(), num_threads, [&](size_t i) {
+    // Leaves are fully described by the child bits of their parent.
+    if (tree.nodeHasChildren(chunk_nodes[i])) {
+      appendBinaryNodesRecurs(tree, chunk_nodes[i], &chunks[i]);
+    }
+  });
+
+  output->reserve(output->size() + getTotalSize(chunks));
+  size_t next_chunk = 0;
+  appendBinaryTopNodesRecurs(tree, tree.getRoot(), 0, chunk_depth, chunks,
+                             &next_chunk, output);
+  CHECK_EQ(next_chunk, chunks.size());
+}
+
+void writeFullDataParallel(const octomap::OcTree& tree, int num_threads,
+                           std::string* output) {
+  CHECK_NOTNULL(output);
+  if (tree.getRoot() == NULL) {
+    return;
+  }
+  std::vector<const octomap::OcTreeNode*> chunk_nodes;
+  const unsigned int chunk_depth =
+      getChunkNodes(tree, num_threads, &chunk_nodes);
+  if (chunk_depth == 0) {
+    appendFullNodesRecurs(tree, tree.getRoot(), output);
+    return;
+  }
+
+  std::vector<std::string> chunks(chunk_nodes.size());
+  parallelFor(chunk_nodes.size(), num_threads, [&](size_t i) {
+    appendFullNodesRecurs(tree, chunk_nodes[i], &chunks[i]);
+  });
+
+  output->reserve(output->size() + getTotalSize(chunks));
+  size_t next_chunk = 0;
+  appendFullTopNodesRecurs(tree, tree.getRoot(), 0, chunk_depth, chunks,
+                           &next_chunk, output);
+  CHECK_EQ(next_chunk, chunks.size());
+}
+
+bool writeBinaryParallel(const octomap::OcTree& tree, int num_threads,
+                         std::ostream& s) {
+  // Same header as OcTree::writeBinaryConst().
+  s << "# Octomap OcTree binary file\n# (feel free to add / change comments, "
+       "but leave the first line as it is!)\n#\n";
+  s << "id " << tree.getTreeType() << std::endl;
+  s << "size " << tree.size() << std::endl;
+  s << "res " << tree.getResolution() << std::endl;
+  s << "data" << std::endl;
+
+  std::string data;
+  writeBinaryDataParallel(tree, num_threads, &data);
+  s.write(data.data(), data.size());
+  return s.good();
+}
+
+}  // namespace volumetric_mapping
@@ -0,0 +1,169 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <octomap/octomap.h>
+
+#include "octomap_world/octree_serialization.h"
+
+DEFINE_string(input_file, "",
+              "Octomap .bt or .ot file to serialize. If empty, a random map "
+              "is generated instead.");
+DEFINE_int32(num_random_points, 1000000,
+             "Number of random occupied points of the generated map.");
+DEFINE_double(random_extent, 50.0,
+              "Side length in meters of the cube of the generated map.");
+DEFINE_double(resolution, 0.15, "Resolution of the generated map in meters.");
+DEFINE_int32(num_threads, 0, "Number of threads, 0 for all cores.");
+DEFINE_int32(num_repetitions, 5,
+             "Number of times each writer is run; the fastest run counts.");
+
+namespace {
+
+// Returns the fastest of FLAGS_num_repetitions runs of write in seconds.
+// output holds the result of the last run.
+double timeWriter(const std::function<void(std::string*)>& write,
+                  std::string* output) {
+  double best_seconds = std::numeric_limits<double>::max();
+  for (int i = 0; i < std::max(FLAGS_num_repetitions, 1); ++i) {
+    output->clear();
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    write(output);
+    best_seconds = std::min(
+        best_seconds, std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count());
+  }
+  return best_seconds;
+}
+
+void reportSpeedup(const std::string& name, double serial_seconds,
+                   double parallel_seconds, const std::string& serial_data,
+                   const std::string& parallel_data, int num_threads) {
+  LOG(INFO) << name << ": " << serial_data.size() << " bytes, octomap "
+            << serial_seconds << " s, parallel " << parallel_seconds
+            << " s on " << num_threads << " threads (speedup "
+            << serial_seconds / std::max(parallel_seconds, 1e-9) << ").";
+  if (serial_data != parallel_data) {
+    LOG(ERROR) << name << ": the parallel output differs from octomap's.";
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InstallFailureSignalHandler();
+  FLAGS_alsologtostderr = true;
+
+  std::unique_ptr<octomap::OcTree> tree;
+  if (!FLAGS_input_file.empty()) {
+    octomap::AbstractOcTree* read_tree =
+        octomap::AbstractOcTree::read(FLAGS_input_file);
+    tree.reset(dynamic_cast<octomap::OcTree*>(read_tree));
+    if (!tree) {
+      LOG(ERROR) << "Could not read an octree from " << FLAGS_input_file;
+      delete read_tree;
+      return 1;
+    }
+  } else {
+    tree.reset(new octomap::OcTree(FLAGS_resolution));
+    std::mt19937 generator(0);
+    std::uniform_real_distribution<double> distribution(
+        -FLAGS_random_extent / 2.0, FLAGS_random_extent / 2.0);
+    for (int i = 0; i < FLAGS_num_random_points; ++i) {
+      tree->updateNode(octomap::point3d(distribution(generator),
+                                        distribution(generator),
+                                        distribution(generator)),
+                       true, true);
+    }
+    tree->updateInnerOccupancy();
+  }
+  tree->prune();
+  LOG(INFO) << "Serializing a map of " << tree->size() << " nodes.";
+
+  const int num_threads =
+      FLAGS_num_threads > 0
+          ? FLAGS_num_threads
+          : std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+  std::string serial_data;
+  std::string parallel_data;
+  const double serial_binary_seconds =
+      timeWriter([&tree](std::string* output) {
+        std::ostringstream stream;
+        tree->writeBinaryData(stream);
+        *output = stream.str();
+      }, &serial_data);
+  const double parallel_binary_seconds =
+      timeWriter([&tree, num_threads](std::string* output) {
+        volumetric_mapping::writeBinaryDataParallel(*tree, num_threads, output);
+      }, &parallel_data);
+  reportSpeedup("Binary data", serial_binary_seconds, parallel_binary_seconds,
+                serial_data, parallel_data, num_threads);
+
+  const double serial_full_seconds =
+      timeWriter([&tree](std::string* output) {
+        std::ostringstream stream;
+        tree->writeData(stream);
+        *output = stream.str();
+      }, &serial_data);
+  const double parallel_full_seconds =
+      timeWriter([&tree, num_threads](std::string* output) {
+        volumetric_mapping::writeFullDataParallel(*tree, num_threads, output);
+      }, &parallel_data);
+  reportSpeedup("Full data", serial_full_seconds, parallel_full_seconds,
+                serial_data, parallel_data, num_threads);
+
+  // Decoding is not parallelized, so only octomap's own reader is timed.
+  std::istringstream read_stream;
+  const double read_seconds = timeWriter(
+      [&tree, &serial_data, &read_stream](std::string* output) {
+        read_stream.str(serial_data);
+        read_stream.clear();
+        octomap::OcTree read_tree(tree->getResolution());
+        read_tree.readData(read_stream);
+      },
+      &parallel_data);
+  LOG(INFO) << "Full data: octomap read " << read_seconds << " s.";
+  return 0;
+}
@@ -0,0 +1,582 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/point_cloud_io.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#include <glog/logging.h>
+#include <pcl/io/pcd_io.h>
+
+namespace volumetric_mapping {
+
+namespace {
+
+template <typename T>
+double readAs(const char* data) {
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return static_cast<double>(value);
+}
+
+bool isBlank(const std::string& line) {
+  return line.find_first_not_of(" \t\r") == std::string::npos;
+}
+
+// Enough digits for any size_t.
+const int kCountWidth = 20;
+// Written to disk whenever the buffer exceeds this size.
+const size_t kWriteBufferSize = 1 << 20;
+
+}  // namespace
+
+PointCloudReader::PointCloudReader()
+    : encoding_(Encoding::kAscii),
+      num_points_(0),
+      num_points_read_(0),
+      point_size_(0),
+      num_locations_(0),
+      has_point_origins_(false),
+      has_cloud_origin_(false) {}
+
+bool PointCloudReader::open(const std::string& filename) {
+  filename_ = filename;
+  num_points_ = 0;
+  num_points_read_ = 0;
+  has_point_origins_ = false;
+  has_cloud_origin_ = false;
+  loaded_cloud_.clear();
+  file_.close();
+  file_.clear();
+  file_.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (!file_.is_open()) {
+    LOG(ERROR) << "Could not open " << filename;
+    return false;
+  }
+
+  std::string extension = filename.substr(filename.find_last_of('.') + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 ::tolower);
+  if (extension == "pcd") {
+    return readPcdHeader();
+  } else if (extension == "ply") {
+    return readPlyHeader();
+  }
+  LOG(ERROR) << filename << " is neither a .pcd nor a .ply file.";
+  return false;
+}
+
+bool PointCloudReader::readPoints(size_t max_points,
+                                  std::vector<octomap::point3d>* points,
+                                  std::vector<octomap::point3d>* origins) {
+  CHECK_NOTNULL(points);
+  points->clear();
+  const bool read_origins = origins != NULL && hasOrigins();
+  if (origins != NULL) {
+    origins->clear();
+  }
+  const size_t num_points =
+      std::min(max_points, num_points_ - num_points_read_);
+  points->reserve(num_points);
+  if (read_origins) {
+    origins->reserve(num_points);
+  }
+
+  double values[6];
+  auto add_point = [&]() {
+    for (size_t i = 0; i < num_locations_; ++i) {
+      if (!std::isfinite(values[i])) {
+        return;
+      }
+    }
+    points->emplace_back(values[0], values[1], values[2]);
+    if (read_origins) {
+      origins->push_back(has_point_origins_
+                             ? octomap::point3d(values[3], values[4], values[5])
+                             : cloud_origin_);
+    }
+  };
+
+  switch (encoding_) {
+    case Encoding::kLoaded:
+      for (size_t i = num_points_read_; i < num_points_read_ + num_points;
+           ++i) {
+        values[0] = loaded_cloud_[i].x;
+        values[1] = loaded_cloud_[i].y;
+        values[2] = loaded_cloud_[i].z;
+        add_point();
+      }
+      break;
+    case Encoding::kBinary:
+      buffer_.resize(num_points * point_size_);
+      if (!file_.read(buffer_.data(), buffer_.size())) {
+        LOG(ERROR) << filename_ << " is truncated.";
+        return false;
+      }
+      for (size_t i = 0; i < num_points; ++i) {
+        const char* point = &buffer_[i * point_size_];
+        for (size_t j = 0; j < num_locations_; ++j) {
+          values[j] =
+              readValue(point + locations_[j].offset, locations_[j].type);
+        }
+        add_point();
+      }
+      break;
+    case Encoding::kAscii:
+      for (size_t i = 0; i < num_points; ++i) {
+        std::string line;
+        do {
+          if (!std::getline(file_, line)) {
+            LOG(ERROR) << filename_ << " is truncated.";
+            return false;
+          }
+        } while (isBlank(line));
+        if (!parseAsciiPoint(line, values)) {
+          LOG(ERROR) << "Could not parse point in " << filename_ << ": "
+                     << line;
+          return false;
+        }
+        add_point();
+      }
+      break;
+  }
+  num_points_read_ += num_points;
+  return true;
+}
+
+size_t PointCloudReader::getSize(ValueType type) {
+  switch (type) {
+    case ValueType::kInt8:
+    case ValueType::kUInt8:
+      return 1;
+    case ValueType::kInt16:
+    case ValueType::kUInt16:
+      return 2;
+    case ValueType::kInt32:
+    case ValueType::kUInt32:
+    case ValueType::kFloat32:
+      return 4;
+    case ValueType::kFloat64:
+      return 8;
+  }
+  return 0;
+}
+
+bool PointCloudReader::getPcdValueType(char type, size_t size,
+                                       ValueType* value_type) {
+  CHECK_NOTNULL(value_type);
+  if (type == 'F' && size == 4) {
+    *value_type = ValueType::kFloat32;
+  } else if (type == 'F' && size == 8) {
+    *value_type = ValueType::kFloat64;
+  } else if (type == 'I' && size == 1) {
+    *value_type = ValueType::kInt8;
+  } else if (type == 'I' && size == 2) {
+    *value_type = ValueType::kInt16;
+  } else if (type == 'I' && size == 4) {
+    *value_type = ValueType::kInt32;
+  } else if (type == 'U' && size == 1) {
+    *value_type = ValueType::kUInt8;
+  } else if (type == 'U' && size == 2) {
+    *value_type = ValueType::kUInt16;
+  } else if (type == 'U' && size == 4) {
+    *value_type = ValueType::kUInt32;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool PointCloudReader::getPlyValueType(const std::string& type,
+                                       ValueType* value_type) {
+  CHECK_NOTNULL(value_type);
+  if (type == "char" || type == "int8") {
+    *value_type = ValueType::kInt8;
+  } else if (type == "uchar" || type == "uint8") {
+    *value_type = ValueType::kUInt8;
+  } else if (type == "short" || type == "int16") {
+    *value_type = ValueType::kInt16;
+  } else if (type == "ushort" || type == "uint16") {
+    *value_type = ValueType::kUInt16;
+  } else if (type == "int" || type == "int32") {
+    *value_type = ValueType::kInt32;
+  } else if (type == "uint" || type == "uint32") {
+    *value_type = ValueType::kUInt32;
+  } else if (type == "float" || type == "float32") {
+    *value_type = ValueType::kFloat32;
+  } else if (type == "double" || type == "float64") {
+    *value_type = ValueType::kFloat64;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+double PointCloudReader::readValue(const char* data, ValueType type) {
+  switch (type) {
+    case ValueType::kInt8:
+      return readAs<int8_t>(data);
+    case ValueType::kUInt8:
+      return readAs<uint8_t>(data);
+    case ValueType::kInt16:
+      return readAs<int16_t>(data);
+    case ValueType::kUInt16:
+      return readAs<uint16_t>(data);
+    case ValueType::kInt32:
+      return readAs<int32_t>(data);
+    case ValueType::kUInt32:
+      return readAs<uint32_t>(data);
+    case ValueType::kFloat32:
+      return readAs<float>(data);
+    case ValueType::kFloat64:
+      return readAs<double>(data);
+  }
+  return 0.0;
+}
+
+bool PointCloudReader::readPcdHeader() {
+  std::vector<std::string> names;
+  std::vector<char> types;
+  std::vector<size_t> sizes, counts;
+  size_t width = 0, height = 1;
+  bool has_num_points = false;
+
+  std::string line;
+  while (std::getline(file_, line)) {
+    std::istringstream tokens(line);
+    std::string keyword;
+    if (!(tokens >> keyword) || keyword[0] == '#') {
+      continue;
+    }
+    if (keyword == "FIELDS") {
+      std::string name;
+      while (tokens >> name) {
+        names.push_back(name);
+      }
+    } else if (keyword == "SIZE") {
+      size_t size;
+      while (tokens >> size) {
+        sizes.push_back(size);
+      }
+    } else if (keyword == "TYPE") {
+      char type;
+      while (tokens >> type) {
+        types.push_back(type);
+      }
+    } else if (keyword == "COUNT") {
+      size_t count;
+      while (tokens >> count) {
+        counts.push_back(count);
+      }
+    } else if (keyword == "WIDTH") {
+      tokens >> width;
+    } else if (keyword == "HEIGHT") {
+      tokens >> height;
+    } else if (keyword == "POINTS") {
+      has_num_points = static_cast<bool>(tokens >> num_points_);
+    } else if (keyword == "VIEWPOINT") {
+      double x, y, z;
+      if (tokens >> x >> y >> z) {
+        cloud_origin_ = octomap::point3d(x, y, z);
+        has_cloud_origin_ = true;
+      }
+    } else if (keyword == "DATA") {
+      // The header ends with the DATA line.
+      std::string data;
+      tokens >> data;
+      if (!has_num_points) {
+        num_points_ = width * height;
+      }
+      if (counts.empty()) {
+        counts.assign(names.size(), 1);
+      }
+      if (sizes.size() != names.size() || types.size() != names.size() ||
+          counts.size() != names.size()) {
+        LOG(ERROR) << "Inconsistent fields in PCD header of " << filename_;
+        return false;
+      }
+      std::vector<Field> fields;
+      for (size_t i = 0; i < names.size(); ++i) {
+        Field field;
+        field.name = names[i];
+        field.count = counts[i];
+        if (!getPcdValueType(types[i], sizes[i], &field.type)) {
+          LOG(ERROR) << "Unsupported type of field " << names[i] << " in "
+                     << filename_;
+          return false;
+        }
+        fields.push_back(field);
+      }
+
+      if (data == "ascii") {
+        encoding_ = Encoding::kAscii;
+      } else if (data == "binary") {
+        encoding_ = Encoding::kBinary;
+      } else if (data == "binary_compressed") {
+        // The whole data is compressed in one block, so can not be streamed.
+        file_.close();
+        if (pcl::io::loadPCDFile<pcl::PointXYZ>(filename_, loaded_cloud_) !=
+            0) {
+          return false;
+        }
+        encoding_ = Encoding::kLoaded;
+        num_points_ = loaded_cloud_.size();
+        num_locations_ = 3;
+        return true;
+      } else {
+        LOG(ERROR) << "Unknown PCD data encoding " << data << " in "
+                   << filename_;
+        return false;
+      }
+      return setFields(fields);
+    }
+  }
+  LOG(ERROR) << filename_ << " has no valid PCD header.";
+  return false;
+}
+
+bool PointCloudReader::readPlyHeader() {
+  std::string line, magic;
+  std::getline(file_, line);
+  std::istringstream magic_tokens(line);
+  if (!(magic_tokens >> magic) || magic != "ply") {
+    LOG(ERROR) << filename_ << " has no valid PLY header.";
+    return false;
+  }
+
+  std::vector<Field> fields;
+  std::string format;
+  bool in_vertices = false;
+  bool has_elements = false;
+  while (std::getline(file_, line)) {
+    std::istringstream tokens(line);
+    std::string keyword;
+    if (!(tokens >> keyword)) {
+      continue;
+    }
+    if (keyword == "format") {
+      tokens >> format;
+    } else if (keyword == "element") {
+      std::string name;
+      tokens >> name;
+      // Other elements can be of variable size, so the vertices have to come
+      // first to be read without parsing everything before them.
+      in_vertices = !has_elements && name == "vertex";
+      if (!has_elements && !in_vertices) {
+        LOG(ERROR) << "The first element of " << filename_
+                   << " has to be the vertices.";
+        return false;
+      }
+      if (in_vertices && !(tokens >> num_points_)) {
+        LOG(ERROR) << "Invalid number of vertices in " << filename_;
+        return false;
+      }
+      has_elements = true;
+    } else if (keyword == "property" && in_vertices) {
+      std::string type;
+      Field field;
+      field.count = 1;
+      if (!(tokens >> type >> field.name) ||
+          !getPlyValueType(type, &field.type)) {
+        LOG(ERROR) << "Unsupported vertex property in " << filename_ << ": "
+                   << line;
+        return false;
+      }
+      fields.push_back(field);
+    } else if (keyword == "end_header") {
+      if (format == "ascii") {
+        encoding_ = Encoding::kAscii;
+      } else if (format == "binary_little_endian") {
+        encoding_ = Encoding::kBinary;
+      } else {
+        LOG(ERROR) << "Unsupported PLY format " << format << " of "
+                   << filename_;
+        return false;
+      }
+      return setFields(fields);
+    }
+  }
+  LOG(ERROR) << filename_ << " has no valid PLY header.";
+  return false;
+}
+
+bool PointCloudReader::setFields(const std::vector<Field>& fields) {
+  const char* kNames[6] = {"x", "y", "z", "vp_x", "vp_y", "vp_z"};
+  bool found[6] = {false, false, false, false, false, false};
+  size_t offset = 0, index = 0;
+  for (const Field& field : fields) {
+    for (size_t i = 0; i < 6; ++i) {
+      if (field.name == kNames[i]) {
+        locations_[i].offset = offset;
+        locations_[i].index = index;
+        locations_[i].type = field.type;
+        found[i] = true;
+      }
+    }
+    offset += getSize(field.type) * field.count;
+    index += field.count;
+  }
+  point_size_ = offset;
+
+  if (!found[0] || !found[1] || !found[2]) {
+    LOG(ERROR) << filename_ << " has no x, y and z fields.";
+    return false;
+  }
+  has_point_origins_ = found[3] && found[4] && found[5];
+  num_locations_ = has_point_origins_ ? 6 : 3;
+  return true;
+}
+
+bool PointCloudReader::parseAsciiPoint(const std::string& line,
+                                       double* values) const {
+  size_t max_index = 0;
+  for (size_t i = 0; i < num_locations_; ++i) {
+    max_index = std::max(max_index, locations_[i].index);
+  }
+  const char* token = line.c_str();
+  for (size_t index = 0; index <= max_index; ++index) {
+    char* end;
+    const double value = strtod(token, &end);
+    if (end == token) {
+      return false;
+    }
+    for (size_t i = 0; i < num_locations_; ++i) {
+      if (locations_[i].index == index) {
+        values[i] = value;
+      }
+    }
+    token = end;
+  }
+  return true;
+}
+
+PointCloudWriter::PointCloudWriter() : with_sizes_(false), num_points_(0) {}
+
+PointCloudWriter::~PointCloudWriter() {
+  if (file_.is_open()) {
+    close();
+  }
+}
+
+bool PointCloudWriter::open(const std::string& filename, bool with_sizes) {
+  filename_ = filename;
+  with_sizes_ = with_sizes;
+  num_points_ = 0;
+  count_positions_.clear();
+  buffer_.clear();
+  file_.close();
+  file_.clear();
+  file_.open(filename.c_str(), std::ios_base::out | std::ios_base::binary |
+                                   std::ios_base::trunc);
+  if (!file_.is_open()) {
+    LOG(ERROR) << "Could not open " << filename << " for writing.";
+    return false;
+  }
+
+  std::string extension = filename.substr(filename.find_last_of('.') + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 ::tolower);
+  if (extension == "pcd") {
+    file_ << "# .PCD v0.7 - Point Cloud Data file format\n"
+          << "VERSION 0.7\n";
+    if (with_sizes_) {
+      file_ << "FIELDS x y z size\nSIZE 4 4 4 4\nTYPE F F F F\n"
+            << "COUNT 1 1 1 1\n";
+    } else {
+      file_ << "FIELDS x y z\nSIZE 4 4 4\nTYPE F F F\nCOUNT 1 1 1\n";
+    }
+    file_ << "WIDTH ";
+    writeCountPlaceholder();
+    file_ << "\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS ";
+    writeCountPlaceholder();
+    file_ << "\nDATA binary\n";
+  } else {
+    file_ << "ply\nformat binary_little_endian 1.0\nelement vertex ";
+    writeCountPlaceholder();
+    file_ << "\nproperty float x\nproperty float y\nproperty float z\n";
+    if (with_sizes_) {
+      file_ << "property float size\n";
+    }
+    file_ << "end_header\n";
+  }
+  return file_.good();
+}
+
+bool PointCloudWriter::close() {
+  flush();
+  std::ostringstream count;
+  count << std::setw(kCountWidth) << std::setfill('0') << num_points_;
+  for (const std::streampos& position : count_positions_) {
+    file_.seekp(position);
+    file_ << count.str();
+  }
+  file_.close();
+  if (file_.fail()) {
+    LOG(ERROR) << "Could not write point cloud to " << filename_;
+    return false;
+  }
+  return true;
+}
+
+void PointCloudWriter::addPoint(float x, float y, float z) {
+  const float point[3] = {x, y, z};
+  buffer_.append(reinterpret_cast<const char*>(point), sizeof(point));
+  ++num_points_;
+  if (buffer_.size() >= kWriteBufferSize) {
+    flush();
+  }
+}
+
+void PointCloudWriter::addPoint(float x, float y, float z, float size) {
+  const float point[4] = {x, y, z, size};
+  buffer_.append(reinterpret_cast<const char*>(point), sizeof(point));
+  ++num_points_;
+  if (buffer_.size() >= kWriteBufferSize) {
+    flush();
+  }
+}
+
+void PointCloudWriter::writeCountPlaceholder() {
+  count_positions_.push_back(file_.tellp());
+  file_ << std::string(kCountWidth, '0');
+}
+
+void PointCloudWriter::flush() {
+  file_.write(buffer_.data(), buffer_.size());
+  buffer_.clear();
+}
+
+}  // namespace volumetric_mapping
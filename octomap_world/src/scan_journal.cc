@@ -0,0 +1,285 @@
+/*
+Copyright (c) 2015, Helen Oleynikova, ETH Zurich, Switzerland
+You can contact the author at <helen dot oleynikova at mavt dot ethz dot ch>
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of ETHZ-ASL nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL ETHZ-ASL BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "octomap_world/scan_journal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace volumetric_mapping {
+
+namespace {
+
+// Writes all of data, retrying on partial writes and interrupts.
+bool writeAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+}  // namespace
+
+const char ScanJournal::kMagic[8] = {'V', 'M', 'S', 'C', 'N', 'J', 'N', 'L'};
+const uint32_t ScanJournal::kVersion = 1;
+
+ScanJournal::ScanJournal() : fd_(-1), sync_interval_(1), num_buffered_(0) {}
+
+ScanJournal::~ScanJournal() { close(); }
+
+bool ScanJournal::open(const std::string& filename, double resolution,
+                       unsigned int sync_interval) {
+  close();
+  const int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not open scan journal " << filename << ": "
+               << strerror(errno);
+    return false;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    ::close(fd);
+    return false;
+  }
+  Header header;
+  if (file_stat.st_size == 0) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.resolution = resolution;
+    if (!writeAll(fd, reinterpret_cast<const char*>(&header),
+                  sizeof(header)) ||
+        fdatasync(fd) != 0) {
+      LOG(ERROR) << "Could not write scan journal " << filename;
+      ::close(fd);
+      return false;
+    }
+  } else if (pread(fd, &header, sizeof(header), 0) !=
+                 static_cast<ssize_t>(sizeof(header)) ||
+             memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+             header.version != kVersion || header.resolution != resolution) {
+    LOG(ERROR) << filename << " is not a scan journal of a map with resolution "
+               << resolution;
+    ::close(fd);
+    return false;
+  }
+
+  fd_ = fd;
+  filename_ = filename;
+  sync_interval_ = std::max(sync_interval, 1u);
+  num_buffered_ = 0;
+  buffer_.clear();
+  return true;
+}
+
+void ScanJournal::close() {
+  if (fd_ < 0) {
+    return;
+  }
+  sync();
+  ::close(fd_);
+  fd_ = -1;
+}
+
+bool ScanJournal::append(const octomap::KeySet& free_cells,
+                         const octomap::KeySet& occupied_cells) {
+  if (fd_ < 0) {
+    return false;
+  }
+  const size_t record_start = buffer_.size();
+  RecordHeader record;
+  record.num_free = free_cells.size();
+  record.num_occupied = occupied_cells.size();
+  record.checksum = 0;
+  buffer_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+  const size_t keys_start = buffer_.size();
+  appendKeys(free_cells, &buffer_);
+  appendKeys(occupied_cells, &buffer_);
+  record.checksum = computeChecksum(buffer_.data() + keys_start,
+                                    buffer_.size() - keys_start);
+  buffer_.replace(record_start, sizeof(record),
+                  reinterpret_cast<const char*>(&record), sizeof(record));
+
+  ++num_buffered_;
+  if (num_buffered_ >= sync_interval_) {
+    return sync();
+  }
+  return true;
+}
+
+bool ScanJournal::sync() {
+  if (fd_ < 0) {
+    return false;
+  }
+  if (num_buffered_ == 0) {
+    return true;
+  }
+  const bool success =
+      writeAll(fd_, buffer_.data(), buffer_.size()) && fdatasync(fd_) == 0;
+  if (!success) {
+    LOG(ERROR) << "Could not write scan journal " << filename_ << ": "
+               << strerror(errno);
+  }
+  buffer_.clear();
+  num_buffered_ = 0;
+  return success;
+}
+
+bool ScanJournal::clear() {
+  if (fd_ < 0) {
+    return false;
+  }
+  buffer_.clear();
+  num_buffered_ = 0;
+  if (ftruncate(fd_, sizeof(Header)) != 0 || fdatasync(fd_) != 0) {
+    LOG(ERROR) << "Could not clear scan journal " << filename_ << ": "
+               << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool ScanJournal::replay(const std::string& filename, double resolution,
+                         const ReplayCallback& callback, size_t* num_scans) {
+  CHECK_NOTNULL(num_scans);
+  *num_scans = 0;
+  std::ifstream file(filename.c_str(), std::ios_base::in |
+                                           std::ios_base::binary);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open scan journal " << filename;
+    return false;
+  }
+
+  // Sizes in a partially written record can not be trusted.
+  file.seekg(0, std::ios_base::end);
+  const uint64_t file_size = file.tellg();
+  file.seekg(0, std::ios_base::beg);
+
+  Header header;
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion || header.resolution != resolution) {
+    LOG(ERROR) << filename << " is not a scan journal of a map with resolution "
+               << resolution;
+    return false;
+  }
+
+  const size_t kKeySize = 3 * sizeof(octomap::key_type);
+  RecordHeader record;
+  std::vector<char> keys;
+  // End of the last complete record.
+  uint64_t valid_size = sizeof(header);
+  bool torn = false;
+  while (file.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+    const uint64_t size =
+        (static_cast<uint64_t>(record.num_free) + record.num_occupied) *
+        kKeySize;
+    if (size > file_size - valid_size - sizeof(record)) {
+      torn = true;
+      break;
+    }
+    keys.resize(size);
+    if (!file.read(keys.data(), size) ||
+        computeChecksum(keys.data(), size) != record.checksum) {
+      torn = true;
+      break;
+    }
+    octomap::KeySet free_cells, occupied_cells;
+    readKeys(keys.data(), record.num_free, &free_cells);
+    readKeys(keys.data() + record.num_free * kKeySize, record.num_occupied,
+             &occupied_cells);
+    callback(&free_cells, &occupied_cells);
+    ++(*num_scans);
+    valid_size += sizeof(record) + size;
+  }
+  if (!torn && file.gcount() == 0) {
+    return true;
+  }
+
+  // Scans appended after the torn record would never be replayed.
+  LOG(WARNING) << "Dropping a partially written scan at the end of "
+               << filename;
+  file.close();
+  if (truncate(filename.c_str(), valid_size) != 0) {
+    LOG(ERROR) << "Could not truncate scan journal " << filename << ": "
+               << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+uint32_t ScanJournal::computeChecksum(const char* data, size_t size) {
+  // FNV-1a.
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void ScanJournal::appendKeys(const octomap::KeySet& keys,
+                             std::string* buffer) {
+  CHECK_NOTNULL(buffer);
+  for (const octomap::OcTreeKey& key : keys) {
+    buffer->append(reinterpret_cast<const char*>(key.k),
+                   3 * sizeof(octomap::key_type));
+  }
+}
+
+void ScanJournal::readKeys(const char* data, size_t num_keys,
+                           octomap::KeySet* keys) {
+  CHECK_NOTNULL(keys);
+  keys->reserve(num_keys);
+  octomap::OcTreeKey key;
+  for (size_t i = 0; i < num_keys; ++i) {
+    memcpy(&key.k[0], data, 3 * sizeof(octomap::key_type));
+    keys->insert(key);
+    data += 3 * sizeof(octomap::key_type);
+  }
+}
+
+}  // namespace volumetric_mapping